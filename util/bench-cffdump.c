@@ -0,0 +1,215 @@
+/*
+ * Copyright (c) 2012 Rob Clark <robdclark@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* Benchmark for cffdump's decoding throughput: writes a synthetic capture
+ * of register writes, constants and raw packets, and times how fast each
+ * of the given cffdump binaries gets through it, in MB/s of cmdstream:
+ *
+ *   make bench-cffdump && ./bench-cffdump ./cffdump /path/to/old/cffdump
+ *
+ * Extra arguments to cffdump (ie. -j 4) can be given after a "--".
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/wait.h>
+
+#include "redump.h"
+#include "adreno_pm4types.h"
+
+#define CAPTURE     "bench-cffdump.rd"
+#define SUBMITS     64
+#define IB_DWORDS   (256 * 1024)
+#define IB_GPUADDR  0x10000000
+
+static void section(FILE *f, uint32_t type, const void *data, uint32_t sz)
+{
+	uint32_t hdr[2] = { type, sz };
+	fwrite(hdr, sizeof(hdr), 1, f);
+	fwrite(data, sz, 1, f);
+}
+
+static uint32_t rnd(void)
+{
+	/* xorshift, so the capture is the same every time: */
+	static uint32_t state = 2463534242u;
+	state ^= state << 13;
+	state ^= state >> 17;
+	state ^= state << 5;
+	return state;
+}
+
+/* a mix of what real cmdstreams mostly are: */
+static int fill_ib(uint32_t *ib, int max)
+{
+	int n = 0;
+
+	while (n < (max - 64)) {
+		int i, count = 1 + rnd() % 16;
+		float f;
+
+		switch (rnd() % 4) {
+		case 0:
+		case 1:
+			/* type-0 register writes, mostly to named registers: */
+			ib[n++] = ((count - 1) << 16) | (0x2000 + rnd() % 0x300);
+			for (i = 0; i < count; i++)
+				ib[n++] = (rnd() & 1) ? rnd() : (rnd() & 0xff);
+			break;
+		case 2:
+			/* CP_MEM_WRITE, dumped as floats: */
+			ib[n++] = CP_TYPE3_PKT | (count << 16) | (CP_MEM_WRITE << 8);
+			ib[n++] = IB_GPUADDR;
+			for (i = 0; i < count; i++) {
+				f = (rnd() & 1) ? 0.0 : (float)(rnd() % 1000) / 7.0;
+				memcpy(&ib[n++], &f, sizeof(f));
+			}
+			break;
+		case 3:
+			/* packets which are only hexdumped: */
+			ib[n++] = CP_TYPE3_PKT | ((count - 1) << 16) | (CP_NOP << 8);
+			for (i = 0; i < count; i++)
+				ib[n++] = rnd();
+			break;
+		}
+	}
+
+	return n;
+}
+
+static void write_capture(uint32_t *sizedwords)
+{
+	uint32_t *ib = malloc(IB_DWORDS * 4);
+	uint32_t addr[2];
+	FILE *f;
+	int i;
+
+	f = fopen(CAPTURE, "w");
+	if (!f) {
+		fprintf(stderr, "could not open: %s\n", CAPTURE);
+		exit(1);
+	}
+
+	section(f, RD_TEST, "bench-cffdump", 13);
+
+	*sizedwords = fill_ib(ib, IB_DWORDS);
+
+	for (i = 0; i < SUBMITS; i++) {
+		addr[0] = IB_GPUADDR;
+		addr[1] = *sizedwords * 4;
+		section(f, RD_GPUADDR, addr, sizeof(addr));
+		section(f, RD_BUFFER_CONTENTS, ib, *sizedwords * 4);
+		addr[1] = *sizedwords;
+		section(f, RD_CMDSTREAM_ADDR, addr, sizeof(addr));
+	}
+
+	fclose(f);
+	free(ib);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+static double run(const char *cffdump, char **extra, int nextra)
+{
+	char *argv[nextra + 3];
+	double t;
+	int status;
+	pid_t pid;
+
+	argv[0] = (char *)cffdump;
+	memcpy(&argv[1], extra, nextra * sizeof(argv[0]));
+	argv[nextra + 1] = CAPTURE;
+	argv[nextra + 2] = NULL;
+
+	t = now();
+	pid = fork();
+	if (pid == 0) {
+		int fd = open("/dev/null", O_WRONLY);
+		dup2(fd, STDOUT_FILENO);
+		dup2(fd, STDERR_FILENO);
+		execv(cffdump, argv);
+		_exit(127);
+	}
+	waitpid(pid, &status, 0);
+	t = now() - t;
+
+	if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+		fprintf(stderr, "%s failed\n", cffdump);
+		return -1;
+	}
+
+	return t;
+}
+
+int main(int argc, char **argv)
+{
+	char **extra = NULL;
+	uint32_t sizedwords;
+	double mb;
+	int i, j, n = argc, nextra = 0;
+
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--")) {
+			n = i;
+			extra = &argv[i + 1];
+			nextra = argc - i - 1;
+			break;
+		}
+	}
+
+	write_capture(&sizedwords);
+	mb = (double)sizedwords * 4 * SUBMITS / (1024 * 1024);
+
+	printf("%d submits, %.1f MB of cmdstream\n", SUBMITS, mb);
+
+	for (i = 1; i < ((n > 1) ? n : 2); i++) {
+		const char *cffdump = (n > 1) ? argv[i] : "./cffdump";
+		double best = 0;
+
+		/* best of three: */
+		for (j = 0; j < 3; j++) {
+			double t = run(cffdump, extra, nextra);
+			if (t < 0)
+				break;
+			if (!best || (t < best))
+				best = t;
+		}
+
+		if (best > 0)
+			printf("%-30s %8.3f s, %8.1f MB/s\n", cffdump, best, mb / best);
+	}
+
+	unlink(CAPTURE);
+
+	return 0;
+}
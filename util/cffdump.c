@@ -24,14 +24,20 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <string.h>
+#include <ctype.h>
+#include <math.h>
+#include <pthread.h>
 
 #include "redump.h"
 #include "disasm.h"
+#include "rd.h"
+#include "ioctls.h"
 
 
 /* ************************************************************************* */
@@ -45,6 +51,21 @@ typedef enum {
 } bool;
 
 static bool dump_shaders = false;
+static bool dump_ioctls = false;
+static bool latency = false;
+static bool delta = false;
+static int snapshot_every = 100;
+static bool stats = false;
+static bool csv = false;
+static bool redundant = false;
+static bool expand_ibs = false;
+
+/* --format=, text unless otherwise asked for: */
+static enum {
+	FORMAT_TEXT,
+	FORMAT_JSONL,
+	FORMAT_BIN,
+} format = FORMAT_TEXT;
 
 static const char *levels[] = {
 		"\t",
@@ -64,6 +85,104 @@ static const char *levels[] = {
 		"x",
 };
 
+/*
+ * Output: the bulk of what cffdump prints is rows of hex dwords and
+ * register values, so those are formatted by hand into a line buffer and
+ * written with a single fwrite(), rather than a printf() per dword.  They
+ * still go through stdio, so they stay in order with everything else.
+ *
+ * Everything is written to 'out', which is stdout except in the -j worker
+ * threads, which each decode into a buffer of their own.
+ */
+
+static __thread FILE *out;
+
+static char hex_pairs[256][2];
+static int level_len[ARRAY_SIZE(levels)];
+
+static void init_output(void)
+{
+	static const char digits[] = "0123456789abcdef";
+	int i;
+
+	for (i = 0; i < 256; i++) {
+		hex_pairs[i][0] = digits[i >> 4];
+		hex_pairs[i][1] = digits[i & 0xf];
+	}
+
+	for (i = 0; i < ARRAY_SIZE(levels); i++)
+		level_len[i] = strlen(levels[i]);
+
+	out = stdout;
+
+	/* unless someone is watching, write in big chunks: */
+	if (!isatty(STDOUT_FILENO))
+		setvbuf(stdout, NULL, _IOFBF, 1024 * 1024);
+}
+
+/* %08x: */
+static char *put_hex32(char *p, uint32_t val)
+{
+	memcpy(p + 0, hex_pairs[(val >> 24) & 0xff], 2);
+	memcpy(p + 2, hex_pairs[(val >> 16) & 0xff], 2);
+	memcpy(p + 4, hex_pairs[(val >>  8) & 0xff], 2);
+	memcpy(p + 6, hex_pairs[(val >>  0) & 0xff], 2);
+	return p + 8;
+}
+
+/* %04x, for values that fit: */
+static char *put_hex16(char *p, uint32_t val)
+{
+	memcpy(p + 0, hex_pairs[(val >> 8) & 0xff], 2);
+	memcpy(p + 2, hex_pairs[(val >> 0) & 0xff], 2);
+	return p + 4;
+}
+
+/* %u: */
+static char *put_udec(char *p, uint32_t u)
+{
+	char tmp[12];
+	int n = 0;
+
+	do {
+		tmp[n++] = '0' + (u % 10);
+		u /= 10;
+	} while (u);
+
+	while (n)
+		*p++ = tmp[--n];
+
+	return p;
+}
+
+/* %d: */
+static char *put_dec(char *p, int32_t val)
+{
+	if (val < 0) {
+		*p++ = '-';
+		return put_udec(p, -(uint32_t)val);
+	}
+	return put_udec(p, val);
+}
+
+static char *put_str(char *p, const char *str)
+{
+	int len = strlen(str);
+	memcpy(p, str, len);
+	return p + len;
+}
+
+static char *put_level(char *p, int level)
+{
+	memcpy(p, levels[level], level_len[level]);
+	return p + level_len[level];
+}
+
+static void put_line(const char *line, const char *end)
+{
+	fwrite(line, 1, end - line, out);
+}
+
 #define NAME(x)	[x] = #x
 
 static const char *event_name[] = {
@@ -146,14 +265,43 @@ static const char *stencil_op[8] = {
 };
 
 static void dump_commands(uint32_t *dwords, uint32_t sizedwords, int level);
+static void shadow_commands(uint32_t *dwords, uint32_t sizedwords);
 
 struct buffer {
 	void *hostptr;
 	unsigned int gpuaddr, len;
+	uint64_t hash;
+	bool hashed;
+	bool owned;         /* otherwise hostptr points into the mmap'd file */
+	int submit;         /* last submit this buffer was part of */
 };
 
-static struct buffer buffers[32];
-static int nbuffers;
+/* buffer contents are kept around across submits, since a later submit
+ * can refer back to them with RD_BUFFER_REF.  Only the buffers that are
+ * part of the current submit are visible to gpuaddr()/hostptr().
+ *
+ * All of the buffers are kept sorted by gpuaddr, and the visible ones are
+ * indexed by gpuaddr and by hostptr for the address translation, which is
+ * done a lot (ie. for each line of dump_hex()).  The index is rebuilt
+ * lazily, when the set of visible buffers might have changed.
+ *
+ * The index (and the current submit) is per-thread: the -j workers each
+ * get their own, built from a snapshot of the visible buffers, so they
+ * never look at buffers[] while the main thread carries on changing it.
+ */
+static struct buffer *buffers;
+static int nbuffers, maxbuffers;
+static __thread int submit;
+
+static __thread struct buffer **by_gpuaddr, **by_hostptr;
+static __thread int nvisible;
+static __thread int visible_submit = -1;     /* submit the index was built for */
+static __thread struct buffer *last_gpuaddr, *last_hostptr;
+
+static void buffers_changed(void)
+{
+	visible_submit = -1;
+}
 
 static int buffer_contains_gpuaddr(struct buffer *buf, uint32_t gpuaddr, uint32_t len)
 {
@@ -165,57 +313,294 @@ static int buffer_contains_hostptr(struct buffer *buf, void *hostptr)
 	return (buf->hostptr <= hostptr) && (hostptr < (buf->hostptr + buf->len));
 }
 
+static int cmp_hostptr(const void *a, const void *b)
+{
+	const struct buffer *x = *(struct buffer * const *)a;
+	const struct buffer *y = *(struct buffer * const *)b;
+	return (x->hostptr > y->hostptr) - (x->hostptr < y->hostptr);
+}
+
+static void index_visible(void)
+{
+	int i;
+
+	if (visible_submit == submit)
+		return;
+
+	by_gpuaddr = realloc(by_gpuaddr, (maxbuffers + 1) * sizeof(by_gpuaddr[0]));
+	by_hostptr = realloc(by_hostptr, (maxbuffers + 1) * sizeof(by_hostptr[0]));
+
+	/* buffers[] is already in gpuaddr order: */
+	nvisible = 0;
+	for (i = 0; i < nbuffers; i++)
+		if (buffers[i].submit == submit)
+			by_gpuaddr[nvisible++] = &buffers[i];
+
+	memcpy(by_hostptr, by_gpuaddr, nvisible * sizeof(by_hostptr[0]));
+	qsort(by_hostptr, nvisible, sizeof(by_hostptr[0]), cmp_hostptr);
+
+	last_gpuaddr = last_hostptr = NULL;
+	visible_submit = submit;
+}
+
 #define GET_PM4_TYPE3_OPCODE(x) ((*(x) >> 8) & 0xFF)
 #define GET_PM4_TYPE0_REGIDX(x) ((*(x)) & 0x7FFF)
 
+/* the visible buffer containing hostptr, if any: */
+static struct buffer *lookup_hostptr(void *hostptr)
+{
+	int lo = 0, hi;
+
+	index_visible();
+
+	/* sequential accesses mostly land in the same buffer: */
+	if (last_hostptr && buffer_contains_hostptr(last_hostptr, hostptr))
+		return last_hostptr;
+
+	/* find the last buffer starting at or before hostptr: */
+	hi = nvisible;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (by_hostptr[mid]->hostptr <= hostptr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (lo && buffer_contains_hostptr(by_hostptr[lo - 1], hostptr))
+		return last_hostptr = by_hostptr[lo - 1];
+
+	return NULL;
+}
+
+/* the visible buffer containing gpuaddr, if any: */
+static struct buffer *lookup_gpuaddr(uint32_t gpuaddr)
+{
+	int lo = 0, hi;
+
+	index_visible();
+
+	if (last_gpuaddr && buffer_contains_gpuaddr(last_gpuaddr, gpuaddr, 0))
+		return last_gpuaddr;
+
+	hi = nvisible;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (by_gpuaddr[mid]->gpuaddr <= gpuaddr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (lo && buffer_contains_gpuaddr(by_gpuaddr[lo - 1], gpuaddr, 0))
+		return last_gpuaddr = by_gpuaddr[lo - 1];
+
+	return NULL;
+}
+
 static uint32_t gpuaddr(void *hostptr)
 {
-	int i;
-	for (i = 0; i < nbuffers; i++)
-		if (buffer_contains_hostptr(&buffers[i], hostptr))
-			return buffers[i].gpuaddr + (hostptr - buffers[i].hostptr);
+	struct buffer *buf = lookup_hostptr(hostptr);
+	if (buf)
+		return buf->gpuaddr + (hostptr - buf->hostptr);
 	return 0;
 }
 
 static void *hostptr(uint32_t gpuaddr)
 {
-	int i;
-	for (i = 0; i < nbuffers; i++)
-		if (buffer_contains_gpuaddr(&buffers[i], gpuaddr, 0))
-			return buffers[i].hostptr + (gpuaddr - buffers[i].gpuaddr);
+	struct buffer *buf = lookup_gpuaddr(gpuaddr);
+	if (buf)
+		return buf->hostptr + (gpuaddr - buf->gpuaddr);
 	return 0;
 }
 
+/* index of the first buffer with gpuaddr >= the given one: */
+static int buffer_index(uint32_t gpuaddr)
+{
+	int lo = 0, hi = nbuffers;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (buffers[mid].gpuaddr < gpuaddr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static struct buffer *find_buffer(uint32_t gpuaddr)
+{
+	int i = buffer_index(gpuaddr);
+	if ((i < nbuffers) && (buffers[i].gpuaddr == gpuaddr))
+		return &buffers[i];
+	return NULL;
+}
+
+static struct buffer *add_buffer(uint32_t gpuaddr)
+{
+	int i = buffer_index(gpuaddr);
+
+	if (nbuffers == maxbuffers) {
+		maxbuffers = maxbuffers ? maxbuffers * 2 : 64;
+		buffers = realloc(buffers, maxbuffers * sizeof(buffers[0]));
+	}
+
+	memmove(&buffers[i + 1], &buffers[i],
+			(nbuffers - i) * sizeof(buffers[0]));
+	memset(&buffers[i], 0, sizeof(buffers[0]));
+	buffers[i].gpuaddr = gpuaddr;
+	nbuffers++;
+
+	/* the index points into buffers[]: */
+	buffers_changed();
+
+	return &buffers[i];
+}
+
+static void buffer_contents(uint32_t gpuaddr, uint32_t len,
+		struct rd_section *sect)
+{
+	struct buffer *buf = find_buffer(gpuaddr);
+
+	if (!buf)
+		buf = add_buffer(gpuaddr);
+
+	if (buf->owned)
+		free(buf->hostptr);
+
+	/* use the contents in place if they stay around, otherwise we
+	 * need our own copy:
+	 */
+	if (sect->persistent) {
+		buf->hostptr = (void *)sect->data;
+		buf->owned = false;
+	} else {
+		buf->hostptr = malloc(sect->size + 1);
+		memcpy(buf->hostptr, sect->data, sect->size);
+		buf->owned = true;
+	}
+
+	buf->gpuaddr = gpuaddr;
+	buf->len = len;
+	buf->hashed = false;
+	buf->submit = submit;
+	buffers_changed();
+}
+
+static void buffer_ref(uint32_t gpuaddr, uint32_t len, uint64_t hash)
+{
+	struct buffer *buf = find_buffer(gpuaddr);
+
+	if (buf && !buf->hashed) {
+		buf->hash = rd_hash(buf->hostptr, buf->len);
+		buf->hashed = true;
+	}
+
+	if (!buf || (buf->len != len) || (buf->hash != hash)) {
+		fprintf(stderr, "could not resolve buffer ref: %08x (%d)\n",
+				gpuaddr, len);
+		return;
+	}
+
+	buf->submit = submit;
+	buffers_changed();
+}
+
+static void buffer_delta(uint32_t gpuaddr, uint32_t len,
+		const uint8_t *data, int sz)
+{
+	struct buffer *buf = find_buffer(gpuaddr);
+	const uint8_t *end = data + sz;
+	uint32_t nruns;
+
+	if (!buf || (buf->len != len) || (sz < 4)) {
+		fprintf(stderr, "could not resolve buffer delta: %08x (%d)\n",
+				gpuaddr, len);
+		return;
+	}
+
+	/* the file is mapped read-only, so copy before patching: */
+	if (!buf->owned) {
+		void *hostptr = malloc(buf->len + 1);
+		memcpy(hostptr, buf->hostptr, buf->len);
+		buf->hostptr = hostptr;
+		buf->owned = true;
+	}
+
+	memcpy(&nruns, data, 4);
+	data += 4;
+
+	while (nruns--) {
+		uint32_t run[2];  /* offset, len */
+
+		if ((end - data) < sizeof(run))
+			break;
+		memcpy(run, data, sizeof(run));
+		data += sizeof(run);
+
+		if (((end - data) < run[1]) || ((run[0] + run[1]) > buf->len)) {
+			fprintf(stderr, "bad buffer delta: %08x (%d)\n", gpuaddr, len);
+			break;
+		}
+
+		memcpy(buf->hostptr + run[0], data, run[1]);
+		data += run[1];
+	}
+
+	buf->hashed = false;
+	buf->submit = submit;
+	buffers_changed();
+}
+
 static void dump_hex(uint32_t *dwords, uint32_t sizedwords, int level)
 {
+	char line[8 + 16 + 8 * 9 + 1];
 	int i;
-	for (i = 0; i < sizedwords; i++) {
-		if ((i % 8) == 0)
-			printf("%08x:%s", gpuaddr(dwords), levels[level]);
-		else
-			printf(" ");
-		printf("%08x", *(dwords++));
-		if ((i % 8) == 7)
-			printf("\n");
+
+	for (i = 0; i < sizedwords; i += 8) {
+		int j, n = ((sizedwords - i) < 8) ? (sizedwords - i) : 8;
+		char *p = line;
+
+		p = put_hex32(p, gpuaddr(dwords));
+		*p++ = ':';
+		p = put_level(p, level);
+		for (j = 0; j < n; j++) {
+			if (j)
+				*p++ = ' ';
+			p = put_hex32(p, *(dwords++));
+		}
+		*p++ = '\n';
+
+		put_line(line, p);
 	}
-	if (i % 8)
-		printf("\n");
 }
 
 static void dump_float(float *dwords, uint32_t sizedwords, int level)
 {
+	char line[8 + 16 + 8 * 64];
 	int i;
-	for (i = 0; i < sizedwords; i++) {
-		if ((i % 8) == 0)
-			printf("%08x:%s", gpuaddr(dwords), levels[level]);
-		else
-			printf(" ");
-		printf("%8f", *(dwords++));
-		if ((i % 8) == 7)
-			printf("\n");
+
+	for (i = 0; i < sizedwords; i += 8) {
+		int j, n = ((sizedwords - i) < 8) ? (sizedwords - i) : 8;
+		char *p = line;
+
+		p = put_hex32(p, gpuaddr(dwords));
+		*p++ = ':';
+		p = put_level(p, level);
+		for (j = 0; j < n; j++) {
+			float f = *(dwords++);
+			if (j)
+				*p++ = ' ';
+			/* zeros are by far the most common: */
+			if (f == 0.0)
+				p = put_str(p, signbit(f) ? "-0.000000" : "0.000000");
+			else
+				p += sprintf(p, "%8f", f);
+		}
+		*p++ = '\n';
+
+		put_line(line, p);
 	}
-	if (i % 8)
-		printf("\n");
 }
 
 /* I believe the surface format is low bits:
@@ -238,19 +623,38 @@ static void parse_dword_addr(uint32_t dword, uint32_t *gpuaddr,
 
 static void reg_hex(const char *name, uint32_t dword, int level)
 {
-	printf("%s%s: %08x (%d)\n", levels[level], name, dword, dword);
+	char line[16 + 128 + 24];
+	char *p = line;
+
+	if (strlen(name) > 128) {
+		fprintf(out, "%s%s: %08x (%d)\n", levels[level], name, dword, dword);
+		return;
+	}
+
+	p = put_level(p, level);
+	p = put_str(p, name);
+	*p++ = ':';
+	*p++ = ' ';
+	p = put_hex32(p, dword);
+	*p++ = ' ';
+	*p++ = '(';
+	p = put_dec(p, dword);
+	*p++ = ')';
+	*p++ = '\n';
+
+	put_line(line, p);
 }
 
 static void reg_float(const char *name, uint32_t dword, int level)
 {
-	printf("%s%s: %f (%08x)\n", levels[level], name, *(float *)&dword, dword);
+	fprintf(out, "%s%s: %f (%08x)\n", levels[level], name, *(float *)&dword, dword);
 }
 
 static void reg_gpuaddr(const char *name, uint32_t dword, int level)
 {
 	uint32_t gpuaddr, flags;
 	parse_dword_addr(dword, &gpuaddr, &flags, 0xfff);
-	printf("%s%s: %08x (%x)\n", levels[level], name, gpuaddr, flags);
+	fprintf(out, "%s%s: %08x (%x)\n", levels[level], name, gpuaddr, flags);
 }
 
 static void reg_rb_copy_dest_info(const char *name, uint32_t dword, int level)
@@ -268,7 +672,7 @@ static void reg_rb_copy_dest_info(const char *name, uint32_t dword, int level)
 	uint32_t dither_mode = (dword >> 10) & 0x3;
 	uint32_t dither_type = (dword >> 12) & 0x3;
 	uint32_t write_mask  = (dword >> 14) & 0xf;
-	printf("%s%s: endian=%s, format=%s, swap=%x, dither-mode=%s, dither-type=%s, write-mask=%x (%08x)\n",
+	fprintf(out, "%s%s: endian=%s, format=%s, swap=%x, dither-mode=%s, dither-type=%s, write-mask=%x (%08x)\n",
 			levels[level], name, endian_name[endian], format_name[format], swap,
 			dither_mode_name[dither_mode], dither_type_name[dither_type],
 			write_mask, dword);
@@ -277,7 +681,7 @@ static void reg_rb_copy_dest_info(const char *name, uint32_t dword, int level)
 static void reg_rb_copy_dest_pitch(const char *name, uint32_t dword, int level)
 {
 	uint32_t p = dword << 5;
-	printf("%s%s: %d (%08x)\n", levels[level], name, p, dword);
+	fprintf(out, "%s%s: %d (%08x)\n", levels[level], name, p, dword);
 }
 
 
@@ -286,7 +690,7 @@ static void reg_pa_su_sc_mode_cntl(const char *name, uint32_t dword, int level)
 	static const char *ptype[] = {
 			"points", "lines", "triangles", "???",
 	};
-	printf("%s%s: %08x (front-ptype=%s, back-ptype=%s, provoking-vtx=%s%s%s%s%s)\n",
+	fprintf(out, "%s%s: %08x (front-ptype=%s, back-ptype=%s, provoking-vtx=%s%s%s%s%s)\n",
 			levels[level], name, dword,
 			ptype[(dword >> 5) & 0x3], ptype[(dword >> 8) & 0x3],
 			(dword & PA_SU_SC_PROVOKING_VTX_LAST) ? "last" : "first",
@@ -312,7 +716,7 @@ static void reg_sq_program_cntl(const char *name, uint32_t dword, int level)
 		vs_regs = 0;
 	if (ps_regs == 0x81)
 		ps_regs = 0;
-	printf("%s%s: %08x (vs-regs=%u, ps-regs=%u, vs-export=%u %s%s%s%s)\n",
+	fprintf(out, "%s%s: %08x (vs-regs=%u, ps-regs=%u, vs-export=%u %s%s%s%s)\n",
 			levels[level], name, dword, vs_regs, ps_regs, vs_export, vtx_mode[vtx],
 			(dword & SQ_PROGRAM_CNTL_VS_RESOURCE) ? ", vs" : "",
 			(dword & SQ_PROGRAM_CNTL_PS_RESOURCE) ? ", ps" : "",
@@ -327,7 +731,7 @@ static const char *gl_func[] = {
 
 static void reg_rb_colorcontrol(const char *name, uint32_t dword, int level)
 {
-	printf("%s%s: %08x (func=%s%s%s%s%s%s, rop=%d, dither-mode=%s, "
+	fprintf(out, "%s%s: %08x (func=%s%s%s%s%s%s, rop=%d, dither-mode=%s, "
 			"dither-type=%s%s)\n", levels[level], name, dword,
 			gl_func[dword & 0x7],
 			(dword & RB_COLORCONTROL_ALPHA_TEST_ENABLE) ? ", alpha-test" : "",
@@ -343,7 +747,7 @@ static void reg_rb_colorcontrol(const char *name, uint32_t dword, int level)
 
 static void reg_rb_depthcontrol(const char *name, uint32_t dword, int level)
 {
-	printf("%s%s: %08x (%s%s%s%szfunc=%s, %ssfunc=%s, sfail=%s, szpass=%s, "
+	fprintf(out, "%s%s: %08x (%s%s%s%szfunc=%s, %ssfunc=%s, sfail=%s, szpass=%s, "
 			"szfail=%s, sfunc-bf=%s, sfail-bf=%s, szpass-bf=%s, szfail-bf=%s)\n",
 			levels[level], name, dword,
 			(dword & RB_DEPTHCONTROL_STENCIL_ENABLE) ? "stencil, " : "",
@@ -369,7 +773,7 @@ static void reg_clear_color(const char *name, uint32_t dword, int level)
 	b = (dword >> 16) & 0xff;
 	g = (dword >>  8) & 0xff;
 	r = (dword >>  0) & 0xff;
-	printf("%s%s: %f %f %f %f\n", levels[level], name,
+	fprintf(out, "%s%s: %f %f %f %f\n", levels[level], name,
 			((float)r) / 255.0, ((float)g) / 255.0,
 			((float)b) / 255.0, ((float)a) / 255.0);
 }
@@ -381,7 +785,7 @@ static void reg_rb_color_info(const char *name, uint32_t dword, int level)
 	 * gmem base assumed 4K aligned.
 	 * BUG_ON(tmp_ctx.gmem_base & 0xFFF);
 	 */
-	printf("%s%s: %08x (%s)\n", levels[level], name, dword,
+	fprintf(out, "%s%s: %08x (%s)\n", levels[level], name, dword,
 			format_name[dword & 0xf]);
 }
 
@@ -396,14 +800,14 @@ static void reg_pa_sc_window_offset(const char *name, uint32_t dword, int level)
 	/* x and y are 15 bit signed numbers: */
 	uint32_t x = (dword >>  0) & 0x7fff;
 	uint32_t y = (dword >> 16) & 0x7fff;
-	printf("%s%s: %d,%d (%08x)\n", levels[level], name, u2i(x, 15), u2i(y, 15), dword);
+	fprintf(out, "%s%s: %d,%d (%08x)\n", levels[level], name, u2i(x, 15), u2i(y, 15), dword);
 }
 
 static void reg_rb_copy_dest_offset(const char *name, uint32_t dword, int level)
 {
 	uint32_t x = (dword >>  0) & 0x3fff;
 	uint32_t y = (dword >> 13) & 0x3fff;
-	printf("%s%s: %d,%d (%08x)\n", levels[level], name, x, y, dword);
+	fprintf(out, "%s%s: %d,%d (%08x)\n", levels[level], name, x, y, dword);
 }
 
 static void reg_xy(const char *name, uint32_t dword, int level)
@@ -414,7 +818,7 @@ static void reg_xy(const char *name, uint32_t dword, int level)
 	uint32_t x = (dword >>  0) & 0x3fff;
 	uint32_t y = (dword >> 16) & 0x3fff;
 	/* bit 31 is WINDOW_OFFSET_DISABLE (at least for TL's): */
-	printf("%s%s: %d,%d%s (%08x)\n", levels[level], name, x, y,
+	fprintf(out, "%s%s: %d,%d%s (%08x)\n", levels[level], name, x, y,
 			(dword & 0x80000000) ? " (WINDOW_OFFSET_DISABLE)" : "", dword);
 }
 
@@ -422,10 +826,25 @@ static void reg_bin_size(const char *name, uint32_t dword, int level)
 {
 	uint32_t x = ((dword >> 0) & 0x1f) * 32;
 	uint32_t y = ((dword >> 5) & 0x1f) * 32;
-	printf("%s%s: %dx%d (%08x)\n", levels[level], name, x, y, dword);
+	fprintf(out, "%s%s: %dx%d (%08x)\n", levels[level], name, x, y, dword);
 }
 
-static uint32_t type0_reg_vals[0x7fff];
+/* last value written to each register, per-thread for -j.  Which of them
+ * have been written at all is kept track of in a bitmap, and the named
+ * ones in a sorted list too, so dumping the current state at each draw
+ * only has to look at those, rather than at all 0x7fff of them:
+ */
+static __thread uint32_t type0_reg_vals[0x7fff];
+static __thread uint32_t type0_reg_written[(0x7fff + 31) / 32];
+static __thread uint16_t type0_reg_list[0x7fff];
+static __thread int type0_reg_count;
+
+/* for --delta, the values as of the last draw, and the number of draws: */
+static __thread uint32_t type0_reg_drawn[0x7fff];
+static __thread int draws;
+
+/* for naming the --dump-shaders files, also per-thread: */
+static __thread int shader_count;
 
 #define REG(x, fxn) [REG_ ## x] = { #x, fxn }
 static const const struct {
@@ -645,15 +1064,91 @@ static const const struct {
 		REG(SQ_DEBUG_MISC_1, reg_hex),
 };
 
+/* has the register been written, ie. is its value known: */
+static bool reg_known(uint32_t regbase)
+{
+	return (regbase < ARRAY_SIZE(type0_reg_vals)) &&
+			(type0_reg_written[regbase / 32] & (1u << (regbase % 32)));
+}
+
+static void reg_write(uint32_t regbase, uint32_t dword)
+{
+	int lo = 0, hi = type0_reg_count;
+
+	if (regbase >= ARRAY_SIZE(type0_reg_vals))
+		return;
+
+	type0_reg_vals[regbase] = dword;
+
+	if (reg_known(regbase))
+		return;
+
+	type0_reg_written[regbase / 32] |= 1u << (regbase % 32);
+
+	if (!type0_reg[regbase].name)
+		return;
+
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (type0_reg_list[mid] < regbase)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	memmove(&type0_reg_list[lo + 1], &type0_reg_list[lo],
+			(type0_reg_count - lo) * sizeof(type0_reg_list[0]));
+	type0_reg_list[lo] = regbase;
+	type0_reg_count++;
+}
+
+/* forget everything written, ie. for a worker starting on a new job: */
+static void reg_reset(void)
+{
+	int i;
+
+	for (i = 0; i < type0_reg_count; i++) {
+		uint32_t regbase = type0_reg_list[i];
+		type0_reg_vals[regbase] = 0;
+		type0_reg_drawn[regbase] = 0;
+	}
+
+	memset(type0_reg_written, 0, sizeof(type0_reg_written));
+
+	type0_reg_count = 0;
+	draws = 0;
+}
+
+static void reg_draw(void)
+{
+	int i;
+
+	for (i = 0; i < type0_reg_count; i++) {
+		uint32_t regbase = type0_reg_list[i];
+		type0_reg_drawn[regbase] = type0_reg_vals[regbase];
+	}
+
+	draws++;
+}
+
 static void dump_registers(uint32_t regbase,
 		uint32_t *dwords, uint32_t sizedwords, int level)
 {
 	while (sizedwords--) {
-		type0_reg_vals[regbase] = *dwords;
+		reg_write(regbase, *dwords);
 		if (type0_reg[regbase].fxn) {
 			type0_reg[regbase].fxn(type0_reg[regbase].name, *dwords, level);
 		} else {
-			printf("%s<%04x>: %08x\n", levels[level], regbase, *dwords);
+			char line[16 + 16], *p = line;
+			p = put_level(p, level);
+			*p++ = '<';
+			p = put_hex16(p, regbase);
+			*p++ = '>';
+			*p++ = ':';
+			*p++ = ' ';
+			p = put_hex32(p, *dwords);
+			*p++ = '\n';
+			put_line(line, p);
 		}
 		regbase++;
 		dwords++;
@@ -681,15 +1176,14 @@ static void cp_im_loadi(uint32_t *dwords, uint32_t sizedwords, int level)
 	default:
 		type = "<unknown>"; break;
 	}
-	printf("%s%s shader, start=%04x, size=%04x\n", levels[level], type, start, size);
+	fprintf(out, "%s%s shader, start=%04x, size=%04x\n", levels[level], type, start, size);
 	disasm(dwords + 2, sizedwords - 2, level+1, disasm_type);
 
 	/* dump raw shader: */
 	if (ext && dump_shaders) {
-		static int n = 0;
 		char filename[8];
 		int fd;
-		sprintf(filename, "%04d.%s", n++, ext);
+		sprintf(filename, "%04d.%s", shader_count++, ext);
 		fd = open(filename, O_WRONLY| O_TRUNC | O_CREAT, 0644);
 		write(fd, dwords + 2, (sizedwords - 2) * 4);
 	}
@@ -741,36 +1235,36 @@ static void dump_tex_const(uint32_t *dwords, uint32_t sizedwords, uint32_t val,
 	 */
 	parse_dword_addr(dwords[5], &mip_gpuaddr, &mip_flags, 0xfff);
 
-	printf("%sset texture const %04x\n", levels[level], val);
-	printf("%sclamp x/y: %s/%s\n", levels[level+1], clamp[clamp_x], clamp[clamp_y]);
-	printf("%sfilter min/mag: %s/%s\n", levels[level+1], filter[min], filter[mag]);
-	printf("%saddr=%08x (flags=%03x), size=%dx%d, pitch=%d, format=%s\n",
+	fprintf(out, "%sset texture const %04x\n", levels[level], val);
+	fprintf(out, "%sclamp x/y: %s/%s\n", levels[level+1], clamp[clamp_x], clamp[clamp_y]);
+	fprintf(out, "%sfilter min/mag: %s/%s\n", levels[level+1], filter[min], filter[mag]);
+	fprintf(out, "%saddr=%08x (flags=%03x), size=%dx%d, pitch=%d, format=%s\n",
 			levels[level+1], gpuaddr, flags, w, h, p,
 			format_name[flags & 0xf]);
-	printf("%smipaddr=%08x (flags=%03x)\n", levels[level+1],
+	fprintf(out, "%smipaddr=%08x (flags=%03x)\n", levels[level+1],
 			mip_gpuaddr, mip_flags);
 }
 
 static void dump_shader_const(uint32_t *dwords, uint32_t sizedwords, uint32_t val, int level)
 {
 	int i;
-	printf("%sset shader const %04x\n", levels[level], val);
+	fprintf(out, "%sset shader const %04x\n", levels[level], val);
 	for (i = 0; i < sizedwords; ) {
 		uint32_t gpuaddr, flags;
 		parse_dword_addr(dwords[i++], &gpuaddr, &flags, 0xf);
 		void *addr = hostptr(gpuaddr);
 		if (addr) {
 			uint32_t size = dwords[i++];
-			printf("%saddr=%08x, size=%d, format=%s\n", levels[level+1],
+			fprintf(out, "%saddr=%08x, size=%d, format=%s\n", levels[level+1],
 					gpuaddr, size, format_name[flags & 0xf]);
 			// TODO maybe dump these as bytes instead of dwords?
 			size = (size + 3) / 4; // for now convert to dwords
 			dump_hex(addr, min(size, 64), level + 1);
 			if (size > min(size, 64))
-				printf("%s\t\t...\n", levels[level+1]);
+				fprintf(out, "%s\t\t...\n", levels[level+1]);
 			dump_float(addr, min(size, 64), level + 1);
 			if (size > min(size, 64))
-				printf("%s\t\t...\n", levels[level+1]);
+				fprintf(out, "%s\t\t...\n", levels[level+1]);
 		}
 	}
 }
@@ -790,10 +1284,10 @@ static void cp_set_const(uint32_t *dwords, uint32_t sizedwords, int level)
 		}
 		break;
 	case 0x2:
-		printf("%sset bool const %04x\n", levels[level], val);
+		fprintf(out, "%sset bool const %04x\n", levels[level], val);
 		break;
 	case 0x3:
-		printf("%sset loop const %04x\n", levels[level], val);
+		fprintf(out, "%sset loop const %04x\n", levels[level], val);
 		break;
 	case 0x4:
 		val += 0x2000;
@@ -804,7 +1298,7 @@ static void cp_set_const(uint32_t *dwords, uint32_t sizedwords, int level)
 
 static void cp_event_write(uint32_t *dwords, uint32_t sizedwords, int level)
 {
-	printf("%sevent %s\n", levels[level], event_name[dwords[0]]);
+	fprintf(out, "%sevent %s\n", levels[level], event_name[dwords[0]]);
 }
 
 static void cp_draw_indx(uint32_t *dwords, uint32_t sizedwords, int level)
@@ -813,12 +1307,13 @@ static void cp_draw_indx(uint32_t *dwords, uint32_t sizedwords, int level)
 	uint32_t prim_type     = dwords[1] & 0x1f;
 	uint32_t source_select = (dwords[1] >> 6) & 0x3;
 	uint32_t num_indices   = dwords[2];
+	bool full;
 
-	printf("%sprim_type:     %s (%d)\n", levels[level],
+	fprintf(out, "%sprim_type:     %s (%d)\n", levels[level],
 			vgt_prim_types[prim_type], prim_type);
-	printf("%ssource_select: %s (%d)\n", levels[level],
+	fprintf(out, "%ssource_select: %s (%d)\n", levels[level],
 			vgt_source_select[source_select], source_select);
-	printf("%snum_indices:   %d\n", levels[level], num_indices);
+	fprintf(out, "%snum_indices:   %d\n", levels[level], num_indices);
 
 /*
 00004804 - GL_UNSIGNED_INT
@@ -827,9 +1322,9 @@ static void cp_draw_indx(uint32_t *dwords, uint32_t sizedwords, int level)
  */
 	if (sizedwords == 5) {
 		void *ptr = hostptr(dwords[3]);
-		printf("%sgpuaddr:       %08x\n", levels[level], dwords[3]);
-		printf("%sidx_size:      %d\n", levels[level], dwords[4]);
-		printf("%sidxs:         ", levels[level]);
+		fprintf(out, "%sgpuaddr:       %08x\n", levels[level], dwords[3]);
+		fprintf(out, "%sidx_size:      %d\n", levels[level], dwords[4]);
+		fprintf(out, "%sidxs:         ", levels[level]);
 		if (ptr) {
 			enum pc_di_index_size size =
 					((dwords[1] >> 11) & 1) | ((dwords[1] >> 12) & 2);
@@ -837,67 +1332,136 @@ static void cp_draw_indx(uint32_t *dwords, uint32_t sizedwords, int level)
 			if (size == INDEX_SIZE_8_BIT) {
 				uint8_t *idx = ptr;
 				for (i = 0; i < dwords[4]; i++)
-					printf(" %u", idx[i]);
+					fprintf(out, " %u", idx[i]);
 			} else if (size == INDEX_SIZE_16_BIT) {
 				uint16_t *idx = ptr;
 				for (i = 0; i < dwords[4]/2; i++)
-					printf(" %u", idx[i]);
+					fprintf(out, " %u", idx[i]);
 			} else if (size == INDEX_SIZE_32_BIT) {
 				uint32_t *idx = ptr;
 				for (i = 0; i < dwords[4]/4; i++)
-					printf(" %u", idx[i]);
+					fprintf(out, " %u", idx[i]);
 			}
-			printf("\n");
+			fprintf(out, "\n");
 			dump_hex(ptr, dwords[4], level+1);
 		}
 	}
 
-	/* dump current state of registers: */
-	printf("%scurrent register values\n", levels[level]);
-	for (i = 0; i < ARRAY_SIZE(type0_reg); i++) {
-		uint32_t regbase = i;
+	/* dump current state of registers, or with --delta just what changed
+	 * since the last draw, plus all of it every so often:
+	 */
+	full = !delta || !draws ||
+			(snapshot_every && !(draws % snapshot_every));
+	fprintf(out, "%s%s register values\n", levels[level],
+			full ? "current" : "changed");
+	for (i = 0; i < type0_reg_count; i++) {
+		uint32_t regbase = type0_reg_list[i];
 		uint32_t lastval = type0_reg_vals[regbase];
-		/* skip registers we don't know about or have zero: */
-		if (!(type0_reg[regbase].name && lastval))
+		/* skip registers which have been zero'd, or are unchanged: */
+		if (full ? !lastval : (lastval == type0_reg_drawn[regbase]))
 			continue;
 		if (type0_reg[regbase].fxn) {
 			type0_reg[regbase].fxn(type0_reg[regbase].name, lastval, level+2);
 		} else {
-			printf("%s<%04x>: %08x\n", levels[level+2], regbase, lastval);
+			fprintf(out, "%s<%04x>: %08x\n", levels[level+2], regbase, lastval);
 		}
 	}
+
+	reg_draw();
+}
+
+/* IBs already decoded in the current submit, so that an IB which is called
+ * several times (ie. the draws, once per bin) is only decoded once, unless
+ * --expand-ibs.  Buffers can't change within a submit, so gpuaddr and size
+ * are enough to tell that it is the same.  A hash table, per-thread for -j,
+ * and emptied when moving on to the next submit:
+ */
+static __thread struct ib_entry {
+	uint32_t gpuaddr, sizedwords;   /* sizedwords is 0 for an empty slot */
+} *ib_table;
+static __thread uint32_t ib_table_size, ib_count;
+static __thread int ib_submit = -1;
+
+static struct ib_entry *ib_slot(struct ib_entry *table, uint32_t size,
+		uint32_t gpuaddr, uint32_t sizedwords)
+{
+	uint32_t i = (gpuaddr * 0x9e3779b1) ^ sizedwords;
+
+	for (;; i++) {
+		struct ib_entry *entry = &table[i & (size - 1)];
+		if (!entry->sizedwords || ((entry->gpuaddr == gpuaddr) &&
+				(entry->sizedwords == sizedwords)))
+			return entry;
+	}
+}
+
+/* returns true if already seen, otherwise remembers it: */
+static bool ib_seen(uint32_t gpuaddr, uint32_t sizedwords)
+{
+	struct ib_entry *entry;
+	uint32_t i;
+
+	if (!sizedwords)
+		return false;
+
+	if (ib_submit != submit) {
+		memset(ib_table, 0, ib_table_size * sizeof(ib_table[0]));
+		ib_count = 0;
+		ib_submit = submit;
+	}
+
+	/* keep it at most half full: */
+	if (((ib_count + 1) * 2) > ib_table_size) {
+		uint32_t size = ib_table_size ? (ib_table_size * 2) : 64;
+		struct ib_entry *table = calloc(size, sizeof(table[0]));
+		for (i = 0; i < ib_table_size; i++)
+			if (ib_table[i].sizedwords)
+				*ib_slot(table, size, ib_table[i].gpuaddr,
+						ib_table[i].sizedwords) = ib_table[i];
+		free(ib_table);
+		ib_table = table;
+		ib_table_size = size;
+	}
+
+	entry = ib_slot(ib_table, ib_table_size, gpuaddr, sizedwords);
+	if (entry->sizedwords)
+		return true;
+
+	entry->gpuaddr = gpuaddr;
+	entry->sizedwords = sizedwords;
+	ib_count++;
+
+	return false;
 }
 
 static void cp_indirect(uint32_t *dwords, uint32_t sizedwords, int level)
 {
 	/* traverse indirect buffers */
-	int i;
 	uint32_t ibaddr = dwords[0];
 	uint32_t ibsize = dwords[1];
-	uint32_t *ptr = NULL;
+	uint32_t *ptr;
 
-	printf("%sibaddr:%08x\n", levels[level], ibaddr);
-	printf("%sibsize:%08x\n", levels[level], ibsize);
+	fprintf(out, "%sibaddr:%08x\n", levels[level], ibaddr);
+	fprintf(out, "%sibsize:%08x\n", levels[level], ibsize);
 
 	/* map gpuaddr back to hostptr: */
-	for (i = 0; i < nbuffers; i++) {
-		if (buffer_contains_gpuaddr(&buffers[i], ibaddr, ibsize)) {
-			ptr = buffers[i].hostptr + (ibaddr - buffers[i].gpuaddr);
-			break;
-		}
-	}
+	ptr = hostptr(ibaddr);
 
-	if (ptr) {
-		dump_commands(ptr, ibsize, level);
-	} else {
+	if (!ptr) {
 		fprintf(stderr, "could not find: %08x (%d)\n", ibaddr, ibsize);
+	} else if (!expand_ibs && ib_seen(ibaddr, ibsize)) {
+		fprintf(out, "%s(same as above, not decoded again)\n", levels[level]);
+		/* but the register values it writes still need tracking: */
+		shadow_commands(ptr, ibsize);
+	} else {
+		dump_commands(ptr, ibsize, level);
 	}
 }
 
 static void cp_mem_write(uint32_t *dwords, uint32_t sizedwords, int level)
 {
 	uint32_t gpuaddr = dwords[0];
-	printf("%sgpuaddr:%08x\n", levels[level], gpuaddr);
+	fprintf(out, "%sgpuaddr:%08x\n", levels[level], gpuaddr);
 	dump_float((float *)&dwords[1], sizedwords-1, level+1);
 }
 
@@ -957,126 +1521,1639 @@ static const struct {
 		 */
 };
 
-static void dump_commands(uint32_t *dwords, uint32_t sizedwords, int level)
-{
-	int dwords_left = sizedwords;
-	uint32_t count = 0; /* dword count including packet header */
-	uint32_t val;
+/*
+ * --format=jsonl and --format=bin: rather than the text, each packet is
+ * written out as a JSON object on a line of its own, or as a struct
+ * rd_packet followed by the raw dwords.  The JSON has the registers
+ * written (with names) and the fields of the packets which the text
+ * decodes, as well as the raw dwords.
+ */
 
-	while (dwords_left > 0) {
-		int type = dwords[0] >> 30;
-		printf("t%d", type);
-		switch (type) {
-		case 0x0: /* type-0 */
-			count = (dwords[0] >> 16)+2;
-			val = GET_PM4_TYPE0_REGIDX(dwords);
-			printf("%swrite %s%s\n", levels[level+1], type0_reg[val].name,
-					(dwords[0] & 0x8000) ? " (same register)" : "");
-			dump_registers(val, dwords+1, count-1, level+2);
-			dump_hex(dwords, count, level+1);
-			break;
-		case 0x1: /* type-1 */
-			count = 3;
-			val = dwords[0] & 0xfff;
-			printf("%swrite %s\n", levels[level+1], type0_reg[val].name);
-			dump_registers(val, dwords+1, 1, level+2);
-			val = (dwords[0] >> 12) & 0xfff;
-			printf("%swrite %s\n", levels[level+1], type0_reg[val].name);
-			dump_registers(val, dwords+2, 1, level+2);
-			dump_hex(dwords, count, level+1);
-			break;
-		case 0x3: /* type-3 */
-			count = ((dwords[0] >> 16) & 0x3fff) + 2;
-			val = GET_PM4_TYPE3_OPCODE(dwords);
-			printf("\t%sopcode: %s (%02x) (%d dwords)%s\n", levels[level],
-					type3_op[val].name, val, count,
-					(dwords[0] & 0x1) ? " (predicated)" : "");
-			if (type3_op[val].fxn)
-				type3_op[val].fxn(dwords+1, count-1, level+1);
-			dump_hex(dwords, count, level+1);
-			break;
-		default:
-			fprintf(stderr, "bad type!\n");
-			return;
-		}
+/* each record is formatted into a buffer, big enough for the worst case
+ * of the packet being all register writes:
+ */
+static __thread char *json_buf;
+static __thread uint32_t json_size;
 
-		dwords += count;
-		dwords_left -= count;
+/* {"reg":N,"name":"...","value":N}, with names all well short of 64: */
+#define JSON_REG_SIZE   (64 + 64)
 
-		//printf("*** dwords_left=%d, count=%d\n", dwords_left, count);
+static char *json_str(char *p, const char *key, const char *str)
+{
+	*p++ = ',';
+	*p++ = '"';
+	p = put_str(p, key);
+	if (str) {
+		p = put_str(p, "\":\"");
+		p = put_str(p, str);
+		*p++ = '"';
+	} else {
+		p = put_str(p, "\":null");
 	}
-
-	if (dwords_left < 0)
-		printf("**** this ain't right!! dwords_left=%d\n", dwords_left);
+	return p;
 }
 
-int main(int argc, char **argv)
+static char *json_num(char *p, const char *key, uint32_t val)
 {
-	enum rd_sect_type type = RD_NONE;
-	void *buf = NULL;
-	int fd, sz, i, n = 1;
+	*p++ = ',';
+	*p++ = '"';
+	p = put_str(p, key);
+	*p++ = '"';
+	*p++ = ':';
+	return put_udec(p, val);
+}
 
-	if (!strcmp(argv[n], "--verbose")) {
-		disasm_set_debug(PRINT_RAW);
-		n++;
+static char *json_reg(char *p, uint32_t regbase, uint32_t dword)
+{
+	p = put_str(p, "{\"reg\":");
+	p = put_udec(p, regbase);
+	p = json_str(p, "name", (regbase < ARRAY_SIZE(type0_reg)) ?
+			type0_reg[regbase].name : NULL);
+	p = json_num(p, "value", dword);
+	*p++ = '}';
+	return p;
+}
+
+static char *json_regs(char *p, uint32_t regbase, uint32_t *dwords,
+		uint32_t sizedwords)
+{
+	uint32_t i;
+
+	p = put_str(p, ",\"regs\":[");
+	for (i = 0; i < sizedwords; i++) {
+		if (i)
+			*p++ = ',';
+		p = json_reg(p, regbase + i, dwords[i]);
+	}
+	*p++ = ']';
+	return p;
+}
+
+static void json_packet(uint32_t *dwords, uint32_t count, int type, int level)
+{
+	uint32_t op = GET_PM4_TYPE3_OPCODE(dwords);
+	uint32_t *payload = dwords + 1;
+	uint32_t i, size = 512 + count * (JSON_REG_SIZE + 12);
+	char *p;
+
+	if (size > json_size) {
+		json_buf = realloc(json_buf, size);
+		json_size = size;
 	}
 
-	if (!strcmp(argv[n], "--dump-shaders")) {
-		dump_shaders = true;
-		n++;
+	p = json_buf;
+	p = put_str(p, "{\"submit\":");
+	p = put_dec(p, submit);
+	p = json_num(p, "level", level);
+	p = json_num(p, "gpuaddr", gpuaddr(dwords));
+	p = json_num(p, "type", type);
+	if (type == 0x3) {
+		p = json_str(p, "opcode", (op < ARRAY_SIZE(type3_op)) ?
+				type3_op[op].name : NULL);
+		p = json_num(p, "op", op);
 	}
+	p = json_num(p, "count", count);
 
-	if (argc-n != 1)
-		fprintf(stderr, "usage: %s [--dump-shaders] testlog.rd\n", argv[0]);
+	switch (type) {
+	case 0x0:
+		p = json_regs(p, GET_PM4_TYPE0_REGIDX(dwords), payload, count-1);
+		break;
+	case 0x1:
+		p = put_str(p, ",\"regs\":[");
+		p = json_reg(p, dwords[0] & 0xfff, payload[0]);
+		*p++ = ',';
+		p = json_reg(p, (dwords[0] >> 12) & 0xfff, payload[1]);
+		*p++ = ']';
+		break;
+	case 0x3:
+		/* don't read past the end of short (or bogus) packets, count
+		 * includes the header:
+		 */
+		switch (op) {
+		case CP_INDIRECT_BUFFER:
+		case CP_INDIRECT_BUFFER_PFD:
+			if (count < 3)
+				break;
+			p = json_num(p, "ibaddr", payload[0]);
+			p = json_num(p, "ibsize", payload[1]);
+			break;
+		case CP_SET_CONSTANT:
+			p = json_num(p, "const_type", payload[0] >> 16);
+			p = json_num(p, "offset", payload[0] & 0xffff);
+			if ((payload[0] >> 16) == 0x4)
+				p = json_regs(p, (payload[0] & 0xffff) + 0x2000,
+						payload + 1, count-2);
+			break;
+		case CP_DRAW_INDX:
+			if (count < 4)
+				break;
+			p = json_str(p, "prim_type", vgt_prim_types[payload[1] & 0x1f]);
+			p = json_str(p, "source_select",
+					vgt_source_select[(payload[1] >> 6) & 0x3]);
+			p = json_num(p, "num_indices", payload[2]);
+			if (count == 6) {
+				p = json_num(p, "index_addr", payload[3]);
+				p = json_num(p, "index_size", payload[4]);
+			}
+			break;
+		case CP_EVENT_WRITE:
+			p = json_str(p, "event", (payload[0] < ARRAY_SIZE(event_name)) ?
+					event_name[payload[0]] : NULL);
+			break;
+		case CP_MEM_WRITE:
+			p = json_num(p, "addr", payload[0]);
+			break;
+		case CP_IM_LOAD_IMMEDIATE:
+			if (count < 3)
+				break;
+			p = json_str(p, "shader", (payload[0] == 0) ? "vertex" :
+					(payload[0] == 1) ? "fragment" : NULL);
+			p = json_num(p, "start", payload[1] >> 16);
+			p = json_num(p, "size", payload[1] & 0xffff);
+			break;
+		}
+		break;
+	}
 
-	fd = open(argv[n], O_RDONLY);
-	if (fd < 0)
-		fprintf(stderr, "could not open: %s\n", argv[1]);
+	p = put_str(p, ",\"dwords\":[");
+	for (i = 0; i < count; i++) {
+		if (i)
+			*p++ = ',';
+		p = put_udec(p, dwords[i]);
+	}
+	p = put_str(p, "]}\n");
 
-	while ((read(fd, &type, sizeof(type)) > 0) && (read(fd, &sz, 4) > 0)) {
-		free(buf);
+	put_line(json_buf, p);
+}
 
-		buf = malloc(sz + 1);
-		((char *)buf)[sz] = '\0';
-		read(fd, buf, sz);
+static void bin_packet(uint32_t *dwords, uint32_t count, int type, int level)
+{
+	struct rd_packet pkt;
+
+	memset(&pkt, 0, sizeof(pkt));
+	pkt.submit  = submit;
+	pkt.gpuaddr = gpuaddr(dwords);
+	pkt.type    = type;
+	pkt.opcode  = (type == 0x3) ? GET_PM4_TYPE3_OPCODE(dwords) : 0;
+	pkt.level   = level;
+	pkt.count   = count;
+
+	fwrite(&pkt, sizeof(pkt), 1, out);
+	fwrite(dwords, sizeof(dwords[0]), count, out);
+}
 
-		switch(type) {
-		case RD_TEST:
-			printf("test: %s\n", (char *)buf);
+/* returns the size of the packet, or zero if it can't be parsed: */
+static uint32_t emit_packet(uint32_t *dwords, int level)
+{
+	int type = dwords[0] >> 30;
+	uint32_t count, *ptr;
+
+	switch (type) {
+	case 0x0: /* type-0 */
+		count = (dwords[0] >> 16)+2;
+		break;
+	case 0x1: /* type-1 */
+		count = 3;
+		break;
+	case 0x3: /* type-3 */
+		count = ((dwords[0] >> 16) & 0x3fff) + 2;
+		break;
+	default:
+		fprintf(stderr, "bad type!\n");
+		return 0;
+	}
+
+	if (format == FORMAT_JSONL)
+		json_packet(dwords, count, type, level);
+	else
+		bin_packet(dwords, count, type, level);
+
+	/* the packets of an IB follow the one pointing to it: */
+	if ((type == 0x3) && (count >= 3) &&
+			((GET_PM4_TYPE3_OPCODE(dwords) == CP_INDIRECT_BUFFER) ||
+			 (GET_PM4_TYPE3_OPCODE(dwords) == CP_INDIRECT_BUFFER_PFD))) {
+		ptr = hostptr(dwords[1]);
+		if (ptr)
+			dump_commands(ptr, dwords[2], level + 1);
+		else
+			fprintf(stderr, "could not find: %08x (%d)\n",
+					dwords[1], dwords[2]);
+	}
+
+	return count;
+}
+
+static void dump_commands(uint32_t *dwords, uint32_t sizedwords, int level)
+{
+	int dwords_left = sizedwords;
+	uint32_t count = 0; /* dword count including packet header */
+	uint32_t val;
+
+	while (dwords_left > 0) {
+		int type = dwords[0] >> 30;
+		char t[2] = { 't', '0' + type };
+
+		if (format != FORMAT_TEXT) {
+			if (!(count = emit_packet(dwords, level)))
+				return;
+			dwords += count;
+			dwords_left -= count;
+			continue;
+		}
+
+		put_line(t, t + 2);
+		switch (type) {
+		case 0x0: /* type-0 */
+			count = (dwords[0] >> 16)+2;
+			val = GET_PM4_TYPE0_REGIDX(dwords);
+			fprintf(out, "%swrite %s%s\n", levels[level+1], type0_reg[val].name,
+					(dwords[0] & 0x8000) ? " (same register)" : "");
+			dump_registers(val, dwords+1, count-1, level+2);
+			dump_hex(dwords, count, level+1);
 			break;
-		case RD_CMD:
-			printf("cmd: %s\n", (char *)buf);
+		case 0x1: /* type-1 */
+			count = 3;
+			val = dwords[0] & 0xfff;
+			fprintf(out, "%swrite %s\n", levels[level+1], type0_reg[val].name);
+			dump_registers(val, dwords+1, 1, level+2);
+			val = (dwords[0] >> 12) & 0xfff;
+			fprintf(out, "%swrite %s\n", levels[level+1], type0_reg[val].name);
+			dump_registers(val, dwords+2, 1, level+2);
+			dump_hex(dwords, count, level+1);
 			break;
-		case RD_VERT_SHADER:
-			printf("vertex shader:\n%s\n", (char *)buf);
+		case 0x3: /* type-3 */
+			count = ((dwords[0] >> 16) & 0x3fff) + 2;
+			val = GET_PM4_TYPE3_OPCODE(dwords);
+			fprintf(out, "\t%sopcode: %s (%02x) (%d dwords)%s\n", levels[level],
+					type3_op[val].name, val, count,
+					(dwords[0] & 0x1) ? " (predicated)" : "");
+			if (type3_op[val].fxn)
+				type3_op[val].fxn(dwords+1, count-1, level+1);
+			dump_hex(dwords, count, level+1);
 			break;
-		case RD_FRAG_SHADER:
-			printf("fragment shader:\n%s\n", (char *)buf);
+		default:
+			fprintf(stderr, "bad type!\n");
+			return;
+		}
+
+		dwords += count;
+		dwords_left -= count;
+
+		//printf("*** dwords_left=%d, count=%d\n", dwords_left, count);
+	}
+
+	if (dwords_left < 0)
+		fprintf(out, "**** this ain't right!! dwords_left=%d\n", dwords_left);
+}
+
+static void dump_cmdstream(uint32_t gpuaddr, uint32_t sizedwords)
+{
+	if (format != FORMAT_TEXT) {
+		dump_commands(hostptr(gpuaddr), sizedwords, 0);
+		return;
+	}
+
+	fprintf(out, "############################################################\n");
+	fprintf(out, "cmdstream: %d dwords\n", sizedwords);
+	dump_commands(hostptr(gpuaddr), sizedwords, 0);
+	fprintf(out, "############################################################\n");
+}
+
+/* --stats and --redundant: counters accumulated by shadow_commands(),
+ * instead of decoding:
+ */
+static struct {
+	uint64_t packets[4], packet_dwords[4];     /* by packet type */
+	uint64_t opcodes[256], opcode_dwords[256];
+	uint64_t reg_writes[0x7fff], reg_redundant[0x7fff];
+	uint64_t ibs, draws;
+	uint64_t shaders, shader_bytes, consts, const_bytes;
+	uint64_t writes, redundant, wasted;
+	uint64_t submits;
+	/* per submit: */
+	uint64_t submit_dwords, submit_draws;
+	uint64_t submit_writes, submit_redundant, submit_wasted;
+	uint64_t min_dwords, max_dwords, min_draws, max_draws;
+} st;
+
+/* returns the number of writes which didn't change the value: */
+static uint32_t shadow_registers(uint32_t regbase, uint32_t *dwords,
+		uint32_t sizedwords)
+{
+	uint32_t n = sizedwords, nredundant = 0;
+
+	/* st is only for the main thread, with --stats or --redundant (the
+	 * -j workers also get here, for repeated IBs):
+	 */
+	if (!(stats || redundant)) {
+		while (sizedwords--)
+			reg_write(regbase++, *(dwords++));
+		return 0;
+	}
+
+	while (sizedwords--) {
+		if (regbase < ARRAY_SIZE(st.reg_writes)) {
+			st.reg_writes[regbase]++;
+			if (reg_known(regbase) &&
+					(type0_reg_vals[regbase] == *dwords)) {
+				st.reg_redundant[regbase]++;
+				nredundant++;
+			}
+		}
+		reg_write(regbase++, *(dwords++));
+	}
+
+	st.submit_writes += n;
+	st.submit_redundant += nredundant;
+	st.submit_wasted += nredundant;
+
+	return nredundant;
+}
+
+/* --stats counters for a packet, other than the register writes: */
+static void stats_packet(uint32_t *dwords, uint32_t type, uint32_t count)
+{
+	uint32_t val;
+
+	st.packets[type]++;
+	st.packet_dwords[type] += count;
+	st.submit_dwords += count;
+
+	if (type != 0x3)
+		return;
+
+	val = GET_PM4_TYPE3_OPCODE(dwords);
+	st.opcodes[val]++;
+	st.opcode_dwords[val] += count;
+
+	switch (val) {
+	case CP_INDIRECT_BUFFER:
+	case CP_INDIRECT_BUFFER_PFD:
+		st.ibs++;
+		break;
+	case CP_SET_CONSTANT:
+		if ((dwords[1] >> 16) != 0x4) {
+			st.consts++;
+			st.const_bytes += (count - 2) * 4;
+		}
+		break;
+	case CP_IM_LOAD_IMMEDIATE:
+		st.shaders++;
+		st.shader_bytes += (count - 3) * 4;
+		break;
+	case CP_DRAW_INDX:
+		st.draws++;
+		st.submit_draws++;
+		break;
+	}
+}
+
+/* For -j: just the state that dump_commands() carries over from one submit
+ * to the next, ie. the register values (and as of the last draw), and the
+ * count of shaders dumped, without decoding anything else.  This way the
+ * main thread can keep up with the state as of the start of each submit,
+ * to hand to the worker, and the workers can skip over repeated IBs.  For
+ * --stats and --redundant (main thread only), it also does the counting.
+ */
+static void shadow_commands(uint32_t *dwords, uint32_t sizedwords)
+{
+	bool counting = stats || redundant;
+	int dwords_left = sizedwords;
+	uint32_t count, val, type;
+	uint32_t *ptr;
+
+	while (dwords_left > 0) {
+		type = dwords[0] >> 30;
+		switch (type) {
+		case 0x0: /* type-0 */
+			count = (dwords[0] >> 16)+2;
+			val = GET_PM4_TYPE0_REGIDX(dwords);
+			/* if none of it was needed, neither was the header: */
+			if ((shadow_registers(val, dwords+1, count-1) == (count-1)) &&
+					counting)
+				st.submit_wasted++;
 			break;
-		case RD_GPUADDR:
-			buffers[nbuffers].gpuaddr = ((uint32_t *)buf)[0];
-			buffers[nbuffers].len = ((uint32_t *)buf)[1];
+		case 0x1: /* type-1 */
+			count = 3;
+			val = shadow_registers(dwords[0] & 0xfff, dwords+1, 1) +
+				shadow_registers((dwords[0] >> 12) & 0xfff, dwords+2, 1);
+			if ((val == 2) && counting)
+				st.submit_wasted++;
 			break;
-		case RD_BUFFER_CONTENTS:
-			buffers[nbuffers].hostptr = buf;
-			nbuffers++;
-			buf = NULL;
+		case 0x3: /* type-3 */
+			count = ((dwords[0] >> 16) & 0x3fff) + 2;
+			val = GET_PM4_TYPE3_OPCODE(dwords);
+			switch (val) {
+			case CP_INDIRECT_BUFFER:
+			case CP_INDIRECT_BUFFER_PFD:
+				ptr = hostptr(dwords[1]);
+				if (ptr)
+					shadow_commands(ptr, dwords[2]);
+				break;
+			case CP_SET_CONSTANT:
+				if (((dwords[1] >> 16) == 0x4) &&
+						(shadow_registers((dwords[1] & 0xffff) + 0x2000,
+								dwords+2, count-2) == (count-2)) &&
+						counting)
+					st.submit_wasted += 2;
+				break;
+			case CP_IM_LOAD_IMMEDIATE:
+				if (dump_shaders && (dwords[1] <= 1))
+					shader_count++;
+				break;
+			case CP_DRAW_INDX:
+				if (delta)
+					reg_draw();
+				break;
+			}
 			break;
-		case RD_CMDSTREAM_ADDR:
-			printf("############################################################\n");
-			printf("cmdstream: %d dwords\n", ((uint32_t *)buf)[1]);
-			dump_commands(hostptr(((uint32_t *)buf)[0]),
-					((uint32_t *)buf)[1], 0);
-			printf("############################################################\n");
-			for (i = 0; i < nbuffers; i++) {
-				free(buffers[i].hostptr);
-				buffers[i].hostptr = NULL;
+		default:
+			return;
+		}
+
+		if (counting)
+			stats_packet(dwords, type, count);
+
+		dwords += count;
+		dwords_left -= count;
+	}
+}
+
+/* pending RD_GPUADDR, for the buffer sections that follow it: */
+static uint32_t pending_gpuaddr, pending_len;
+
+/* --submit/--range, only decode submits first_submit..last_submit: */
+static int first_submit = 0, last_submit = -1;
+
+static bool in_window_submit(int n)
+{
+	return (n >= first_submit) &&
+			((last_submit < 0) || (n <= last_submit));
+}
+
+static bool in_window(void)
+{
+	return in_window_submit(submit);
+}
+
+/* same format as libwrap's hexdump(): */
+static void dump_bytes(const void *data, int size)
+{
+	const unsigned char *buf = data;
+	char alpha[17];
+	int i;
+
+	for (i = 0; i < size; i++) {
+		if (!(i % 16))
+			fprintf(out, "\t\t\t%08X", (unsigned int) i);
+		if (!(i % 4))
+			fprintf(out, " ");
+
+		fprintf(out, " %02x", buf[i]);
+		alpha[i % 16] = (isprint(buf[i]) && (buf[i] < 0xA0)) ? buf[i] : '.';
+
+		if ((i % 16) == 15) {
+			alpha[16] = 0;
+			fprintf(out, "\t|%s|\n", alpha);
+		}
+	}
+
+	if (i % 16) {
+		for (i %= 16; i < 16; i++) {
+			fprintf(out, "   ");
+			alpha[i] = '.';
+		}
+		alpha[16] = 0;
+		fprintf(out, "\t|%s|\n", alpha);
+	}
+}
+
+static void dump_ioctl_args(const struct rd_ioctl *hdr,
+		const void *arg, const void *extra)
+{
+	int nr = _IOC_NR(hdr->request);
+	unsigned int i;
+
+#define ARG(type) \
+	const struct type *param = arg; \
+	if (hdr->argsz != sizeof(*param)) \
+		break
+
+	if (!hdr->post) {
+		switch (nr) {
+		case _IOC_NR(IOCTL_KGSL_RINGBUFFER_ISSUEIBCMDS): {
+			ARG(kgsl_ringbuffer_issueibcmds);
+			const struct kgsl_ibdesc *ibdesc = extra;
+			fprintf(out, "\t\tdrawctxt_id:\t%08x\n", param->drawctxt_id);
+			fprintf(out, "\t\tflags:\t\t%08x\n", param->flags);
+			fprintf(out, "\t\tnumibs:\t\t%08x\n", param->numibs);
+			fprintf(out, "\t\tibdesc_addr:\t%08x\n", param->ibdesc_addr);
+			if (hdr->extrasz != param->numibs * sizeof(*ibdesc))
+				break;
+			for (i = 0; i < param->numibs; i++) {
+				fprintf(out, "\t\tibdesc[%d].ctrl:\t\t%08x\n", i, ibdesc[i].ctrl);
+				fprintf(out, "\t\tibdesc[%d].sizedwords:\t%08x\n", i, ibdesc[i].sizedwords);
+				fprintf(out, "\t\tibdesc[%d].gpuaddr:\t%08x\n", i, ibdesc[i].gpuaddr);
+				fprintf(out, "\t\tibdesc[%d].hostptr:\t%p\n", i, ibdesc[i].hostptr);
 			}
-			nbuffers = 0;
 			break;
 		}
+		case _IOC_NR(IOCTL_KGSL_DRAWCTXT_CREATE): {
+			ARG(kgsl_drawctxt_create);
+			fprintf(out, "\t\tflags:\t\t%08x\n", param->flags);
+			break;
+		}
+		case _IOC_NR(IOCTL_KGSL_SHAREDMEM_FROM_VMALLOC): {
+			ARG(kgsl_sharedmem_from_vmalloc);
+			fprintf(out, "\t\tflags:\t\t%08x\n", param->flags);
+			fprintf(out, "\t\thostptr:\t%08x\n", param->hostptr);
+			break;
+		}
+		case _IOC_NR(IOCTL_KGSL_SHAREDMEM_FREE): {
+			ARG(kgsl_sharedmem_free);
+			fprintf(out, "\t\tgpuaddr:\t%08x\n", param->gpuaddr);
+			break;
+		}
+		case _IOC_NR(IOCTL_KGSL_GPUMEM_ALLOC): {
+			ARG(kgsl_gpumem_alloc);
+			fprintf(out, "\t\tflags:\t\t%08x\n", param->flags);
+			fprintf(out, "\t\tsize:\t\t%08x\n", (unsigned int)param->size);
+			break;
+		}
+		}
+	} else {
+		switch (nr) {
+		case _IOC_NR(IOCTL_KGSL_RINGBUFFER_ISSUEIBCMDS): {
+			ARG(kgsl_ringbuffer_issueibcmds);
+			fprintf(out, "\t\ttimestamp:\t%08x\n", param->timestamp);
+			break;
+		}
+		case _IOC_NR(IOCTL_KGSL_DRAWCTXT_CREATE): {
+			ARG(kgsl_drawctxt_create);
+			fprintf(out, "\t\tdrawctxt_id:\t%08x\n", param->drawctxt_id);
+			break;
+		}
+		case _IOC_NR(IOCTL_KGSL_DEVICE_GETPROPERTY): {
+			ARG(kgsl_device_getproperty);
+			fprintf(out, "\t\ttype:\t\t%08x (%s)\n", param->type,
+					((param->type < ARRAY_SIZE(propnames)) &&
+					propnames[param->type]) ?
+					propnames[param->type] : "<unknown>");
+			dump_bytes(extra, hdr->extrasz);
+			break;
+		}
+		case _IOC_NR(IOCTL_KGSL_SHAREDMEM_FROM_VMALLOC): {
+			ARG(kgsl_sharedmem_from_vmalloc);
+			fprintf(out, "\t\tgpuaddr:\t%08x\n", param->gpuaddr);
+			break;
+		}
+		case _IOC_NR(IOCTL_KGSL_GPUMEM_ALLOC): {
+			ARG(kgsl_gpumem_alloc);
+			fprintf(out, "\t\tgpuaddr:\t%08lx\n", param->gpuaddr);
+			break;
+		}
+		}
 	}
 
-	return 0;
+#undef ARG
+}
+
+/* render a RD_IOCTL section the same way libwrap prints ioctls when not
+ * logging them in binary:
+ */
+/* indexed by enum rd_ioctl_dev: */
+static struct device_info *ioctl_devices[] = {
+		[RD_IOCTL_KGSL_3D] = &kgsl_3d_info,
+		[RD_IOCTL_KGSL_2D] = &kgsl_2d_info,
+		[RD_IOCTL_PMEM]    = &pmem_info,
+};
+
+static void dump_ioctl(const void *data, uint32_t sz)
+{
+	static uint64_t first_time;
+	const struct rd_ioctl *hdr = data;
+	const uint8_t *arg = (const uint8_t *)(hdr + 1);
+	struct device_info *info = NULL;
+	const char *name = "<unknown>";
+	char c = hdr->post ? '<' : '>';
+	uint64_t t;
+
+	if ((sz < sizeof(*hdr)) ||
+			((sz - sizeof(*hdr)) < ((uint64_t)hdr->argsz + hdr->extrasz))) {
+		fprintf(out, "invalid ioctl log\n");
+		return;
+	}
+
+	if (!first_time)
+		first_time = hdr->time;
+	t = hdr->time - first_time;
+
+	if (hdr->dev < ARRAY_SIZE(ioctl_devices))
+		info = ioctl_devices[hdr->dev];
+
+	if (!info) {
+		fprintf(out, "%c [%4d]         : <unknown> (%08x)", c, hdr->fd, hdr->request);
+		if (hdr->post)
+			fprintf(out, " (%d)", hdr->ret);
+		fprintf(out, "\n");
+		return;
+	}
+
+	if (info->ioctl_info[_IOC_NR(hdr->request)].name)
+		name = info->ioctl_info[_IOC_NR(hdr->request)].name;
+
+	fprintf(out, "%c [%4d] %8s: %s (%08x)", c, hdr->fd, info->name, name,
+			hdr->request);
+	if (hdr->post)
+		fprintf(out, " => %d", hdr->ret);
+	fprintf(out, " @%u.%06u\n", (unsigned int)(t / 1000000000),
+			(unsigned int)(t % 1000000000) / 1000);
+
+	dump_bytes(arg, hdr->argsz);
+
+	if ((hdr->dev == RD_IOCTL_KGSL_3D) || (hdr->dev == RD_IOCTL_KGSL_2D))
+		dump_ioctl_args(hdr, arg, arg + hdr->argsz);
+}
+
+/*
+ * --latency: instead of decoding the cmdstream, pair up the RD_TIMESTAMPs
+ * written by libwrap to work out, for each submit, how long the submit
+ * ioctl took, how long until the CPU saw it retire (ie. the first wait
+ * or read of a timestamp at or past the submit's), and the gap since the
+ * previous submit.
+ *
+ * A submit ioctl covers the RD_CMDSTREAM_ADDRs (one per IB) just before
+ * its RD_TS_SUBMIT, and the RD_TS_SUBMITTED is paired up with it by its
+ * serial #, since other threads' submits can land in between.
+ */
+
+struct lat_submit {
+	int submit, nibs;        /* first RD_CMDSTREAM_ADDR, and how many */
+	uint32_t serial;
+	uint32_t dev, ts;
+	uint64_t begin, end, retired;
+	bool submitted, failed;
+};
+
+static struct lat_submit *lat_submits;
+static int lat_count, lat_max;
+static int lat_unsubmitted, lat_unretired[RD_IOCTL_PMEM + 1];
+
+/* has timestamp a passed b, allowing for wrap-around: */
+static bool ts_passed(uint32_t a, uint32_t b)
+{
+	return (int32_t)(a - b) >= 0;
+}
+
+static void lat_retire(uint32_t dev, uint32_t value, uint64_t time)
+{
+	int i;
+
+	if (dev >= ARRAY_SIZE(lat_unretired))
+		return;
+
+	for (i = lat_unretired[dev]; i < lat_count; i++) {
+		struct lat_submit *s = &lat_submits[i];
+		if ((s->dev != dev) || s->failed || s->retired)
+			continue;
+		if (!s->submitted || !ts_passed(value, s->ts))
+			break;
+		s->retired = time;
+	}
+
+	while ((lat_unretired[dev] < lat_count) &&
+			((lat_submits[lat_unretired[dev]].dev != dev) ||
+			 lat_submits[lat_unretired[dev]].failed ||
+			 lat_submits[lat_unretired[dev]].retired))
+		lat_unretired[dev]++;
+}
+
+static void lat_timestamp(const struct rd_timestamp *t)
+{
+	struct lat_submit *s;
+	int i;
+
+	switch (t->event) {
+	case RD_TS_SUBMIT:
+		/* the submit's RD_CMDSTREAM_ADDRs were just before it: */
+		if (!t->nibs || !in_window_submit(submit - t->nibs))
+			break;
+		if (lat_count == lat_max) {
+			lat_max = lat_max ? lat_max * 2 : 1024;
+			lat_submits = realloc(lat_submits,
+					lat_max * sizeof(lat_submits[0]));
+		}
+		s = &lat_submits[lat_count++];
+		memset(s, 0, sizeof(*s));
+		s->submit = submit - t->nibs;
+		s->nibs = t->nibs;
+		s->serial = t->submit;
+		s->dev = t->dev;
+		s->begin = t->time;
+		break;
+	case RD_TS_SUBMITTED:
+		for (i = lat_unsubmitted; i < lat_count; i++) {
+			s = &lat_submits[i];
+			if (s->submitted || s->failed || (s->dev != t->dev) ||
+					(s->serial != t->submit))
+				continue;
+			s->end = t->time;
+			s->ts = t->value;
+			if (t->ret)
+				s->failed = true;
+			else
+				s->submitted = true;
+			break;
+		}
+		while ((lat_unsubmitted < lat_count) &&
+				(lat_submits[lat_unsubmitted].submitted ||
+				 lat_submits[lat_unsubmitted].failed))
+			lat_unsubmitted++;
+		break;
+	case RD_TS_WAITED:
+		if (!t->ret)
+			lat_retire(t->dev, t->value, t->time);
+		break;
+	case RD_TS_READ:
+		if (!t->ret)
+			lat_retire(t->dev, t->value, t->time);
+		break;
+	default:
+		break;
+	}
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
 }
 
+static double ms(uint64_t ns)
+{
+	return ns / 1000000.0;
+}
+
+/* percentiles, and a histogram in power of two buckets: */
+static void lat_summary(const char *name, uint64_t *vals, int n)
+{
+	int hist[64] = {0};
+	int i, lo = 63, hi = 0, most = 0;
+
+	fprintf(out, "%s: %d samples", name, n);
+	if (!n) {
+		fprintf(out, "\n\n");
+		return;
+	}
+
+	qsort(vals, n, sizeof(vals[0]), cmp_u64);
+	fprintf(out, ", min %.3f, p50 %.3f, p90 %.3f, p99 %.3f, max %.3f ms\n",
+			ms(vals[0]), ms(vals[n / 2]), ms(vals[(n * 90) / 100]),
+			ms(vals[(n * 99) / 100]), ms(vals[n - 1]));
+
+	for (i = 0; i < n; i++) {
+		uint64_t us = vals[i] / 1000;
+		int b = 0;
+		while (us) {
+			us >>= 1;
+			b++;
+		}
+		hist[b]++;
+		if (b < lo)
+			lo = b;
+		if (b > hi)
+			hi = b;
+		if (hist[b] > most)
+			most = hist[b];
+	}
+
+	for (i = lo; i <= hi; i++) {
+		int bar = (hist[i] * 50 + most - 1) / most;
+		fprintf(out, "  < %10llu us: %7d ", 1ULL << i, hist[i]);
+		while (bar--)
+			fprintf(out, "#");
+		fprintf(out, "\n");
+	}
+	fprintf(out, "\n");
+}
+
+static void lat_report(void)
+{
+	uint64_t *ioctl = malloc((lat_count + 1) * sizeof(uint64_t));
+	uint64_t *retire = malloc((lat_count + 1) * sizeof(uint64_t));
+	uint64_t *gap = malloc((lat_count + 1) * sizeof(uint64_t));
+	int i, nioctl = 0, nretire = 0, ngap = 0;
+
+	for (i = 0; i < lat_count; i++) {
+		struct lat_submit *s = &lat_submits[i];
+		char name[32];
+
+		/* several IBs in one ioctl share its numbers: */
+		if (s->nibs > 1)
+			sprintf(name, "%d-%d", s->submit, s->submit + s->nibs - 1);
+		else
+			sprintf(name, "%d", s->submit);
+		fprintf(out, "submit %5s:", name);
+
+		if (s->submitted || s->failed) {
+			ioctl[nioctl++] = s->end - s->begin;
+			fprintf(out, " ioctl %9.3f ms", ms(s->end - s->begin));
+		} else {
+			fprintf(out, " ioctl         - ms");
+		}
+
+		if (s->retired) {
+			retire[nretire++] = s->retired - s->begin;
+			fprintf(out, ", retire %9.3f ms", ms(s->retired - s->begin));
+		} else {
+			fprintf(out, ", retire         - ms");
+		}
+
+		if (i > 0) {
+			gap[ngap++] = s->begin - lat_submits[i-1].begin;
+			fprintf(out, ", gap %9.3f ms", ms(s->begin - lat_submits[i-1].begin));
+		}
+
+		if (s->failed)
+			fprintf(out, " (failed)");
+		else if (s->submitted)
+			fprintf(out, " (ts %u)", s->ts);
+		fprintf(out, "\n");
+	}
+	fprintf(out, "\n");
+
+	lat_summary("submit ioctl", ioctl, nioctl);
+	lat_summary("submit to retire", retire, nretire);
+	lat_summary("submit to submit", gap, ngap);
+
+	free(ioctl);
+	free(retire);
+	free(gap);
+	free(lat_submits);
+}
+
+static void dump_memstat(const void *data, uint32_t sz)
+{
+	const struct rd_memstat *total = data;
+	const struct rd_memstat_bucket *buckets =
+			(const struct rd_memstat_bucket *)(total + 1);
+	int i;
+
+	if ((sz < sizeof(*total)) || ((sz - sizeof(*total)) <
+			((uint64_t)total->nbuckets * sizeof(buckets[0])))) {
+		fprintf(out, "invalid memstat\n");
+		return;
+	}
+
+	fprintf(out, "memstat: %u buffers / %"PRIu64" KB live, peak %u / %"PRIu64" KB, "
+			"%u allocs, %u frees\n", total->live, total->live_bytes / 1024,
+			total->peak, total->peak_bytes / 1024, total->allocs, total->frees);
+
+	for (i = 0; i < total->nbuckets; i++) {
+		const struct rd_memstat_bucket *bucket = &buckets[i];
+		if (!bucket->live)
+			continue;
+		if (bucket->size_log2)
+			fprintf(out, "\t<=%7uK", (1U << bucket->size_log2) / 1024);
+		else
+			fprintf(out, "\t   other");
+		fprintf(out, " flags %08x: %u buffers / %"PRIu64" KB live, peak %u / "
+				"%"PRIu64" KB\n", bucket->flags, bucket->live,
+				bucket->live_bytes / 1024, bucket->peak,
+				bucket->peak_bytes / 1024);
+	}
+}
+
+static void stats_submit(uint32_t gpuaddr, uint32_t sizedwords)
+{
+	uint32_t *cmds = hostptr(gpuaddr);
+
+	st.submit_dwords = st.submit_draws = 0;
+	st.submit_writes = st.submit_redundant = st.submit_wasted = 0;
+	if (cmds)
+		shadow_commands(cmds, sizedwords);
+
+	if (redundant) {
+		fprintf(out, "submit %5d: %6"PRIu64" of %6"PRIu64" register writes "
+				"redundant, %6"PRIu64" of %6"PRIu64" dwords wasted\n",
+				submit, st.submit_redundant, st.submit_writes,
+				st.submit_wasted, st.submit_dwords);
+		st.writes += st.submit_writes;
+		st.redundant += st.submit_redundant;
+		st.wasted += st.submit_wasted;
+	}
+
+	if (!st.submits || (st.submit_dwords < st.min_dwords))
+		st.min_dwords = st.submit_dwords;
+	if (st.submit_dwords > st.max_dwords)
+		st.max_dwords = st.submit_dwords;
+	if (!st.submits || (st.submit_draws < st.min_draws))
+		st.min_draws = st.submit_draws;
+	if (st.submit_draws > st.max_draws)
+		st.max_draws = st.submit_draws;
+	st.submits++;
+}
+
+static int cmp_redundant(const void *a, const void *b)
+{
+	uint64_t x = st.reg_redundant[*(const uint16_t *)a];
+	uint64_t y = st.reg_redundant[*(const uint16_t *)b];
+	if (x != y)
+		return (x < y) ? 1 : -1;
+	return *(const uint16_t *)a - *(const uint16_t *)b;
+}
+
+/* --redundant: the totals, and the registers by number of wasted writes: */
+static void redundant_report(void)
+{
+	uint64_t dwords = 0;
+	uint16_t *regs = malloc(ARRAY_SIZE(st.reg_redundant) * sizeof(regs[0]));
+	int i, n = 0;
+
+	for (i = 0; i < ARRAY_SIZE(st.packet_dwords); i++)
+		dwords += st.packet_dwords[i];
+
+	fprintf(out, "\ntotal: %"PRIu64" of %"PRIu64" register writes redundant, "
+			"%"PRIu64" of %"PRIu64" dwords wasted (%.1f%%)\n\n",
+			st.redundant, st.writes, st.wasted, dwords,
+			dwords ? (100.0 * st.wasted / dwords) : 0.0);
+
+	for (i = 0; i < ARRAY_SIZE(st.reg_redundant); i++)
+		if (st.reg_redundant[i])
+			regs[n++] = i;
+	qsort(regs, n, sizeof(regs[0]), cmp_redundant);
+
+	fprintf(out, "%-48s %12s %12s\n", "register", "redundant", "writes");
+	for (i = 0; i < n; i++) {
+		uint32_t regbase = regs[i];
+		char name[64];
+		if (type0_reg[regbase].name && (strlen(type0_reg[regbase].name) < 48))
+			sprintf(name, "%s (%04x)", type0_reg[regbase].name, regbase);
+		else
+			sprintf(name, "(%04x)", regbase);
+		fprintf(out, "%-48s %12"PRIu64" %12"PRIu64"\n", name,
+				st.reg_redundant[regbase], st.reg_writes[regbase]);
+	}
+
+	free(regs);
+}
+
+static void stats_row(const char *kind, const char *name, uint64_t count,
+		uint64_t dwords)
+{
+	if (csv)
+		fprintf(out, "%s,%s,%"PRIu64",%"PRIu64"\n", kind, name, count, dwords);
+	else
+		fprintf(out, "\t%-40s %12"PRIu64" %14"PRIu64"\n", name, count, dwords);
+}
+
+static void stats_report(void)
+{
+	uint64_t dwords = 0;
+	char name[64];
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(st.packet_dwords); i++)
+		dwords += st.packet_dwords[i];
+
+	if (csv) {
+		fprintf(out, "kind,name,count,dwords\n");
+		stats_row("total", "submits", st.submits, dwords);
+		stats_row("total", "indirect buffers", st.ibs, 0);
+		stats_row("total", "draws", st.draws, 0);
+		stats_row("total", "shader uploads", st.shaders, st.shader_bytes / 4);
+		stats_row("total", "constant uploads", st.consts, st.const_bytes / 4);
+	} else {
+		uint64_t n = st.submits ? st.submits : 1;
+		fprintf(out, "submits:          %12"PRIu64"\n", st.submits);
+		fprintf(out, "dwords:           %12"PRIu64"   per submit min %"PRIu64
+				", avg %"PRIu64", max %"PRIu64"\n", dwords,
+				st.min_dwords, dwords / n, st.max_dwords);
+		fprintf(out, "draws:            %12"PRIu64"   per submit min %"PRIu64
+				", avg %"PRIu64", max %"PRIu64"\n", st.draws,
+				st.min_draws, st.draws / n, st.max_draws);
+		fprintf(out, "indirect buffers: %12"PRIu64"\n", st.ibs);
+		fprintf(out, "shader uploads:   %12"PRIu64"   %"PRIu64" bytes\n",
+				st.shaders, st.shader_bytes);
+		fprintf(out, "constant uploads: %12"PRIu64"   %"PRIu64" bytes\n",
+				st.consts, st.const_bytes);
+		fprintf(out, "\npackets:%53s %14s\n", "count", "dwords");
+	}
+
+	for (i = 0; i < ARRAY_SIZE(st.packets); i++) {
+		if (!st.packets[i])
+			continue;
+		sprintf(name, "type-%d", i);
+		stats_row("packet", name, st.packets[i], st.packet_dwords[i]);
+	}
+
+	if (!csv)
+		fprintf(out, "\nopcodes:%53s %14s\n", "count", "dwords");
+	for (i = 0; i < ARRAY_SIZE(st.opcodes); i++) {
+		if (!st.opcodes[i])
+			continue;
+		if ((i < ARRAY_SIZE(type3_op)) && type3_op[i].name)
+			sprintf(name, "%s (%02x)", type3_op[i].name, i);
+		else
+			sprintf(name, "(%02x)", i);
+		stats_row("opcode", name, st.opcodes[i], st.opcode_dwords[i]);
+	}
+
+	if (!csv)
+		fprintf(out, "\nregisters:%51s\n", "writes");
+	for (i = 0; i < ARRAY_SIZE(st.reg_writes); i++) {
+		if (!st.reg_writes[i])
+			continue;
+		if (type0_reg[i].name && (strlen(type0_reg[i].name) < 48))
+			sprintf(name, "%s (%04x)", type0_reg[i].name, i);
+		else
+			sprintf(name, "(%04x)", i);
+		if (csv)
+			fprintf(out, "register,%s,%"PRIu64",\n", name, st.reg_writes[i]);
+		else
+			fprintf(out, "\t%-40s %12"PRIu64"\n", name, st.reg_writes[i]);
+	}
+}
+
+/*
+ * -j N: the submits are decoded by N worker threads.  The main thread
+ * still reads the file and keeps track of the buffers, and for each submit
+ * in the window queues up a job with a snapshot of everything the decode
+ * needs: the visible buffers, and the register values as of the start of
+ * the submit.  Each job is decoded into its own memory stream, and the
+ * main thread writes them out in capture order.
+ *
+ * Whatever the main thread prints itself between two submits goes into
+ * the next job's stream, ahead of the decode, so it stays in place too.
+ */
+
+struct job {
+	struct job *next, *next_todo;
+	int submit;
+	uint32_t gpuaddr, sizedwords;   /* the cmdstream */
+	struct buffer *bufs;
+	int nbufs;
+	uint32_t (*regs)[3];            /* register, value, value at last draw */
+	int nregs, draws;
+	int shader_count;
+	FILE *out;
+	char *buf;
+	size_t len;
+	bool done;
+};
+
+static int nthreads;
+static pthread_t *threads;
+static pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_queued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t job_done = PTHREAD_COND_INITIALIZER;
+static struct job *jobs, *last_job;    /* not yet written, in capture order */
+static struct job *todo, *last_todo;   /* not yet picked up by a worker */
+static struct job *cur_job;            /* collecting the main thread's output */
+static int njobs;
+static bool quit;
+
+static void new_job(void)
+{
+	cur_job = calloc(1, sizeof(*cur_job));
+	cur_job->out = open_memstream(&cur_job->buf, &cur_job->len);
+	out = cur_job->out;
+}
+
+static void decode_job(struct job *job)
+{
+	int i;
+
+	out = job->out;
+	disasm_set_output(out);
+	submit = job->submit;
+	shader_count = job->shader_count;
+	reg_reset();
+	for (i = 0; i < job->nregs; i++) {
+		reg_write(job->regs[i][0], job->regs[i][1]);
+		type0_reg_drawn[job->regs[i][0]] = job->regs[i][2];
+	}
+	draws = job->draws;
+
+	/* the job's buffers are all that is visible to this thread: */
+	by_gpuaddr = realloc(by_gpuaddr, (job->nbufs + 1) * sizeof(by_gpuaddr[0]));
+	by_hostptr = realloc(by_hostptr, (job->nbufs + 1) * sizeof(by_hostptr[0]));
+	for (i = 0; i < job->nbufs; i++)
+		by_gpuaddr[i] = &job->bufs[i];
+	memcpy(by_hostptr, by_gpuaddr, job->nbufs * sizeof(by_hostptr[0]));
+	qsort(by_hostptr, job->nbufs, sizeof(by_hostptr[0]), cmp_hostptr);
+	nvisible = job->nbufs;
+	last_gpuaddr = last_hostptr = NULL;
+	visible_submit = submit;
+
+	dump_cmdstream(job->gpuaddr, job->sizedwords);
+}
+
+static void *worker(void *arg)
+{
+	struct job *job;
+
+	for (;;) {
+		pthread_mutex_lock(&job_lock);
+		while (!todo && !quit)
+			pthread_cond_wait(&job_queued, &job_lock);
+		job = todo;
+		if (job && !(todo = job->next_todo))
+			last_todo = NULL;
+		pthread_mutex_unlock(&job_lock);
+
+		if (!job)
+			return NULL;
+
+		decode_job(job);
+		fclose(job->out);
+
+		pthread_mutex_lock(&job_lock);
+		job->done = true;
+		pthread_cond_broadcast(&job_done);
+		pthread_mutex_unlock(&job_lock);
+	}
+}
+
+/* wait for the oldest job, and write it out: */
+static void write_job(void)
+{
+	struct job *job = jobs;
+	int i;
+
+	pthread_mutex_lock(&job_lock);
+	while (!job->done)
+		pthread_cond_wait(&job_done, &job_lock);
+	if (!(jobs = job->next))
+		last_job = NULL;
+	njobs--;
+	pthread_mutex_unlock(&job_lock);
+
+	fwrite(job->buf, 1, job->len, stdout);
+
+	for (i = 0; i < job->nbufs; i++)
+		if (job->bufs[i].owned)
+			free(job->bufs[i].hostptr);
+	free(job->bufs);
+	free(job->regs);
+	free(job->buf);
+	free(job);
+}
+
+static void add_job(struct job *job, bool decode)
+{
+	pthread_mutex_lock(&job_lock);
+	if (last_job)
+		last_job->next = job;
+	else
+		jobs = job;
+	last_job = job;
+	njobs++;
+	if (decode) {
+		if (last_todo)
+			last_todo->next_todo = job;
+		else
+			todo = job;
+		last_todo = job;
+		pthread_cond_signal(&job_queued);
+	}
+	pthread_mutex_unlock(&job_lock);
+}
+
+/* hand the current submit off to the workers: */
+static void queue_submit(uint32_t gpuaddr, uint32_t sizedwords)
+{
+	struct job *job = cur_job;
+	uint32_t *cmds;
+	int i;
+
+	job->submit = submit;
+	job->gpuaddr = gpuaddr;
+	job->sizedwords = sizedwords;
+	job->shader_count = shader_count;
+	job->regs = malloc((type0_reg_count + 1) * sizeof(job->regs[0]));
+	job->nregs = type0_reg_count;
+	for (i = 0; i < type0_reg_count; i++) {
+		job->regs[i][0] = type0_reg_list[i];
+		job->regs[i][1] = type0_reg_vals[type0_reg_list[i]];
+		job->regs[i][2] = type0_reg_drawn[type0_reg_list[i]];
+	}
+	job->draws = draws;
+
+	/* buffers which aren't in the mmap'd file can be changed or freed
+	 * before the worker gets to them, so those need copying:
+	 */
+	index_visible();
+	job->bufs = malloc((nvisible + 1) * sizeof(job->bufs[0]));
+	job->nbufs = nvisible;
+	for (i = 0; i < nvisible; i++) {
+		struct buffer *buf = &job->bufs[i];
+		*buf = *by_gpuaddr[i];
+		if (buf->owned) {
+			buf->hostptr = malloc(buf->len + 1);
+			memcpy(buf->hostptr, by_gpuaddr[i]->hostptr, buf->len);
+		}
+	}
+
+	/* and catch up with the state at the end of this submit: */
+	cmds = hostptr(gpuaddr);
+	if (cmds)
+		shadow_commands(cmds, sizedwords);
+
+	add_job(job, true);
+
+	/* don't get too far ahead of the writer: */
+	while (njobs > 2 * nthreads)
+		write_job();
+
+	new_job();
+}
+
+static void start_threads(void)
+{
+	int i;
+
+	threads = calloc(nthreads, sizeof(threads[0]));
+	for (i = 0; i < nthreads; i++)
+		pthread_create(&threads[i], NULL, worker, NULL);
+
+	new_job();
+}
+
+static void finish_threads(void)
+{
+	int i;
+
+	/* whatever was printed after the last submit: */
+	fclose(cur_job->out);
+	cur_job->done = true;
+	add_job(cur_job, false);
+	out = stdout;
+
+	while (jobs)
+		write_job();
+
+	pthread_mutex_lock(&job_lock);
+	quit = true;
+	pthread_cond_broadcast(&job_queued);
+	pthread_mutex_unlock(&job_lock);
+
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+}
+
+static void handle_section(struct rd_section *sect)
+{
+	const uint32_t *dwords = sect->data;
+	const char *str = sect->data;
+	int sz = sect->size;
+
+	if (latency) {
+		/* nothing else needs decoding: */
+		if (sect->type == RD_CMDSTREAM_ADDR)
+			submit++;
+		else if ((sect->type == RD_TIMESTAMP) &&
+				(sz >= sizeof(struct rd_timestamp)))
+			lat_timestamp(sect->data);
+		return;
+	}
+
+	/* and with --stats, --redundant or --format, only what they print: */
+	if (stats || redundant || (format != FORMAT_TEXT)) {
+		switch (sect->type) {
+		case RD_GPUADDR:
+		case RD_BUFFER_CONTENTS:
+		case RD_BUFFER_REF:
+		case RD_BUFFER_DELTA:
+		case RD_CMDSTREAM_ADDR:
+			break;
+		default:
+			return;
+		}
+	}
+
+	switch(sect->type) {
+	case RD_TEST:
+		fprintf(out, "test: %.*s\n", sz, str);
+		break;
+	case RD_CMD:
+		fprintf(out, "cmd: %.*s\n", sz, str);
+		break;
+	case RD_VERT_SHADER:
+		if (in_window())
+			fprintf(out, "vertex shader:\n%.*s\n", sz, str);
+		break;
+	case RD_FRAG_SHADER:
+		if (in_window())
+			fprintf(out, "fragment shader:\n%.*s\n", sz, str);
+		break;
+	case RD_GPUADDR:
+		pending_gpuaddr = dwords[0];
+		pending_len = dwords[1];
+		break;
+	case RD_BUFFER_CONTENTS:
+		buffer_contents(pending_gpuaddr, pending_len, sect);
+		break;
+	case RD_BUFFER_REF:
+		buffer_ref(pending_gpuaddr, pending_len,
+				dwords[0] | (uint64_t)dwords[1] << 32);
+		break;
+	case RD_BUFFER_DELTA:
+		buffer_delta(pending_gpuaddr, pending_len, sect->data, sz);
+		break;
+	case RD_CMDSTREAM_ADDR:
+		/* buffers still need to be tracked for submits outside of
+		 * the window, since later submits can refer back to them:
+		 */
+		if (in_window()) {
+			if (stats || redundant)
+				stats_submit(dwords[0], dwords[1]);
+			else if (nthreads)
+				queue_submit(dwords[0], dwords[1]);
+			else
+				dump_cmdstream(dwords[0], dwords[1]);
+		}
+		submit++;
+		break;
+	case RD_IOCTL:
+		if (dump_ioctls && in_window())
+			dump_ioctl(sect->data, sz);
+		break;
+	case RD_MEMSTAT:
+		if (in_window())
+			dump_memstat(sect->data, sz);
+		break;
+	case RD_DROPPED:
+		fprintf(out, "WARNING: %u sections dropped by the capture here, buffer "
+				"contents may be stale\n", dwords[0]);
+		break;
+	default:
+		break;
+	}
+}
+
+static int read_section(struct rd_file *f, uint64_t offset)
+{
+	struct rd_section sect;
+
+	if (rd_seek(f, offset) || !rd_next(f, &sect))
+		return -1;
+
+	handle_section(&sect);
+
+	return 0;
+}
+static int cmp_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+	return (x > y) - (x < y);
+}
+
+/* Use the index to skip ahead to first_submit.  The only state that
+ * carries across submits is buffer contents, so for each buffer we only
+ * need to load the last RD_BUFFER_CONTENTS before the window, plus any
+ * RD_BUFFER_DELTA's applied on top of it.  Everything else before the
+ * window can be skipped.
+ */
+static int skip_to_submit(struct rd_file *f, struct rd_index_entry *entries,
+		int count)
+{
+	uint32_t (*last)[2];   /* gpuaddr, index of last contents */
+	int i, j, nlast = 0;
+
+	last = malloc((count + 1) * sizeof(last[0]));
+
+	for (i = 0; (i < count) && (entries[i].submit < first_submit); i++) {
+		if (entries[i].type != RD_BUFFER_CONTENTS)
+			continue;
+		last[nlast][0] = entries[i].gpuaddr;
+		last[nlast][1] = i;
+		nlast++;
+	}
+
+	/* sort by gpuaddr, keeping the last contents of each buffer: */
+	qsort(last, nlast, sizeof(last[0]), cmp_u32);
+	for (i = 0, j = 0; i < nlast; i++) {
+		if (j && (last[j-1][0] == last[i][0])) {
+			if (last[i][1] > last[j-1][1])
+				last[j-1][1] = last[i][1];
+			continue;
+		}
+		last[j][0] = last[i][0];
+		last[j][1] = last[i][1];
+		j++;
+	}
+	nlast = j;
+
+	for (i = 0; (i < count) && (entries[i].submit < first_submit); i++) {
+		struct rd_index_entry *entry = &entries[i];
+		uint32_t key[2] = { entry->gpuaddr };
+		uint32_t (*l)[2];
+		struct buffer *buf;
+
+		switch (entry->type) {
+		case RD_TEST:
+		case RD_CMD:
+			break;
+		case RD_BUFFER_CONTENTS:
+		case RD_BUFFER_DELTA:
+			l = bsearch(key, last, nlast, sizeof(last[0]), cmp_u32);
+			if (!l || (i < (*l)[1]))
+				continue;
+			pending_gpuaddr = entry->gpuaddr;
+			if (entry->type == RD_BUFFER_CONTENTS) {
+				pending_len = entry->size;
+			} else {
+				buf = find_buffer(entry->gpuaddr);
+				pending_len = buf ? buf->len : 0;
+			}
+			break;
+		default:
+			continue;
+		}
+
+		submit = entry->submit;
+		if (read_section(f, entry->offset)) {
+			free(last);
+			return -1;
+		}
+	}
+
+	free(last);
+
+	submit = first_submit;
+
+	if (i == count)
+		return rd_seek(f, rd_size(f));
+
+	return rd_seek(f, entries[i].offset);
+}
+
+int main(int argc, char **argv)
+{
+	struct rd_index_entry *entries;
+	struct rd_section sect;
+	struct rd_file *f;
+	int count, n = 1;
+
+	init_output();
+
+	while (n < argc) {
+		if (!strcmp(argv[n], "--verbose")) {
+			disasm_set_debug(PRINT_RAW);
+			n++;
+			continue;
+		}
+
+		if (!strcmp(argv[n], "--dump-shaders")) {
+			dump_shaders = true;
+			n++;
+			continue;
+		}
+
+		if (!strcmp(argv[n], "--ioctls")) {
+			dump_ioctls = true;
+			n++;
+			continue;
+		}
+
+		if (!strcmp(argv[n], "--latency")) {
+			latency = true;
+			n++;
+			continue;
+		}
+
+		if (!strcmp(argv[n], "--delta")) {
+			delta = true;
+			n++;
+			continue;
+		}
+
+		if (!strcmp(argv[n], "--snapshot") && (n + 1 < argc)) {
+			snapshot_every = atoi(argv[n+1]);
+			n += 2;
+			continue;
+		}
+
+		if (!strcmp(argv[n], "--stats")) {
+			stats = true;
+			n++;
+			continue;
+		}
+
+		if (!strcmp(argv[n], "--redundant")) {
+			redundant = true;
+			n++;
+			continue;
+		}
+
+		if (!strncmp(argv[n], "--format=", 9)) {
+			if (!strcmp(argv[n] + 9, "jsonl")) {
+				format = FORMAT_JSONL;
+			} else if (!strcmp(argv[n] + 9, "bin")) {
+				format = FORMAT_BIN;
+			} else if (!strcmp(argv[n] + 9, "text")) {
+				format = FORMAT_TEXT;
+			} else {
+				fprintf(stderr, "unknown format: %s\n", argv[n] + 9);
+				return -1;
+			}
+			n++;
+			continue;
+		}
+
+		if (!strcmp(argv[n], "--csv")) {
+			stats = csv = true;
+			n++;
+			continue;
+		}
+
+		if (!strcmp(argv[n], "-j") && (n + 1 < argc)) {
+			nthreads = atoi(argv[n+1]);
+			n += 2;
+			continue;
+		}
+
+		if (!strcmp(argv[n], "--expand-ibs")) {
+			expand_ibs = true;
+			n++;
+			continue;
+		}
+
+		if (!strcmp(argv[n], "--submit") && (n + 1 < argc)) {
+			first_submit = last_submit = atoi(argv[n+1]);
+			n += 2;
+			continue;
+		}
+
+		if (!strcmp(argv[n], "--range") && (n + 1 < argc)) {
+			char *end;
+			first_submit = strtol(argv[n+1], &end, 0);
+			last_submit = (*end == ':') ? strtol(end + 1, NULL, 0) : -1;
+			n += 2;
+			continue;
+		}
+
+		break;
+	}
+
+	if (argc-n != 1) {
+		fprintf(stderr, "usage: %s [--verbose] [--dump-shaders] [--ioctls] "
+				"[--expand-ibs] "
+				"[--latency] [--delta [--snapshot N]] [--stats [--csv]] "
+				"[--redundant] [--format=text|jsonl|bin] "
+				"[--submit N | --range A:B] [-j N] testlog.rd\n", argv[0]);
+		return -1;
+	}
+
+	f = rd_open(argv[n]);
+	if (!f) {
+		fprintf(stderr, "could not open: %s\n", argv[n]);
+		return -1;
+	}
+
+	if (first_submit > 0) {
+		entries = rd_read_index(f, &count);
+		if (entries) {
+			if (skip_to_submit(f, entries, count))
+				fprintf(stderr, "could not seek to submit %d\n",
+						first_submit);
+			free(entries);
+		}
+	}
+
+	/* nothing to decode in parallel with --latency, --stats or --redundant: */
+	if (latency || stats || redundant || (nthreads < 0))
+		nthreads = 0;
+	if (nthreads)
+		start_threads();
+
+	while (rd_next(f, &sect)) {
+		/* with --latency, keep going to pick up the retire of the
+		 * last submits in the window:
+		 */
+		if ((last_submit >= 0) && (submit > last_submit) && !latency)
+			break;
+
+		/* the index (if any) is not interesting: */
+		if ((sect.type == RD_INDEX) || (sect.type == RD_INDEX_OFFSET))
+			break;
+
+		handle_section(&sect);
+	}
+
+	if (nthreads)
+		finish_threads();
+
+	if (latency)
+		lat_report();
+	else if (redundant)
+		redundant_report();
+	else if (stats)
+		stats_report();
+
+	rd_close(f);
+
+	return 0;
+}
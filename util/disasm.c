@@ -54,6 +54,9 @@ static const char *levels[] = {
 
 static enum debug_t debug;
 
+/* per-thread, so that cffdump can disassemble in several threads at once: */
+static __thread FILE *out;
+
 /*
  * ALU instructions:
  */
@@ -68,30 +71,30 @@ static void print_srcreg(uint32_t num, uint32_t type,
 		uint32_t swiz, uint32_t negate, uint32_t abs)
 {
 	if (negate)
-		printf("-");
+		fprintf(out, "-");
 	if (abs)
-		printf("|");
-	printf("%c%u", type ? 'R' : 'C', num);
+		fprintf(out, "|");
+	fprintf(out, "%c%u", type ? 'R' : 'C', num);
 	if (swiz) {
 		int i;
-		printf(".");
+		fprintf(out, ".");
 		for (i = 0; i < 4; i++) {
-			printf("%c", chan_names[(swiz + i) & 0x3]);
+			fprintf(out, "%c", chan_names[(swiz + i) & 0x3]);
 			swiz >>= 2;
 		}
 	}
 	if (abs)
-		printf("|");
+		fprintf(out, "|");
 }
 
 static void print_dstreg(uint32_t num, uint32_t mask, uint32_t dst_exp)
 {
-	printf("%s%u", dst_exp ? "export" : "R", num);
+	fprintf(out, "%s%u", dst_exp ? "export" : "R", num);
 	if (mask != 0xf) {
 		int i;
-		printf(".");
+		fprintf(out, ".");
 		for (i = 0; i < 4; i++) {
-			printf("%c", (mask & 0x1) ? chan_names[i] : '_');
+			fprintf(out, "%c", (mask & 0x1) ? chan_names[i] : '_');
 			mask >>= 1;
 		}
 	}
@@ -117,7 +120,7 @@ static void print_export_comment(uint32_t num, enum shader_t type)
 	 * up the name of the varying..
 	 */
 	if (name) {
-		printf("\t; %s", name);
+		fprintf(out, "\t; %s", name);
 	}
 }
 
@@ -215,36 +218,36 @@ static int disasm_alu(uint32_t *dwords, uint32_t alu_off,
 {
 	instr_alu_t *alu = (instr_alu_t *)dwords;
 
-	printf("%s", levels[level]);
+	fprintf(out, "%s", levels[level]);
 	if (debug & PRINT_RAW) {
-		printf("%02x: %08x %08x %08x\t", alu_off,
+		fprintf(out, "%02x: %08x %08x %08x\t", alu_off,
 				dwords[0], dwords[1], dwords[2]);
 	}
 
-	printf("   %sALU:\t", sync ? "(S)" : "   ");
+	fprintf(out, "   %sALU:\t", sync ? "(S)" : "   ");
 
-	printf(vector_instructions[alu->vector_opc].name);
+	fprintf(out, vector_instructions[alu->vector_opc].name);
 
 	if (alu->pred_select & 0x2) {
 		/* seems to work similar to conditional execution in ARM instruction
 		 * set, so let's use a similar syntax for now:
 		 */
-		printf((alu->pred_select & 0x1) ? "EQ" : "NE");
+		fprintf(out, (alu->pred_select & 0x1) ? "EQ" : "NE");
 	}
 
-	printf("\t");
+	fprintf(out, "\t");
 
 	print_dstreg(alu->vector_dest, alu->vector_write_mask, alu->export_data);
-	printf(" = ");
+	fprintf(out, " = ");
 	if (vector_instructions[alu->vector_opc].num_srcs == 3) {
 		print_srcreg(alu->src3_reg, alu->src3_sel, alu->src3_swiz,
 				alu->src3_reg_negate, alu->src3_reg_abs);
-		printf(", ");
+		fprintf(out, ", ");
 	}
 	print_srcreg(alu->src1_reg, alu->src1_sel, alu->src1_swiz,
 			alu->src1_reg_negate, alu->src1_reg_abs);
 	if (vector_instructions[alu->vector_opc].num_srcs > 1) {
-		printf(", ");
+		fprintf(out, ", ");
 		print_srcreg(alu->src2_reg, alu->src2_sel, alu->src2_swiz,
 				alu->src2_reg_negate, alu->src2_reg_abs);
 	}
@@ -252,29 +255,29 @@ static int disasm_alu(uint32_t *dwords, uint32_t alu_off,
 	if (alu->export_data)
 		print_export_comment(alu->vector_dest, type);
 
-	printf("\n");
+	fprintf(out, "\n");
 
 	if (alu->scalar_write_mask || !alu->vector_write_mask) {
 		/* 2nd optional scalar op: */
 
-		printf("%s", levels[level]);
+		fprintf(out, "%s", levels[level]);
 		if (debug & PRINT_RAW)
-			printf("                          \t");
+			fprintf(out, "                          \t");
 
 		if (scalar_instructions[alu->scalar_opc].name) {
-			printf("\t    \t%s\t", scalar_instructions[alu->scalar_opc].name);
+			fprintf(out, "\t    \t%s\t", scalar_instructions[alu->scalar_opc].name);
 		} else {
-			printf("\t    \tOP(%u)\t", alu->scalar_opc);
+			fprintf(out, "\t    \tOP(%u)\t", alu->scalar_opc);
 		}
 
 		print_dstreg(alu->scalar_dest, alu->scalar_write_mask, alu->export_data);
-		printf(" = ");
+		fprintf(out, " = ");
 		print_srcreg(alu->src3_reg, alu->src3_sel, alu->src3_swiz,
 				alu->src3_reg_negate, alu->src3_reg_abs);
 		// TODO ADD/MUL must have another src?!?
 		if (alu->export_data)
 			print_export_comment(alu->scalar_dest, type);
-		printf("\n");
+		fprintf(out, "\n");
 	}
 
 	return 0;
@@ -309,9 +312,9 @@ struct {
 static void print_fetch_dst(uint32_t dst_reg, uint32_t dst_swiz)
 {
 	int i;
-	printf("\tR%u.", dst_reg);
+	fprintf(out, "\tR%u.", dst_reg);
 	for (i = 0; i < 4; i++) {
-		printf("%c", chan_names[dst_swiz & 0x7]);
+		fprintf(out, "%c", chan_names[dst_swiz & 0x7]);
 		dst_swiz >>= 3;
 	}
 }
@@ -320,27 +323,27 @@ static void print_fetch_vtx(instr_fetch_t *fetch)
 {
 	instr_fetch_vtx_t *vtx = &fetch->vtx;
 	print_fetch_dst(vtx->dst_reg, vtx->dst_swiz);
-	printf(" = R%u.", vtx->src_reg);
-	printf("%c", chan_names[vtx->src_swiz & 0x3]);
+	fprintf(out, " = R%u.", vtx->src_reg);
+	fprintf(out, "%c", chan_names[vtx->src_swiz & 0x3]);
 	if (fetch_types[vtx->format].name) {
-		printf(" %s", fetch_types[vtx->format].name);
+		fprintf(out, " %s", fetch_types[vtx->format].name);
 	} else  {
-		printf(" TYPE(0x%x)", vtx->format);
+		fprintf(out, " TYPE(0x%x)", vtx->format);
 	}
-	printf(" %s", vtx->format_comp_all ? "SIGNED" : "UNSIGNED");
-	printf(" STRIDE(%u)", vtx->stride);
+	fprintf(out, " %s", vtx->format_comp_all ? "SIGNED" : "UNSIGNED");
+	fprintf(out, " STRIDE(%u)", vtx->stride);
 	if (vtx->offset)
-		printf(" OFFSET(%u)", vtx->offset);
-	printf(" CONST(%u, %u)", vtx->const_index, vtx->const_index_sel);
+		fprintf(out, " OFFSET(%u)", vtx->offset);
+	fprintf(out, " CONST(%u, %u)", vtx->const_index, vtx->const_index_sel);
 	if (vtx->pred_select)
-		printf(" COND(%u)", vtx->pred_condition);
+		fprintf(out, " COND(%u)", vtx->pred_condition);
 	if (0) {
 		// XXX
-		printf(" src_reg_am=%u", vtx->src_reg_am);
-		printf(" dst_reg_am=%u", vtx->dst_reg_am);
-		printf(" num_format_all=%u", vtx->num_format_all);
-		printf(" signed_rf_mode_all=%u", vtx->signed_rf_mode_all);
-		printf(" exp_adjust_all=%u", vtx->exp_adjust_all);
+		fprintf(out, " src_reg_am=%u", vtx->src_reg_am);
+		fprintf(out, " dst_reg_am=%u", vtx->dst_reg_am);
+		fprintf(out, " num_format_all=%u", vtx->num_format_all);
+		fprintf(out, " signed_rf_mode_all=%u", vtx->signed_rf_mode_all);
+		fprintf(out, " exp_adjust_all=%u", vtx->exp_adjust_all);
 	}
 }
 
@@ -376,41 +379,41 @@ static void print_fetch_tex(instr_fetch_t *fetch)
 	int i;
 
 	print_fetch_dst(tex->dst_reg, tex->dst_swiz);
-	printf(" = R%u.", tex->src_reg);
+	fprintf(out, " = R%u.", tex->src_reg);
 	for (i = 0; i < 3; i++) {
-		printf("%c", chan_names[src_swiz & 0x3]);
+		fprintf(out, "%c", chan_names[src_swiz & 0x3]);
 		src_swiz >>= 2;
 	}
-	printf(" CONST(%u)", tex->const_idx);
+	fprintf(out, " CONST(%u)", tex->const_idx);
 	if (tex->fetch_valid_only)
-		printf(" VALID_ONLY");
+		fprintf(out, " VALID_ONLY");
 	if (tex->tx_coord_denorm)
-		printf(" DENORM");
+		fprintf(out, " DENORM");
 	if (tex->mag_filter != TEX_FILTER_USE_FETCH_CONST)
-		printf(" MAG(%s)", filter[tex->mag_filter]);
+		fprintf(out, " MAG(%s)", filter[tex->mag_filter]);
 	if (tex->min_filter != TEX_FILTER_USE_FETCH_CONST)
-		printf(" MIN(%s)", filter[tex->min_filter]);
+		fprintf(out, " MIN(%s)", filter[tex->min_filter]);
 	if (tex->mip_filter != TEX_FILTER_USE_FETCH_CONST)
-		printf(" MIP(%s)", filter[tex->mip_filter]);
+		fprintf(out, " MIP(%s)", filter[tex->mip_filter]);
 	if (tex->aniso_filter != ANISO_FILTER_USE_FETCH_CONST)
-		printf(" ANISO(%s)", aniso_filter[tex->aniso_filter]);
+		fprintf(out, " ANISO(%s)", aniso_filter[tex->aniso_filter]);
 	if (tex->arbitrary_filter != ARBITRARY_FILTER_USE_FETCH_CONST)
-		printf(" ARBITRARY(%s)", arbitrary_filter[tex->arbitrary_filter]);
+		fprintf(out, " ARBITRARY(%s)", arbitrary_filter[tex->arbitrary_filter]);
 	if (tex->vol_mag_filter != TEX_FILTER_USE_FETCH_CONST)
-		printf(" VOL_MAG(%s)", filter[tex->vol_mag_filter]);
+		fprintf(out, " VOL_MAG(%s)", filter[tex->vol_mag_filter]);
 	if (tex->vol_min_filter != TEX_FILTER_USE_FETCH_CONST)
-		printf(" VOL_MIN(%s)", filter[tex->vol_min_filter]);
+		fprintf(out, " VOL_MIN(%s)", filter[tex->vol_min_filter]);
 	if (!tex->use_comp_lod) {
-		printf(" LOD(%u)", tex->use_comp_lod);
-		printf(" LOD_BIAS(%u)", tex->lod_bias);
+		fprintf(out, " LOD(%u)", tex->use_comp_lod);
+		fprintf(out, " LOD_BIAS(%u)", tex->lod_bias);
 	}
 	if (tex->pred_select)
-		printf(" COND(%u)", tex->pred_condition);
+		fprintf(out, " COND(%u)", tex->pred_condition);
 	if (tex->use_reg_gradients)
-		printf(" USE_REG_GRADIENTS");
-	printf(" LOCATION(%s)", sample_loc[tex->sample_location]);
+		fprintf(out, " USE_REG_GRADIENTS");
+	fprintf(out, " LOCATION(%s)", sample_loc[tex->sample_location]);
 	if (tex->offset_x || tex->offset_y || tex->offset_z)
-		printf(" OFFSET(%u,%u,%u)", tex->offset_x, tex->offset_y, tex->offset_z);
+		fprintf(out, " OFFSET(%u,%u,%u)", tex->offset_x, tex->offset_y, tex->offset_z);
 }
 
 struct {
@@ -435,16 +438,16 @@ static int disasm_fetch(uint32_t *dwords, uint32_t alu_off, int level, int sync)
 {
 	instr_fetch_t *fetch = (instr_fetch_t *)dwords;
 
-	printf("%s", levels[level]);
+	fprintf(out, "%s", levels[level]);
 	if (debug & PRINT_RAW) {
-		printf("%02x: %08x %08x %08x\t", alu_off,
+		fprintf(out, "%02x: %08x %08x %08x\t", alu_off,
 				dwords[0], dwords[1], dwords[2]);
 	}
 
-	printf("   %sFETCH:\t", sync ? "(S)" : "   ");
-	printf(fetch_instructions[fetch->opc].name);
+	fprintf(out, "   %sFETCH:\t", sync ? "(S)" : "   ");
+	fprintf(out, fetch_instructions[fetch->opc].name);
 	fetch_instructions[fetch->opc].fxn(fetch);
-	printf("\n");
+	fprintf(out, "\n");
 
 	return 0;
 }
@@ -481,37 +484,37 @@ static void print_cf_nop(instr_cf_t *cf)
 
 static void print_cf_exec(instr_cf_t *cf)
 {
-	printf(" ADDR(0x%x) CNT(0x%x)", cf->exec.address, cf->exec.count);
+	fprintf(out, " ADDR(0x%x) CNT(0x%x)", cf->exec.address, cf->exec.count);
 	if (cf->exec.yeild)
-		printf(" YIELD");
+		fprintf(out, " YIELD");
 	if (cf->exec.vc)
-		printf(" VC(0x%x)", cf->exec.vc);
+		fprintf(out, " VC(0x%x)", cf->exec.vc);
 	if (cf->exec.bool_addr)
-		printf(" BOOL_ADDR(0x%x)", cf->exec.bool_addr);
+		fprintf(out, " BOOL_ADDR(0x%x)", cf->exec.bool_addr);
 	if (cf->exec.address_mode == ABSOLUTE_ADDR)
-		printf(" ABSOLUTE_ADDR");
+		fprintf(out, " ABSOLUTE_ADDR");
 	if (cf_cond_exec(cf))
-		printf(" COND(%d)", cf->exec.condition);
+		fprintf(out, " COND(%d)", cf->exec.condition);
 }
 
 static void print_cf_loop(instr_cf_t *cf)
 {
-	printf(" ADDR(0x%x) LOOP_ID(%d)", cf->loop.address, cf->loop.loop_id);
+	fprintf(out, " ADDR(0x%x) LOOP_ID(%d)", cf->loop.address, cf->loop.loop_id);
 	if (cf->loop.address_mode == ABSOLUTE_ADDR)
-		printf(" ABSOLUTE_ADDR");
+		fprintf(out, " ABSOLUTE_ADDR");
 }
 
 static void print_cf_jmp_call(instr_cf_t *cf)
 {
-	printf(" ADDR(0x%x) DIR(%d)", cf->jmp_call.address, cf->jmp_call.direction);
+	fprintf(out, " ADDR(0x%x) DIR(%d)", cf->jmp_call.address, cf->jmp_call.direction);
 	if (cf->jmp_call.force_call)
-		printf(" FORCE_CALL");
+		fprintf(out, " FORCE_CALL");
 	if (cf->jmp_call.predicated_jmp)
-		printf(" COND(%d)", cf->jmp_call.condition);
+		fprintf(out, " COND(%d)", cf->jmp_call.condition);
 	if (cf->jmp_call.bool_addr)
-		printf(" BOOL_ADDR(0x%x)", cf->jmp_call.bool_addr);
+		fprintf(out, " BOOL_ADDR(0x%x)", cf->jmp_call.bool_addr);
 	if (cf->jmp_call.address_mode == ABSOLUTE_ADDR)
-		printf(" ABSOLUTE_ADDR");
+		fprintf(out, " ABSOLUTE_ADDR");
 }
 
 static void print_cf_alloc(instr_cf_t *cf)
@@ -522,11 +525,11 @@ static void print_cf_alloc(instr_cf_t *cf)
 			[SQ_PARAMETER_PIXEL] = "PARAM/PIXEL",
 			[SQ_MEMORY] = "MEMORY",
 	};
-	printf(" %s SIZE(0x%x)", bufname[cf->alloc.buffer_select], cf->alloc.size);
+	fprintf(out, " %s SIZE(0x%x)", bufname[cf->alloc.buffer_select], cf->alloc.size);
 	if (cf->alloc.no_serial)
-		printf(" NO_SERIAL");
+		fprintf(out, " NO_SERIAL");
 	if (cf->alloc.alloc_mode) // ???
-		printf(" ALLOC_MODE");
+		fprintf(out, " ALLOC_MODE");
 }
 
 struct {
@@ -555,15 +558,15 @@ struct {
 
 static void print_cf(instr_cf_t *cf, int level)
 {
-	printf("%s", levels[level]);
+	fprintf(out, "%s", levels[level]);
 	if (debug & PRINT_RAW) {
 		uint16_t *words = (uint16_t *)cf;
-		printf("    %04x %04x %04x            \t",
+		fprintf(out, "    %04x %04x %04x            \t",
 				words[0], words[1], words[2]);
 	}
-	printf(cf_instructions[cf->opc].name);
+	fprintf(out, cf_instructions[cf->opc].name);
 	cf_instructions[cf->opc].fxn(cf);
-	printf("\n");
+	fprintf(out, "\n");
 }
 
 /*
@@ -578,6 +581,9 @@ int disasm(uint32_t *dwords, int sizedwords, int level, enum shader_t type)
 	instr_cf_t *cfs = (instr_cf_t *)dwords;
 	int off, idx, max_idx;
 
+	if (!out)
+		out = stdout;
+
 	for (idx = 0; ; idx++) {
 		instr_cf_t *cf = &cfs[idx];
 		if (cf_exec(cf)) {
@@ -613,3 +619,8 @@ void disasm_set_debug(enum debug_t d)
 {
 	debug= d;
 }
+
+void disasm_set_output(FILE *f)
+{
+	out = f;
+}
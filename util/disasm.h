@@ -36,5 +36,6 @@ enum debug_t {
 
 int disasm(uint32_t *dwords, int sizedwords, int level, enum shader_t type);
 void disasm_set_debug(enum debug_t debug);
+void disasm_set_output(FILE *f);
 
 #endif /* DISASM_H_ */
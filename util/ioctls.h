@@ -0,0 +1,131 @@
+/*
+ * Copyright (c) 2012 Rob Clark <robdclark@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef IOCTLS_H_
+#define IOCTLS_H_
+
+#include <stddef.h>
+#include <sys/ioctl.h>
+
+#include "msm_kgsl.h"
+#include "android_pmem.h"
+#include "redump.h"
+
+/* Names of the ioctls that libwrap logs, shared between libwrap, which
+ * prints them as they happen, and cffdump --ioctls, which renders them
+ * from the RD_IOCTL sections of a binary ioctl log.
+ */
+
+struct device_info {
+	const char *name;
+	struct {
+		const char *name;
+	} ioctl_info[_IOC_NR(0xffffffff)];
+};
+
+#define IOCTL_INFO(n) \
+		[_IOC_NR(n)] = { .name = #n }
+
+static struct device_info kgsl_3d_info = {
+		.name = "kgsl-3d",
+		.ioctl_info = {
+				IOCTL_INFO(IOCTL_KGSL_DEVICE_GETPROPERTY),
+				IOCTL_INFO(IOCTL_KGSL_DEVICE_WAITTIMESTAMP),
+				IOCTL_INFO(IOCTL_KGSL_RINGBUFFER_ISSUEIBCMDS),
+				IOCTL_INFO(IOCTL_KGSL_CMDSTREAM_READTIMESTAMP),
+				IOCTL_INFO(IOCTL_KGSL_CMDSTREAM_FREEMEMONTIMESTAMP),
+				IOCTL_INFO(IOCTL_KGSL_DRAWCTXT_CREATE),
+				IOCTL_INFO(IOCTL_KGSL_DRAWCTXT_DESTROY),
+				IOCTL_INFO(IOCTL_KGSL_MAP_USER_MEM),
+				IOCTL_INFO(IOCTL_KGSL_SHAREDMEM_FROM_PMEM),
+				IOCTL_INFO(IOCTL_KGSL_SHAREDMEM_FREE),
+				IOCTL_INFO(IOCTL_KGSL_SHAREDMEM_FROM_VMALLOC),
+				IOCTL_INFO(IOCTL_KGSL_SHAREDMEM_FLUSH_CACHE),
+				IOCTL_INFO(IOCTL_KGSL_GPUMEM_ALLOC),
+				IOCTL_INFO(IOCTL_KGSL_CFF_SYNCMEM),
+				IOCTL_INFO(IOCTL_KGSL_CFF_USER_EVENT),
+				IOCTL_INFO(IOCTL_KGSL_TIMESTAMP_EVENT),
+				/* kgsl-3d specific ioctls: */
+				IOCTL_INFO(IOCTL_KGSL_DRAWCTXT_SET_BIN_BASE_OFFSET),
+		},
+};
+
+// kgsl-2d => Z180 vector graphcis core.. not sure if it is interesting..
+static struct device_info kgsl_2d_info = {
+		.name = "kgsl-2d",
+		.ioctl_info = {
+				IOCTL_INFO(IOCTL_KGSL_DEVICE_GETPROPERTY),
+				IOCTL_INFO(IOCTL_KGSL_DEVICE_WAITTIMESTAMP),
+				IOCTL_INFO(IOCTL_KGSL_RINGBUFFER_ISSUEIBCMDS),
+				IOCTL_INFO(IOCTL_KGSL_CMDSTREAM_READTIMESTAMP),
+				IOCTL_INFO(IOCTL_KGSL_CMDSTREAM_FREEMEMONTIMESTAMP),
+				IOCTL_INFO(IOCTL_KGSL_DRAWCTXT_CREATE),
+				IOCTL_INFO(IOCTL_KGSL_DRAWCTXT_DESTROY),
+				IOCTL_INFO(IOCTL_KGSL_MAP_USER_MEM),
+				IOCTL_INFO(IOCTL_KGSL_SHAREDMEM_FROM_PMEM),
+				IOCTL_INFO(IOCTL_KGSL_SHAREDMEM_FREE),
+				IOCTL_INFO(IOCTL_KGSL_SHAREDMEM_FROM_VMALLOC),
+				IOCTL_INFO(IOCTL_KGSL_SHAREDMEM_FLUSH_CACHE),
+				IOCTL_INFO(IOCTL_KGSL_GPUMEM_ALLOC),
+				IOCTL_INFO(IOCTL_KGSL_CFF_SYNCMEM),
+				IOCTL_INFO(IOCTL_KGSL_CFF_USER_EVENT),
+				IOCTL_INFO(IOCTL_KGSL_TIMESTAMP_EVENT),
+				/* no kgsl-2d specific ioctls, I don't think.. */
+		},
+};
+
+static struct device_info pmem_info = {
+		.name = "pmem-gpu",
+		.ioctl_info = {
+				IOCTL_INFO(PMEM_GET_PHYS),
+				IOCTL_INFO(PMEM_MAP),
+				IOCTL_INFO(PMEM_GET_SIZE),
+				IOCTL_INFO(PMEM_UNMAP),
+				IOCTL_INFO(PMEM_ALLOCATE),
+				IOCTL_INFO(PMEM_CONNECT),
+				IOCTL_INFO(PMEM_GET_TOTAL_SIZE),
+				IOCTL_INFO(HW3D_REVOKE_GPU),
+				IOCTL_INFO(HW3D_GRANT_GPU),
+				IOCTL_INFO(HW3D_WAIT_FOR_INTERRUPT),
+				IOCTL_INFO(PMEM_CLEAN_INV_CACHES),
+				IOCTL_INFO(PMEM_CLEAN_CACHES),
+				IOCTL_INFO(PMEM_INV_CACHES),
+				IOCTL_INFO(PMEM_GET_FREE_SPACE),
+				IOCTL_INFO(PMEM_ALLOCATE_ALIGNED),
+		},
+};
+
+#define PROP_INFO(n) [n] = #n
+static const char *propnames[] = {
+		PROP_INFO(KGSL_PROP_DEVICE_INFO),
+		PROP_INFO(KGSL_PROP_DEVICE_SHADOW),
+		PROP_INFO(KGSL_PROP_DEVICE_POWER),
+		PROP_INFO(KGSL_PROP_SHMEM),
+		PROP_INFO(KGSL_PROP_SHMEM_APERTURES),
+		PROP_INFO(KGSL_PROP_MMU_ENABLE),
+		PROP_INFO(KGSL_PROP_INTERRUPT_WAITS),
+		PROP_INFO(KGSL_PROP_VERSION),
+		PROP_INFO(KGSL_PROP_GPU_RESET_STAT),
+};
+
+#endif /* IOCTLS_H_ */
@@ -32,6 +32,7 @@
 
 #include "redump.h"
 #include "disasm.h"
+#include "rd.h"
 
 struct pgm_header {
 	uint32_t size;
@@ -518,10 +519,11 @@ void dump_program(char *buf, int sz)
 
 int main(int argc, char **argv)
 {
-	enum rd_sect_type type = RD_NONE;
+	struct rd_section sect;
 	void *buf = NULL;
 	const char *infile;
-	int fd, sz, i, raw = 0;
+	struct rd_file *f;
+	int fd, i, raw = 0;
 
 	/* lame argument parsing: */
 	if ((argc > 1) && !strcmp(argv[1], "--verbose")) {
@@ -548,50 +550,60 @@ int main(int argc, char **argv)
 
 	infile = argv[1];
 
-	fd = open(infile, O_RDONLY);
-	if (fd < 0)
-		fprintf(stderr, "could not open: %s\n", argv[1]);
-
 	if (raw) {
 		enum shader_t shader = 0;
 		if (!strcmp(infile + strlen(infile) - 3, ".vo"))
 			shader = SHADER_VERTEX;
 		else if (!strcmp(infile + strlen(infile) - 3, ".fo"))
 			shader = SHADER_FRAGMENT;
+		fd = open(infile, O_RDONLY);
+		if (fd < 0) {
+			fprintf(stderr, "could not open: %s\n", infile);
+			return -1;
+		}
 		buf = calloc(1, 100 * 1024);
 		read(fd, buf, 100 * 1024);
 		return disasm(buf, 100 * 1024, 0, shader);
 	}
 
-	while ((read(fd, &type, sizeof(type)) > 0) && (read(fd, &sz, 4) > 0)) {
-		free(buf);
+	f = rd_open(infile);
+	if (!f) {
+		fprintf(stderr, "could not open: %s\n", infile);
+		return -1;
+	}
+
+	while (rd_next(f, &sect)) {
+		const char *str = sect.data;
+		int sz = sect.size;
 
-		/* note: allow hex dumps to go a bit past the end of the buffer..
-		 * might see some garbage, but better than missing the last few bytes..
+		/* note: hex dumps are allowed to go a bit past the end of the
+		 * section.. might see some garbage, but better than missing the
+		 * last few bytes..
 		 */
-		buf = calloc(1, sz + 3);
-		read(fd, buf, sz);
-
-		switch(type) {
+		switch(sect.type) {
 		case RD_TEST:
 			if (full_dump)
-				printf("test: %s\n", (char *)buf);
+				printf("test: %.*s\n", sz, str);
 			break;
 		case RD_VERT_SHADER:
-			printf("vertex shader:\n%s\n", (char *)buf);
+			printf("vertex shader:\n%.*s\n", sz, str);
 			break;
 		case RD_FRAG_SHADER:
-			printf("fragment shader:\n%s\n", (char *)buf);
+			printf("fragment shader:\n%.*s\n", sz, str);
 			break;
 		case RD_PROGRAM:
 			printf("############################################################\n");
 			printf("program:\n");
-			dump_program(buf, sz);
+			dump_program((char *)str, sz);
 			printf("############################################################\n");
 			break;
+		default:
+			break;
 		}
 	}
 
+	rd_close(f);
+
 	return 0;
 }
 
@@ -0,0 +1,186 @@
+/*
+ * Copyright (c) 2012 Rob Clark <robdclark@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* Append a RD_INDEX to an existing .rd file, ie. one captured without
+ * WRAP_INDEX=1, so that cffdump can seek straight to a given submit.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <string.h>
+
+#include "redump.h"
+#include "rd.h"
+#include "rdz.h"
+
+static struct rd_index_entry *entries;
+static int count, max;
+
+static void add_entry(uint32_t type, uint32_t size, uint32_t submit,
+		uint32_t gpuaddr, uint64_t offset)
+{
+	struct rd_index_entry *entry;
+
+	if (count == max) {
+		max = max ? max * 2 : 1024;
+		entries = realloc(entries, max * sizeof(entries[0]));
+	}
+
+	entry = &entries[count++];
+	entry->type    = type;
+	entry->size    = size;
+	entry->submit  = submit;
+	entry->gpuaddr = gpuaddr;
+	entry->offset  = offset;
+}
+
+static int write_full(int fd, const void *buf, int sz)
+{
+	const uint8_t *p = buf;
+	while (sz > 0) {
+		int ret = write(fd, p, sz);
+		if (ret <= 0)
+			return -1;
+		p += ret;
+		sz -= ret;
+	}
+	return 0;
+}
+
+/* write out the data, split up into frames if the file is compressed: */
+static int append(int fd, int compressed, const uint8_t *data, int sz)
+{
+	static uint8_t zbuf[RDZ_BOUND(RDZ_FRAME_SIZE)];
+
+	if (!compressed)
+		return write_full(fd, data, sz);
+
+	while (sz > 0) {
+		int n = (sz < RDZ_FRAME_SIZE) ? sz : RDZ_FRAME_SIZE;
+		int zlen = rdz_compress(data, n, zbuf, sizeof(zbuf));
+		uint32_t hdr[2] = { n, n | RDZ_STORED };
+		const void *payload = data;
+
+		if (zlen && (zlen < n)) {
+			hdr[1] = zlen;
+			payload = zbuf;
+		}
+
+		if (write_full(fd, hdr, sizeof(hdr)) ||
+				write_full(fd, payload, hdr[1] & ~RDZ_STORED))
+			return -1;
+
+		data += n;
+		sz -= n;
+	}
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	uint32_t hdr[2], submit = 0, gpuaddr = 0;
+	uint64_t offset = 0;
+	struct rd_section sect;
+	struct rd_file *f;
+	uint8_t *buf, *out;
+	int compressed, fd, n, outsz;
+
+	if (argc != 2) {
+		fprintf(stderr, "usage: %s testlog.rd\n", argv[0]);
+		return -1;
+	}
+
+	f = rd_open(argv[1]);
+	if (!f) {
+		fprintf(stderr, "could not open: %s\n", argv[1]);
+		return -1;
+	}
+
+	if ((entries = rd_read_index(f, &n))) {
+		printf("%s: already indexed, %d sections\n", argv[1], n);
+		rd_close(f);
+		return 0;
+	}
+
+	while (rd_next(f, &sect)) {
+		if ((sect.type == RD_GPUADDR) && (sect.size >= sizeof(uint32_t)))
+			gpuaddr = *(const uint32_t *)sect.data;
+
+		add_entry(sect.type, sect.size, submit, gpuaddr, sect.offset);
+
+		if (sect.type == RD_CMDSTREAM_ADDR)
+			submit++;
+
+		offset = sect.offset + sizeof(hdr) + sect.size;
+	}
+
+	/* appending after a partial section would just result in a file
+	 * that can't be parsed:
+	 */
+	if (offset != rd_size(f)) {
+		fprintf(stderr, "%s: not indexing truncated file\n", argv[1]);
+		rd_close(f);
+		return -1;
+	}
+
+	compressed = rd_compressed(f);
+	rd_close(f);
+
+	/* build up the RD_INDEX and RD_INDEX_OFFSET sections: */
+	outsz = 2 * sizeof(hdr) + count * sizeof(entries[0]) + sizeof(offset);
+	out = malloc(outsz);
+	buf = out;
+
+	hdr[0] = RD_INDEX;
+	hdr[1] = count * sizeof(entries[0]);
+	memcpy(buf, hdr, sizeof(hdr));
+	buf += sizeof(hdr);
+	memcpy(buf, entries, hdr[1]);
+	buf += hdr[1];
+
+	hdr[0] = RD_INDEX_OFFSET;
+	hdr[1] = sizeof(offset);
+	memcpy(buf, hdr, sizeof(hdr));
+	buf += sizeof(hdr);
+	memcpy(buf, &offset, sizeof(offset));
+
+	fd = open(argv[1], O_WRONLY | O_APPEND);
+	if ((fd < 0) || append(fd, compressed, out, outsz)) {
+		fprintf(stderr, "could not write index: %s\n", argv[1]);
+		return -1;
+	}
+	close(fd);
+
+	printf("%s: indexed %d sections, %u submits\n", argv[1], count, submit);
+
+	free(out);
+	free(entries);
+
+	return 0;
+}
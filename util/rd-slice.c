@@ -0,0 +1,467 @@
+/*
+ * Copyright (c) 2012 Rob Clark <robdclark@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* Extract some of the submits from a .rd file into a new, self-contained
+ * one, which cffdump can decode on its own:
+ *
+ *   rd-slice --range 40:50 big.rd small.rd
+ *
+ * The input is read in a single pass.  Before the window, only where the
+ * latest contents of each buffer are in the file is remembered (the last
+ * RD_BUFFER_CONTENTS, plus any RD_BUFFER_DELTA's since), not the contents
+ * themselves, so memory use doesn't grow with the size of the capture.
+ * The first time a submit in the window refers back to one of those
+ * buffers, its contents are read back, resolved, and written out ahead
+ * of the reference.  Buffers that the window never uses aren't written.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <string.h>
+
+#include "redump.h"
+#include "rd.h"
+#include "rdz.h"
+
+#define NO_OFFSET (~(uint64_t)0)
+
+struct buffer {
+	uint32_t gpuaddr, len;
+	uint64_t contents;      /* offset of the last RD_BUFFER_CONTENTS */
+	uint64_t *deltas;       /* offsets of RD_BUFFER_DELTA's since then */
+	int ndeltas, maxdeltas;
+	int written;            /* already part of the slice */
+};
+
+/* open addressed hash table of buffers, by gpuaddr: */
+static struct buffer *buffers;
+static uint32_t nbuffers, maxbuffers;
+
+static struct buffer * find_buffer(uint32_t gpuaddr, int create);
+
+static void grow_buffers(void)
+{
+	struct buffer *old = buffers;
+	uint32_t i, oldmax = maxbuffers;
+
+	maxbuffers = maxbuffers ? maxbuffers * 2 : 1024;
+	buffers = calloc(maxbuffers, sizeof(buffers[0]));
+	nbuffers = 0;
+
+	for (i = 0; i < oldmax; i++)
+		if (old[i].gpuaddr)
+			*find_buffer(old[i].gpuaddr, 1) = old[i];
+
+	free(old);
+}
+
+static struct buffer * find_buffer(uint32_t gpuaddr, int create)
+{
+	uint32_t i;
+
+	if (!gpuaddr)
+		return NULL;
+
+	if (create && ((nbuffers + 1) * 2 > maxbuffers))
+		grow_buffers();
+
+	if (!maxbuffers)
+		return NULL;
+
+	for (i = (gpuaddr * 2654435761u) & (maxbuffers - 1); ;
+			i = (i + 1) & (maxbuffers - 1)) {
+		struct buffer *buf = &buffers[i];
+		if (buf->gpuaddr == gpuaddr)
+			return buf;
+		if (!buf->gpuaddr) {
+			if (!create)
+				return NULL;
+			buf->gpuaddr = gpuaddr;
+			buf->contents = NO_OFFSET;
+			nbuffers++;
+			return buf;
+		}
+	}
+}
+
+/*
+ * Output, compressed the same way as the input:
+ */
+
+static int out_fd = -1, out_compressed;
+static uint8_t out_frame[RDZ_FRAME_SIZE];
+static int out_len;
+static uint64_t out_total;
+
+static int write_full(int fd, const void *buf, int sz)
+{
+	const uint8_t *p = buf;
+	while (sz > 0) {
+		int ret = write(fd, p, sz);
+		if (ret <= 0)
+			return -1;
+		p += ret;
+		sz -= ret;
+	}
+	return 0;
+}
+
+static int out_flush(void)
+{
+	static uint8_t zbuf[RDZ_BOUND(RDZ_FRAME_SIZE)];
+	uint32_t hdr[2] = { out_len, out_len | RDZ_STORED };
+	const void *payload = out_frame;
+	int zlen, ret;
+
+	if (!out_len)
+		return 0;
+
+	if (!out_compressed) {
+		ret = write_full(out_fd, out_frame, out_len);
+		out_len = 0;
+		return ret;
+	}
+
+	zlen = rdz_compress(out_frame, out_len, zbuf, sizeof(zbuf));
+	if (zlen && (zlen < out_len)) {
+		hdr[1] = zlen;
+		payload = zbuf;
+	}
+
+	out_len = 0;
+
+	if (write_full(out_fd, hdr, sizeof(hdr)) ||
+			write_full(out_fd, payload, hdr[1] & ~RDZ_STORED))
+		return -1;
+
+	return 0;
+}
+
+static int out_write(const void *buf, uint32_t sz)
+{
+	const uint8_t *p = buf;
+
+	out_total += sz;
+
+	while (sz > 0) {
+		uint32_t n = sizeof(out_frame) - out_len;
+		if (n > sz)
+			n = sz;
+		memcpy(out_frame + out_len, p, n);
+		out_len += n;
+		p += n;
+		sz -= n;
+		if ((out_len == sizeof(out_frame)) && out_flush())
+			return -1;
+	}
+
+	return 0;
+}
+
+static int out_section(uint32_t type, const void *data, uint32_t sz)
+{
+	uint32_t hdr[2] = { type, sz };
+	if (out_write(hdr, sizeof(hdr)) || out_write(data, sz))
+		return -1;
+	return 0;
+}
+
+/*
+ * Resolving buffer contents from before the window:
+ */
+
+static void apply_delta(struct buffer *buf, uint8_t *contents, uint32_t len,
+		const uint8_t *data, uint32_t sz)
+{
+	const uint8_t *end = data + sz;
+	uint32_t nruns;
+
+	if (sz < 4)
+		return;
+
+	memcpy(&nruns, data, 4);
+	data += 4;
+
+	while (nruns--) {
+		uint32_t run[2];  /* offset, len */
+
+		if ((end - data) < sizeof(run))
+			break;
+		memcpy(run, data, sizeof(run));
+		data += sizeof(run);
+
+		if (((end - data) < run[1]) || ((run[0] + run[1]) > len)) {
+			fprintf(stderr, "bad buffer delta: %08x (%d)\n",
+					buf->gpuaddr, buf->len);
+			break;
+		}
+
+		memcpy(contents + run[0], data, run[1]);
+		data += run[1];
+	}
+}
+
+/* read back the buffer's last contents and deltas (through a second
+ * handle, so as not to disturb the main pass), and write out the result:
+ */
+static int write_contents(struct rd_file *f, struct buffer *buf)
+{
+	static uint8_t *contents;
+	static uint32_t maxlen;
+	struct rd_section sect;
+	uint32_t len;
+	int i;
+
+	if (rd_seek(f, buf->contents) || !rd_next(f, &sect) ||
+			(sect.type != RD_BUFFER_CONTENTS))
+		return -1;
+
+	len = sect.size;
+	if (len > maxlen) {
+		maxlen = len;
+		free(contents);
+		contents = malloc(maxlen);
+	}
+	memcpy(contents, sect.data, len);
+
+	for (i = 0; i < buf->ndeltas; i++) {
+		if (rd_seek(f, buf->deltas[i]) || !rd_next(f, &sect) ||
+				(sect.type != RD_BUFFER_DELTA))
+			return -1;
+		apply_delta(buf, contents, len, sect.data, sect.size);
+	}
+
+	return out_section(RD_BUFFER_CONTENTS, contents, len);
+}
+
+static void forget_contents(struct buffer *buf)
+{
+	buf->contents = NO_OFFSET;
+	buf->ndeltas = 0;
+}
+
+static void add_delta(struct buffer *buf, uint64_t offset)
+{
+	if (buf->ndeltas == buf->maxdeltas) {
+		buf->maxdeltas = buf->maxdeltas ? buf->maxdeltas * 2 : 8;
+		buf->deltas = realloc(buf->deltas,
+				buf->maxdeltas * sizeof(buf->deltas[0]));
+	}
+	buf->deltas[buf->ndeltas++] = offset;
+}
+
+/* the sections that libwrap writes after a submit's RD_CMDSTREAM_ADDRs,
+ * before anything of the next ioctl:
+ */
+static int trails_submit(const struct rd_section *sect)
+{
+	if ((sect->type == RD_TIMESTAMP) &&
+			(sect->size >= sizeof(struct rd_timestamp))) {
+		const struct rd_timestamp *t = sect->data;
+		return (t->event == RD_TS_SUBMIT) || (t->event == RD_TS_SUBMITTED);
+	}
+
+	if ((sect->type == RD_IOCTL) &&
+			(sect->size >= sizeof(struct rd_ioctl))) {
+		const struct rd_ioctl *ioc = sect->data;
+		return ioc->post;
+	}
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	int first_submit = -1, last_submit = -1, submit = 0, n = 1;
+	uint32_t pending_gpuaddr = 0, pending_len = 0, magic = RDZ_MAGIC;
+	int nsections = 0, nresolved = 0;
+	struct rd_file *f, *back;
+	struct rd_section sect;
+	const char *in, *out;
+	uint32_t i;
+
+	while (n < argc) {
+		if (!strcmp(argv[n], "--submit") && (n + 1 < argc)) {
+			first_submit = last_submit = atoi(argv[n+1]);
+			n += 2;
+			continue;
+		}
+
+		if (!strcmp(argv[n], "--range") && (n + 1 < argc)) {
+			char *end;
+			first_submit = strtol(argv[n+1], &end, 0);
+			/* A: for everything from A on: */
+			last_submit = ((*end == ':') && end[1]) ?
+					strtol(end + 1, NULL, 0) : -1;
+			n += 2;
+			continue;
+		}
+
+		break;
+	}
+
+	if ((argc - n != 2) || (first_submit < 0)) {
+		fprintf(stderr, "usage: %s --submit N | --range A:[B] in.rd out.rd\n",
+				argv[0]);
+		return -1;
+	}
+
+	in = argv[n];
+	out = argv[n+1];
+
+	f = rd_open(in);
+	back = rd_open(in);
+	if (!f || !back) {
+		fprintf(stderr, "could not open: %s\n", in);
+		return -1;
+	}
+
+	out_fd = open(out, O_WRONLY | O_TRUNC | O_CREAT, 0644);
+	if (out_fd < 0) {
+		fprintf(stderr, "could not open: %s\n", out);
+		return -1;
+	}
+
+	out_compressed = rd_compressed(f);
+	if (out_compressed && write_full(out_fd, &magic, sizeof(magic)))
+		goto fail;
+
+	while (rd_next(f, &sect)) {
+		struct buffer *buf;
+		int in_window = (submit >= first_submit);
+
+		/* past the window's last RD_CMDSTREAM_ADDR, keep what still
+		 * belongs to that submit, up to the first section of the next:
+		 */
+		if ((last_submit >= 0) && (submit > last_submit) &&
+				!trails_submit(&sect))
+			break;
+
+		/* a new index is easy enough to add with rd-index: */
+		if ((sect.type == RD_INDEX) || (sect.type == RD_INDEX_OFFSET))
+			break;
+
+		if (sect.type == RD_GPUADDR) {
+			const uint32_t *dwords = sect.data;
+			pending_gpuaddr = dwords[0];
+			pending_len = dwords[1];
+		}
+
+		if (!in_window) {
+			switch (sect.type) {
+			case RD_TEST:
+			case RD_CMD:
+				/* describes the whole capture, so keep it: */
+				if (out_section(sect.type, sect.data, sect.size))
+					goto fail;
+				nsections++;
+				break;
+			case RD_BUFFER_CONTENTS:
+				buf = find_buffer(pending_gpuaddr, 1);
+				if (!buf)
+					break;
+				buf->len = pending_len;
+				buf->contents = sect.offset;
+				buf->ndeltas = 0;
+				break;
+			case RD_BUFFER_DELTA:
+				buf = find_buffer(pending_gpuaddr, 0);
+				if (buf && (buf->contents != NO_OFFSET))
+					add_delta(buf, sect.offset);
+				break;
+			case RD_CMDSTREAM_ADDR:
+				submit++;
+				break;
+			default:
+				break;
+			}
+			continue;
+		}
+
+		switch (sect.type) {
+		case RD_BUFFER_CONTENTS:
+			buf = find_buffer(pending_gpuaddr, 0);
+			if (buf) {
+				forget_contents(buf);
+				buf->written = 1;
+			}
+			break;
+		case RD_BUFFER_REF:
+		case RD_BUFFER_DELTA:
+			buf = find_buffer(pending_gpuaddr, 0);
+			if (buf && !buf->written && (buf->contents != NO_OFFSET)) {
+				if (write_contents(back, buf)) {
+					fprintf(stderr, "could not resolve buffer: %08x\n",
+							buf->gpuaddr);
+					goto fail;
+				}
+				forget_contents(buf);
+				nresolved++;
+				nsections++;
+			}
+			if (buf)
+				buf->written = 1;
+			break;
+		case RD_CMDSTREAM_ADDR:
+			submit++;
+			break;
+		default:
+			break;
+		}
+
+		if (out_section(sect.type, sect.data, sect.size))
+			goto fail;
+		nsections++;
+	}
+
+	if (out_flush())
+		goto fail;
+	close(out_fd);
+
+	if (submit <= first_submit)
+		fprintf(stderr, "%s: only has %d submits\n", in, submit);
+
+	printf("%s: %d submits, %d sections (%d buffers resolved from before "
+			"the window), %llu of %llu bytes\n", out, submit - first_submit,
+			nsections, nresolved, (unsigned long long)out_total,
+			(unsigned long long)rd_size(f));
+
+	for (i = 0; i < maxbuffers; i++)
+		free(buffers[i].deltas);
+	free(buffers);
+	rd_close(back);
+	rd_close(f);
+
+	return 0;
+
+fail:
+	fprintf(stderr, "could not write: %s\n", out);
+	close(out_fd);
+	unlink(out);
+	return -1;
+}
@@ -0,0 +1,318 @@
+/*
+ * Copyright (c) 2012 Rob Clark <robdclark@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "rd.h"
+#include "rdz.h"
+
+struct rd_file {
+	const char *path;
+
+	/* uncompressed files are mmap'd: */
+	uint8_t *map;
+	size_t mapsz;
+
+	/* otherwise read through rdz: */
+	struct rdz_file *z;
+
+	uint64_t pos, size;
+
+	/* for sections that can't be handed out directly: */
+	uint8_t *buf;
+	uint32_t bufsz;
+};
+
+static int map_file(struct rd_file *f, int fd)
+{
+	long pagesize = sysconf(_SC_PAGESIZE);
+	struct stat st;
+	uint32_t magic;
+	void *map;
+
+	if (fstat(fd, &st) || (st.st_size == 0) ||
+			((uint64_t)st.st_size != (size_t)st.st_size))
+		return -1;
+
+	if ((pread(fd, &magic, sizeof(magic), 0) == sizeof(magic)) &&
+			(magic == RDZ_MAGIC))
+		return -1;
+
+	/* reserve an extra page of zeros past the end of the file, which
+	 * is not part of any section but means the tools can peek a few
+	 * bytes past the end of the last one:
+	 */
+	f->mapsz = st.st_size + pagesize;
+	f->map = mmap(NULL, f->mapsz, PROT_READ,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (f->map == MAP_FAILED) {
+		f->map = NULL;
+		return -1;
+	}
+
+	map = mmap(f->map, st.st_size, PROT_READ,
+			MAP_PRIVATE | MAP_FIXED, fd, 0);
+	if (map == MAP_FAILED) {
+		munmap(f->map, f->mapsz);
+		f->map = NULL;
+		return -1;
+	}
+
+	madvise(f->map, st.st_size, MADV_SEQUENTIAL);
+	f->size = st.st_size;
+
+	return 0;
+}
+
+struct rd_file * rd_open(const char *path)
+{
+	struct rd_file *f;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+
+	f = calloc(1, sizeof(*f));
+	f->path = path;
+
+	if (map_file(f, fd)) {
+		f->z = rdz_open(path);
+		if (!f->z) {
+			close(fd);
+			free(f);
+			return NULL;
+		}
+	}
+
+	/* the mapping stays valid after the fd is closed: */
+	close(fd);
+
+	return f;
+}
+
+static void truncated(struct rd_file *f)
+{
+	fprintf(stderr, "%s: truncated section at offset %llu, ignoring\n",
+			f->path, (unsigned long long)f->pos);
+}
+
+static void *get_buf(struct rd_file *f, uint32_t sz)
+{
+	if ((sz + 4) > f->bufsz) {
+		f->bufsz = sz + 4;
+		free(f->buf);
+		f->buf = malloc(f->bufsz);
+	}
+	/* keep text sections nul terminated, and like the mmap case let
+	 * the tools peek a few bytes past the end:
+	 */
+	memset(f->buf + sz, 0, 4);
+	return f->buf;
+}
+
+static int next_mapped(struct rd_file *f, struct rd_section *sect)
+{
+	uint32_t hdr[2];
+	const uint8_t *data;
+
+	if (f->pos == f->size)
+		return 0;
+
+	if ((f->size - f->pos) < sizeof(hdr)) {
+		truncated(f);
+		f->pos = f->size;
+		return 0;
+	}
+
+	memcpy(hdr, f->map + f->pos, sizeof(hdr));
+	data = f->map + f->pos + sizeof(hdr);
+
+	if ((f->size - f->pos - sizeof(hdr)) < hdr[1]) {
+		truncated(f);
+		f->pos = f->size;
+		return 0;
+	}
+
+	sect->type = hdr[0];
+	sect->size = hdr[1];
+	sect->offset = f->pos;
+
+	/* an odd sized section before this one (ie. a string) leaves the
+	 * payload misaligned, in which case it needs to be copied:
+	 */
+	if ((uintptr_t)data & 3) {
+		sect->data = memcpy(get_buf(f, hdr[1]), data, hdr[1]);
+		sect->persistent = 0;
+	} else {
+		sect->data = data;
+		sect->persistent = 1;
+	}
+
+	f->pos += sizeof(hdr) + hdr[1];
+
+	return 1;
+}
+
+static int next_rdz(struct rd_file *f, struct rd_section *sect)
+{
+	uint32_t hdr[2];
+	void *buf;
+	int n;
+
+	n = rdz_read(f->z, hdr, sizeof(hdr));
+	if (n == 0)
+		return 0;
+
+	if (n != sizeof(hdr)) {
+		truncated(f);
+		return 0;
+	}
+
+	/* check the size before trying to allocate it: */
+	if (hdr[1] > (rd_size(f) - f->pos - sizeof(hdr))) {
+		truncated(f);
+		return 0;
+	}
+
+	buf = get_buf(f, hdr[1]);
+	if (rdz_read(f->z, buf, hdr[1]) != hdr[1]) {
+		truncated(f);
+		return 0;
+	}
+
+	sect->type = hdr[0];
+	sect->size = hdr[1];
+	sect->data = buf;
+	sect->persistent = 0;
+	sect->offset = f->pos;
+
+	f->pos += sizeof(hdr) + hdr[1];
+
+	return 1;
+}
+
+/* returns 1 if there is another section, 0 at end of file */
+int rd_next(struct rd_file *f, struct rd_section *sect)
+{
+	if (f->map)
+		return next_mapped(f, sect);
+	return next_rdz(f, sect);
+}
+
+int rd_seek(struct rd_file *f, uint64_t offset)
+{
+	if (f->map) {
+		if (offset > f->size)
+			return -1;
+	} else if (rdz_seek(f->z, offset)) {
+		return -1;
+	}
+
+	f->pos = offset;
+
+	return 0;
+}
+
+uint64_t rd_size(struct rd_file *f)
+{
+	if (f->map)
+		return f->size;
+	return rdz_size(f->z);
+}
+
+int rd_compressed(struct rd_file *f)
+{
+	return f->z && rdz_compressed(f->z);
+}
+
+static int read_at(struct rd_file *f, uint64_t offset, void *buf, uint32_t sz)
+{
+	if (f->map) {
+		if ((offset > f->size) || ((f->size - offset) < sz))
+			return -1;
+		memcpy(buf, f->map + offset, sz);
+		return 0;
+	}
+
+	if (rdz_seek(f->z, offset) || (rdz_read(f->z, buf, sz) != sz))
+		return -1;
+
+	return 0;
+}
+
+/* load the RD_INDEX, if the file has one.  Leaves the file positioned
+ * back at the start.
+ */
+struct rd_index_entry * rd_read_index(struct rd_file *f, int *count)
+{
+	struct rd_index_entry *entries = NULL;
+	uint64_t size = rd_size(f);
+	uint64_t offset;
+	uint32_t hdr[2];
+
+	*count = 0;
+
+	if (size < (sizeof(hdr) + sizeof(offset)))
+		goto out;
+
+	offset = size - sizeof(hdr) - sizeof(offset);
+	if (read_at(f, offset, hdr, sizeof(hdr)) ||
+			(hdr[0] != RD_INDEX_OFFSET) || (hdr[1] != sizeof(offset)) ||
+			read_at(f, offset + sizeof(hdr), &offset, sizeof(offset)))
+		goto out;
+
+	if (read_at(f, offset, hdr, sizeof(hdr)) || (hdr[0] != RD_INDEX))
+		goto out;
+
+	entries = malloc(hdr[1] + 1);
+	if (read_at(f, offset + sizeof(hdr), entries, hdr[1])) {
+		free(entries);
+		entries = NULL;
+		goto out;
+	}
+
+	*count = hdr[1] / sizeof(entries[0]);
+
+out:
+	rd_seek(f, 0);
+	return entries;
+}
+
+void rd_close(struct rd_file *f)
+{
+	if (f->map)
+		munmap(f->map, f->mapsz);
+	if (f->z)
+		rdz_close(f->z);
+	free(f->buf);
+	free(f);
+}
@@ -0,0 +1,64 @@
+/*
+ * Copyright (c) 2012 Rob Clark <robdclark@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef RD_H_
+#define RD_H_
+
+#include <stdint.h>
+
+#include "redump.h"
+
+/* Section reader shared by the tools.  Uncompressed .rd files are mmap'd
+ * and sections are handed out as views directly into the mapping, so
+ * there is no per-section malloc()/read()/free().  Compressed files (and
+ * anything that can't be mmap'd) are read through rdz into a buffer that
+ * is re-used for each section.
+ *
+ * If rd_section::persistent is set, the data stays valid until rd_close(),
+ * otherwise only until the next rd_next() or rd_seek().  Either way the
+ * data must not be modified.
+ *
+ * A truncated section at the end of the file (ie. from a capture that
+ * crashed) is treated as the end of the file, with a warning.
+ */
+
+struct rd_section {
+	enum rd_sect_type type;
+	uint32_t size;
+	const void *data;   /* dword aligned */
+	int persistent;
+	uint64_t offset;    /* of the section header */
+};
+
+struct rd_file;
+
+struct rd_file * rd_open(const char *path);
+int rd_next(struct rd_file *f, struct rd_section *sect);
+int rd_seek(struct rd_file *f, uint64_t offset);
+uint64_t rd_size(struct rd_file *f);
+int rd_compressed(struct rd_file *f);
+void rd_close(struct rd_file *f);
+
+struct rd_index_entry * rd_read_index(struct rd_file *f, int *count);
+
+#endif /* RD_H_ */
@@ -0,0 +1,449 @@
+/*
+ * Copyright © 2012 Rob Clark <robclark@freedesktop.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* A small LZ4-style block compressor, simple and fast enough to run
+ * inline in libwrap without hurting the traced app too much.  The block
+ * format is a sequence of:
+ *
+ *     token:    literal length (high nibble), match length - 4 (low nibble)
+ *     [extra literal length bytes, if high nibble is 15]
+ *     literals
+ *     offset:   u16 little endian, distance back to the match
+ *     [extra match length bytes, if low nibble is 15]
+ *
+ * where the last sequence of a block has only literals.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "rdz.h"
+
+#define MINMATCH   4
+#define LASTLITS   5    /* last bytes of a block are always literals */
+#define MFLIMIT    12   /* no match may start closer than this to the end */
+#define MAXOFFSET  65535
+#define HASH_BITS  13
+
+static inline uint32_t read32(const uint8_t *p)
+{
+	uint32_t v;
+	memcpy(&v, p, 4);
+	return v;
+}
+
+static inline uint32_t hash4(uint32_t v)
+{
+	return (v * 2654435761U) >> (32 - HASH_BITS);
+}
+
+static uint8_t * write_len(uint8_t *op, uint32_t len)
+{
+	while (len >= 255) {
+		*(op++) = 255;
+		len -= 255;
+	}
+	*(op++) = len;
+	return op;
+}
+
+/* returns compressed size, or 0 if it would not fit in dstlen */
+int rdz_compress(const void *src, int srclen, void *dst, int dstlen)
+{
+	uint32_t table[1 << HASH_BITS];
+	const uint8_t *base = src;
+	const uint8_t *ip = base, *anchor = base;
+	const uint8_t *end = base + srclen;
+	const uint8_t *mflimit = end - MFLIMIT;
+	const uint8_t *matchlimit = end - LASTLITS;
+	uint8_t *op = dst, *oend = op + dstlen;
+	uint32_t litlen;
+
+	memset(table, 0, sizeof(table));
+
+	if (srclen > MFLIMIT) {
+		ip++;
+		while (ip < mflimit) {
+			uint32_t seq = read32(ip);
+			uint32_t h = hash4(seq);
+			const uint8_t *ref = base + table[h];
+			const uint8_t *m;
+			uint32_t matchlen;
+			uint8_t *token;
+
+			table[h] = ip - base;
+
+			if ((ref >= ip) || ((ip - ref) > MAXOFFSET) ||
+					(read32(ref) != seq)) {
+				/* skip ahead faster the longer we go without a match: */
+				ip += 1 + ((ip - anchor) >> 6);
+				continue;
+			}
+
+			/* extend the match backwards and forwards: */
+			while ((ip > anchor) && (ref > base) && (ip[-1] == ref[-1])) {
+				ip--;
+				ref--;
+			}
+			m = ip + MINMATCH;
+			ref += MINMATCH;
+			while ((m < matchlimit) && (*m == *ref)) {
+				m++;
+				ref++;
+			}
+
+			litlen = ip - anchor;
+			matchlen = m - ip - MINMATCH;
+
+			if ((op + 1 + (litlen / 255) + 1 + litlen + 2 +
+					(matchlen / 255) + 1 + LASTLITS + 1) > oend)
+				return 0;
+
+			token = op++;
+			*token = (litlen >= 15 ? 15 : litlen) << 4;
+			if (litlen >= 15)
+				op = write_len(op, litlen - 15);
+			memcpy(op, anchor, litlen);
+			op += litlen;
+
+			*(op++) = (m - ref) & 0xff;
+			*(op++) = (m - ref) >> 8;
+
+			*token |= (matchlen >= 15) ? 15 : matchlen;
+			if (matchlen >= 15)
+				op = write_len(op, matchlen - 15);
+
+			ip = anchor = m;
+		}
+	}
+
+	/* remaining literals: */
+	litlen = end - anchor;
+	if ((op + 1 + (litlen / 255) + 1 + litlen) > oend)
+		return 0;
+	*(op++) = (litlen >= 15 ? 15 : litlen) << 4;
+	if (litlen >= 15)
+		op = write_len(op, litlen - 15);
+	memcpy(op, anchor, litlen);
+	op += litlen;
+
+	return op - (uint8_t *)dst;
+}
+
+static int read_len(const uint8_t **ip, const uint8_t *iend, uint32_t *len)
+{
+	uint8_t b;
+	do {
+		if (*ip >= iend)
+			return -1;
+		b = *((*ip)++);
+		*len += b;
+	} while (b == 255);
+	return 0;
+}
+
+/* returns decompressed size, or -1 if the data is corrupt */
+int rdz_decompress(const void *src, int srclen, void *dst, int dstlen)
+{
+	const uint8_t *ip = src, *iend = ip + srclen;
+	uint8_t *op = dst, *oend = op + dstlen;
+
+	while (ip < iend) {
+		uint8_t token = *(ip++);
+		uint32_t litlen = token >> 4;
+		uint32_t matchlen = token & 0xf;
+		uint32_t off;
+		const uint8_t *ref;
+
+		if ((litlen == 15) && read_len(&ip, iend, &litlen))
+			return -1;
+		if ((litlen > (iend - ip)) || (litlen > (oend - op)))
+			return -1;
+		memcpy(op, ip, litlen);
+		op += litlen;
+		ip += litlen;
+
+		/* last sequence has no match: */
+		if (ip >= iend)
+			break;
+
+		if ((iend - ip) < 2)
+			return -1;
+		off = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if (!off || (off > (op - (uint8_t *)dst)))
+			return -1;
+
+		if ((matchlen == 15) && read_len(&ip, iend, &matchlen))
+			return -1;
+		matchlen += MINMATCH;
+		if (matchlen > (oend - op))
+			return -1;
+
+		/* note: match can overlap the output, so copy bytewise: */
+		ref = op - off;
+		if (off >= matchlen) {
+			memcpy(op, ref, matchlen);
+			op += matchlen;
+		} else {
+			while (matchlen--)
+				*(op++) = *(ref++);
+		}
+	}
+
+	return op - (uint8_t *)dst;
+}
+
+/*****************************************************************************/
+
+struct rdz_frame {
+	uint64_t file_offset;   /* of the frame header */
+	uint64_t offset;        /* in the uncompressed stream */
+};
+
+struct rdz_file {
+	int fd;
+	int compressed;
+	uint8_t *buf;       /* decompressed frame (or peeked bytes) */
+	int pos, len;
+	uint8_t *zbuf;      /* compressed frame */
+	int zlen;
+
+	/* for seeking in compressed files, built on first use by just
+	 * walking the frame headers:
+	 */
+	struct rdz_frame *frames;
+	int nframes;
+	uint64_t size;
+};
+
+static int read_full(int fd, void *buf, int sz)
+{
+	int n = 0;
+	while (n < sz) {
+		int ret = read(fd, (uint8_t *)buf + n, sz - n);
+		if (ret <= 0)
+			return (n > 0) ? n : ret;
+		n += ret;
+	}
+	return n;
+}
+
+struct rdz_file * rdz_open(const char *path)
+{
+	struct rdz_file *f;
+	uint32_t magic = 0;
+	int fd, n;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+
+	f = calloc(1, sizeof(*f));
+	f->fd = fd;
+	f->buf = malloc(RDZ_FRAME_SIZE);
+
+	n = read_full(fd, &magic, sizeof(magic));
+	if ((n == sizeof(magic)) && (magic == RDZ_MAGIC)) {
+		f->compressed = 1;
+	} else if (n > 0) {
+		/* not compressed, hand back what we peeked at first: */
+		memcpy(f->buf, &magic, n);
+		f->len = n;
+	}
+
+	return f;
+}
+
+static int next_frame(struct rdz_file *f)
+{
+	uint32_t hdr[2];   /* rawlen, complen */
+	uint32_t complen;
+	int ret;
+
+	ret = read_full(f->fd, hdr, sizeof(hdr));
+	if (ret <= 0)
+		return ret;
+	if (ret != sizeof(hdr))
+		return -1;
+
+	complen = hdr[1] & ~RDZ_STORED;
+	if ((hdr[0] > RDZ_FRAME_SIZE) || (complen > RDZ_BOUND(RDZ_FRAME_SIZE)))
+		return -1;
+
+	if (hdr[1] & RDZ_STORED) {
+		if (read_full(f->fd, f->buf, complen) != complen)
+			return -1;
+		ret = complen;
+	} else {
+		if (!f->zbuf)
+			f->zbuf = malloc(RDZ_BOUND(RDZ_FRAME_SIZE));
+		if (read_full(f->fd, f->zbuf, complen) != complen)
+			return -1;
+		ret = rdz_decompress(f->zbuf, complen, f->buf, hdr[0]);
+		if (ret != hdr[0])
+			return -1;
+	}
+
+	f->pos = 0;
+	f->len = ret;
+
+	return ret;
+}
+
+/* like read(), but only returns short at end of file */
+int rdz_read(struct rdz_file *f, void *buf, int sz)
+{
+	int n = 0;
+
+	while (n < sz) {
+		int avail = f->len - f->pos;
+
+		if (avail > 0) {
+			int cnt = (avail < (sz - n)) ? avail : (sz - n);
+			memcpy((uint8_t *)buf + n, f->buf + f->pos, cnt);
+			f->pos += cnt;
+			n += cnt;
+		} else if (!f->compressed) {
+			int ret = read_full(f->fd, (uint8_t *)buf + n, sz - n);
+			if (ret <= 0)
+				return (n > 0) ? n : ret;
+			n += ret;
+		} else {
+			int ret = next_frame(f);
+			if (ret <= 0)
+				return (n > 0) ? n : ret;
+		}
+	}
+
+	return n;
+}
+
+static int scan_frames(struct rdz_file *f)
+{
+	uint64_t file_offset = sizeof(uint32_t);   /* skip magic */
+	off_t cur = lseek(f->fd, 0, SEEK_CUR);
+	uint32_t hdr[2];
+	int max = 0;
+
+	if (f->frames)
+		return 0;
+
+	while (1) {
+		if (lseek(f->fd, file_offset, SEEK_SET) == (off_t)-1)
+			return -1;
+		if (read_full(f->fd, hdr, sizeof(hdr)) != sizeof(hdr))
+			break;
+
+		if (f->nframes == max) {
+			max = max ? max * 2 : 64;
+			f->frames = realloc(f->frames, max * sizeof(f->frames[0]));
+		}
+
+		f->frames[f->nframes].file_offset = file_offset;
+		f->frames[f->nframes].offset = f->size;
+		f->nframes++;
+
+		f->size += hdr[0];
+		file_offset += sizeof(hdr) + (hdr[1] & ~RDZ_STORED);
+	}
+
+	/* make sure a frames array exists even for an empty file: */
+	if (!f->frames)
+		f->frames = malloc(sizeof(f->frames[0]));
+
+	/* don't disturb any read in progress: */
+	lseek(f->fd, cur, SEEK_SET);
+
+	return 0;
+}
+
+/* size of the (uncompressed) stream */
+uint64_t rdz_size(struct rdz_file *f)
+{
+	struct stat st;
+
+	if (!f->compressed) {
+		if (fstat(f->fd, &st))
+			return 0;
+		return st.st_size;
+	}
+
+	if (scan_frames(f))
+		return 0;
+
+	return f->size;
+}
+
+int rdz_seek(struct rdz_file *f, uint64_t offset)
+{
+	int lo, hi;
+
+	f->pos = f->len = 0;
+
+	if (!f->compressed)
+		return (lseek(f->fd, offset, SEEK_SET) == (off_t)-1) ? -1 : 0;
+
+	if (scan_frames(f) || (offset > f->size))
+		return -1;
+	if (offset == f->size)
+		return 0;
+
+	/* find the last frame starting at or before offset: */
+	lo = 0;
+	hi = f->nframes - 1;
+	while (lo < hi) {
+		int mid = (lo + hi + 1) / 2;
+		if (f->frames[mid].offset <= offset)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+
+	if (lseek(f->fd, f->frames[lo].file_offset, SEEK_SET) == (off_t)-1)
+		return -1;
+	if (next_frame(f) <= 0)
+		return -1;
+
+	f->pos = offset - f->frames[lo].offset;
+
+	return 0;
+}
+
+int rdz_compressed(struct rdz_file *f)
+{
+	return f->compressed;
+}
+
+void rdz_close(struct rdz_file *f)
+{
+	close(f->fd);
+	free(f->buf);
+	free(f->zbuf);
+	free(f->frames);
+	free(f);
+}
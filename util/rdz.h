@@ -0,0 +1,65 @@
+/*
+ * Copyright © 2012 Rob Clark <robclark@freedesktop.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef RDZ_H_
+#define RDZ_H_
+
+#include <stdint.h>
+
+/* Compressed .rd files start with RDZ_MAGIC, followed by a sequence of
+ * frames, each:
+ *
+ *     u32 rawlen         - size of the frame once decompressed
+ *     u32 complen        - size of the frame data, RDZ_STORED set if the
+ *                          data didn't compress and is stored as-is
+ *     u8  data[complen]  - LZ4-style compressed block
+ *
+ * Uncompressed .rd files start directly with a section header, so the
+ * two are easy to tell apart.
+ *
+ * Offsets (ie. for rdz_seek() or the RD_INDEX section) are always in
+ * terms of the uncompressed stream.
+ */
+#define RDZ_MAGIC       0x315a4452   /* "RDZ1" */
+#define RDZ_STORED      0x80000000
+#define RDZ_FRAME_SIZE  (256 * 1024)
+
+/* worst case size of compressed data for a block of the given size: */
+#define RDZ_BOUND(sz)   ((sz) + ((sz) / 255) + 16)
+
+int rdz_compress(const void *src, int srclen, void *dst, int dstlen);
+int rdz_decompress(const void *src, int srclen, void *dst, int dstlen);
+
+/* read() like interface, which transparently handles both compressed
+ * and uncompressed .rd files.  The tools use this via rd.h:
+ */
+struct rdz_file;
+
+struct rdz_file * rdz_open(const char *path);
+int rdz_read(struct rdz_file *f, void *buf, int sz);
+int rdz_seek(struct rdz_file *f, uint64_t offset);
+uint64_t rdz_size(struct rdz_file *f);
+int rdz_compressed(struct rdz_file *f);
+void rdz_close(struct rdz_file *f);
+
+#endif /* RDZ_H_ */
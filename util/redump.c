@@ -31,6 +31,7 @@
 #include <string.h>
 
 #include "redump.h"
+#include "rd.h"
 
 static const uint32_t patterns[] = {
 		/* these should be ordered by most inclusive pattern, ie. most 'f's */
@@ -124,9 +125,10 @@ struct param {
 };
 
 struct context {
-	int       fd;
+	struct rd_file *f;
 	uint32_t *buf;           /* current row buffer */
 	int       sz;            /* current row buffer size */
+	int       bufsz;         /* allocated size of buf */
 	uint32_t  gpuaddrs[32];
 	int       ngpuaddrs;
 	struct param params[32];
@@ -435,14 +437,27 @@ static const char *sect_names[] = {
 	[RD_FLUSH]     = "flush",
 };
 
+/* skip over the sections we have nothing to show for (ie. buffer
+ * contents, or the ioctl logs, timestamps and index that libwrap can
+ * also write):
+ */
+static int next_section(struct rd_file *f, struct rd_section *sect)
+{
+	while (rd_next(f, sect))
+		if ((sect->type < ARRAY_SIZE(sect_handlers)) &&
+				sect_handlers[sect->type])
+			return 1;
+	return 0;
+}
+
 int main(int argc, char **argv)
 {
 	int i, n;
 
 	for (i = 1; i < argc; i++) {
 		struct context *ctx = &ctxts[nctxts++];
-		ctx->fd = open(argv[i], O_RDONLY);
-		if (ctx->fd < 0) {
+		ctx->f = rd_open(argv[i]);
+		if (!ctx->f) {
 			fprintf(stderr, "could not open: %s\n", argv[i]);
 			return -1;
 		}
@@ -454,27 +469,29 @@ int main(int argc, char **argv)
 
 		for (i = 0; i < nctxts; i++) {
 			struct context *ctx = &ctxts[i];
-			enum rd_sect_type type = RD_NONE;
+			struct rd_section sect;
 
 			ctx->sz = 0;
-			free(ctx->buf);
-			ctx->buf = NULL;
 
-			if ((read(ctx->fd, &type, sizeof(type)) > 0) &&
-					(read(ctx->fd, &ctx->sz, 4) > 0)) {
+			if (next_section(ctx->f, &sect)) {
 				if (row_type == RD_NONE)
-					row_type = type;
+					row_type = sect.type;
 
-				if (type == row_type) {
-					/* allocate  bit extra, because there could be some optional
-					 * words in the cmdstreams, and they might not all be the
-					 * same size..
+				if (sect.type == row_type) {
+					/* keep a bit extra zero'd, because there could be some
+					 * optional words in the cmdstreams, and they might not
+					 * all be the same size..
 					 */
-					ctx->buf = calloc(1, ctx->sz + 1 + 20);
-					read(ctx->fd, ctx->buf, ctx->sz);
-					((char *)ctx->buf)[ctx->sz] = '\0';
+					if ((sect.size + 1 + 20) > ctx->bufsz) {
+						ctx->bufsz = sect.size + 1 + 20;
+						free(ctx->buf);
+						ctx->buf = malloc(ctx->bufsz);
+					}
+					ctx->sz = sect.size;
+					memcpy(ctx->buf, sect.data, ctx->sz);
+					memset((char *)ctx->buf + ctx->sz, 0, 1 + 20);
 				} else {
-					fprintf(stderr, "unexpected type '%d', expected '%d'\n", type, row_type);
+					fprintf(stderr, "unexpected type '%d', expected '%d'\n", sect.type, row_type);
 					return -1;
 				}
 			}
@@ -24,6 +24,8 @@
 #ifndef REDUMP_H_
 #define REDUMP_H_
 
+#include <stdint.h>
+
 enum rd_sect_type {
 	RD_NONE,
 	RD_TEST,       /* ascii text */
@@ -37,7 +39,120 @@ enum rd_sect_type {
 	RD_PROGRAM,    /* shader program, raw dump */
 	RD_VERT_SHADER,
 	RD_FRAG_SHADER,
-	RD_BUFFER_CONTENTS
+	RD_BUFFER_CONTENTS,
+	RD_BUFFER_REF, /* u32 hash_lo, u32 hash_hi: contents unchanged since the
+	                * last RD_BUFFER_CONTENTS for the preceding RD_GPUADDR */
+	RD_BUFFER_DELTA, /* u32 nruns, followed by nruns x { u32 offset, u32 len,
+	                  * u8 data[len] } to patch into the previous contents */
+	RD_INDEX,        /* array of struct rd_index_entry */
+	RD_INDEX_OFFSET, /* u64 offset of the RD_INDEX section, always the last
+	                  * section in the file if present */
+	RD_IOCTL,        /* struct rd_ioctl, followed by the ioctl arguments */
+	RD_DROPPED,      /* u32 count of sections dropped by libwrap's async
+	                  * writer (WRAP_ASYNC=drop) at this point */
+	RD_TIMESTAMP,    /* struct rd_timestamp */
+	RD_MEMSTAT,      /* struct rd_memstat, followed by nbuckets
+	                  * struct rd_memstat_bucket */
+};
+
+/* Optional index of all the sections in a .rd file (see rd-index), so
+ * readers can seek straight to a given submit.  Offsets are of the
+ * section header, in the uncompressed stream:
+ */
+struct rd_index_entry {
+	uint32_t type;
+	uint32_t size;
+	uint32_t submit;    /* # of RD_CMDSTREAM_ADDR sections before this one */
+	uint32_t gpuaddr;   /* most recent RD_GPUADDR, for buffer sections */
+	uint64_t offset;
+};
+
+/* With WRAP_IOCTL_LOG=bin, libwrap logs each ioctl as RD_IOCTL sections
+ * (one before and one after the ioctl) rather than printing it, and
+ * cffdump --ioctls renders them as text.  The header is followed by
+ * argsz bytes of the ioctl argument struct and extrasz bytes of data
+ * that it points to (the ibdescs for ISSUEIBCMDS, or the property value
+ * for GETPROPERTY):
+ */
+enum rd_ioctl_dev {
+	RD_IOCTL_UNKNOWN,
+	RD_IOCTL_KGSL_3D,
+	RD_IOCTL_KGSL_2D,
+	RD_IOCTL_PMEM,
+};
+
+struct rd_ioctl {
+	uint32_t dev;       /* enum rd_ioctl_dev */
+	uint32_t post;      /* 0 before the ioctl, 1 after (ret is valid) */
+	int32_t fd;
+	uint32_t request;
+	int32_t ret;
+	uint32_t argsz;
+	uint32_t extrasz;
+	uint32_t pad;
+	uint64_t time;      /* CLOCK_MONOTONIC, in ns */
+};
+
+/* RD_TIMESTAMPs are written around submits and the ioctls that wait for
+ * or read back the GPU's timestamp, so cffdump --latency can work out how
+ * long each submit took to retire.  A RD_TS_SUBMIT follows the submit's
+ * RD_CMDSTREAM_ADDRs (one per IB), and its RD_TS_SUBMITTED has the same
+ * serial #, whatever other threads wrote in between:
+ */
+enum rd_timestamp_event {
+	RD_TS_SUBMIT,      /* before ISSUEIBCMDS */
+	RD_TS_SUBMITTED,   /* after ISSUEIBCMDS, value is the submit's timestamp */
+	RD_TS_WAIT,        /* before WAITTIMESTAMP, value is the timestamp */
+	RD_TS_WAITED,      /* after WAITTIMESTAMP, value is the timestamp */
+	RD_TS_READ,        /* after READTIMESTAMP, value is the timestamp read */
+};
+
+struct rd_timestamp {
+	uint32_t event;     /* enum rd_timestamp_event */
+	uint32_t dev;       /* enum rd_ioctl_dev */
+	uint32_t value;
+	int32_t ret;        /* of the ioctl, for the after events */
+	uint32_t submit;    /* serial #, for RD_TS_SUBMIT and RD_TS_SUBMITTED */
+	uint32_t nibs;      /* RD_TS_SUBMIT: # of RD_CMDSTREAM_ADDRs before it */
+	uint64_t time;      /* CLOCK_MONOTONIC, in ns */
+};
+
+/* GPU memory footprint, written every WRAP_MEMSTAT=n submits.  Each
+ * bucket is the allocations of a given size class (rounded up to a power
+ * of two) and flags:
+ */
+struct rd_memstat {
+	uint64_t live_bytes, peak_bytes;
+	uint32_t live, peak;        /* # of allocations */
+	uint32_t allocs, frees;     /* so far */
+	uint32_t nbuckets;
+	uint32_t pad;
+};
+
+struct rd_memstat_bucket {
+	uint32_t size_log2;
+	uint32_t flags;
+	uint64_t live_bytes, peak_bytes;
+	uint64_t at_peak_bytes;     /* live_bytes when the overall peak was hit */
+	uint32_t live, peak;
+	uint32_t allocs, frees;
+	uint64_t lifetime;          /* total of the freed allocations, in ns */
+	uint64_t max_lifetime;
+};
+
+/* Not a section, but what cffdump --format=bin writes: one of these for
+ * each packet, in the order they are decoded (ie. the packets of an IB
+ * follow the packet that points to it), followed by count dwords of the
+ * packet itself:
+ */
+struct rd_packet {
+	uint32_t submit;
+	uint32_t gpuaddr;           /* of the packet header */
+	uint8_t type;               /* 0, 1 or 3 */
+	uint8_t opcode;             /* for type-3 packets */
+	uint8_t level;              /* IB nesting, 0 for the cmdstream itself */
+	uint8_t pad;
+	uint32_t count;             /* in dwords, including the header */
 };
 
 /* RD_PARAM types: */
@@ -54,6 +169,24 @@ enum rd_param_type {
 	RD_PARAM_BLIT_Y2,      /* BLIT_Y + BLIT_WIDTH */
 };
 
+/* hash of buffer contents, used by RD_BUFFER_REF to refer back to the
+ * previously written contents of a buffer:
+ */
+static inline uint64_t rd_hash(const void *buf, uint32_t sz)
+{
+	const uint32_t *dwords = buf;
+	const uint8_t *bytes = buf;
+	uint64_t h = 0xcbf29ce484222325ULL ^ sz;
+	uint32_t i;
+
+	for (i = 0; i < sz / 4; i++)
+		h = (h ^ dwords[i]) * 0x100000001b3ULL;
+	for (i = sz & ~3; i < sz; i++)
+		h = (h ^ bytes[i]) * 0x100000001b3ULL;
+
+	return h;
+}
+
 void rd_start(const char *name, const char *fmt, ...) __attribute__((weak));
 void rd_end(void) __attribute__((weak));
 void rd_write_section(enum rd_sect_type type, const void *buf, int sz) __attribute__((weak));
@@ -0,0 +1,170 @@
+/*
+ * Copyright (c) 2012 Rob Clark <robdclark@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* Micro-benchmark for the buffer lookup in libwrap: registers, looks up
+ * and frees a lot of synthetic buffers, with both the range trees and
+ * the old linear list walk:
+ *
+ *   make bench-buffers && ./bench-buffers [nbuffers]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "list.h"
+#include "range.h"
+
+struct buffer {
+	void *hostptr;
+	unsigned int gpuaddr, len;
+	struct list node;
+	struct range host_range, gpu_range;
+};
+
+static LIST_HEAD(buffers);
+static struct range_tree by_hostptr, by_gpuaddr;
+
+static struct buffer * find_tree(void *hostptr, unsigned int gpuaddr)
+{
+	struct range *r;
+	if (hostptr && (r = range_find(&by_hostptr, (uintptr_t)hostptr)))
+		return range_entry(r, struct buffer, host_range);
+	if (gpuaddr && (r = range_find(&by_gpuaddr, gpuaddr)))
+		return range_entry(r, struct buffer, gpu_range);
+	return NULL;
+}
+
+static struct buffer * find_list(void *hostptr, unsigned int gpuaddr)
+{
+	struct buffer *buf;
+	list_for_each_entry(buf, &buffers, node) {
+		if (hostptr)
+			if ((buf->hostptr <= hostptr) && (hostptr < (buf->hostptr + buf->len)))
+				return buf;
+		if (gpuaddr)
+			if ((buf->gpuaddr <= gpuaddr) && (gpuaddr < (buf->gpuaddr + buf->len)))
+				return buf;
+	}
+	return NULL;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+static void shuffle(int *order, int n)
+{
+	int i;
+	for (i = n - 1; i > 0; i--) {
+		int j = rand() % (i + 1);
+		int tmp = order[i];
+		order[i] = order[j];
+		order[j] = tmp;
+	}
+}
+
+static void run(const char *name, int n, int use_tree)
+{
+	struct buffer *bufs = calloc(n, sizeof(*bufs));
+	int *order = malloc(n * sizeof(*order));
+	double t0, t1, t2, t3;
+	int i, misses = 0;
+
+	for (i = 0; i < n; i++)
+		order[i] = i;
+
+	/* buffers are 4k..32k, and allocated in random order: */
+	shuffle(order, n);
+	t0 = now();
+	for (i = 0; i < n; i++) {
+		struct buffer *buf = &bufs[order[i]];
+		buf->len = 0x1000 << (order[i] % 4);
+		buf->gpuaddr = 0x10000000 + order[i] * 0x8000;
+		buf->hostptr = (void *)(uintptr_t)(0x40000000 + order[i] * 0x8000);
+		if (use_tree) {
+			range_insert(&by_hostptr, &buf->host_range,
+					(uintptr_t)buf->hostptr, buf->len);
+			range_insert(&by_gpuaddr, &buf->gpu_range,
+					buf->gpuaddr, buf->len);
+		} else {
+			list_add(&buf->node, &buffers);
+		}
+	}
+
+	/* lookup somewhere inside each buffer, alternating hostptr/gpuaddr: */
+	shuffle(order, n);
+	t1 = now();
+	for (i = 0; i < n; i++) {
+		struct buffer *buf = &bufs[order[i]];
+		unsigned int off = (i * 0x124) % buf->len;
+		struct buffer *found;
+		if (i & 1)
+			found = use_tree ? find_tree(buf->hostptr + off, 0) :
+					find_list(buf->hostptr + off, 0);
+		else
+			found = use_tree ? find_tree((void *)-1, buf->gpuaddr + off) :
+					find_list((void *)-1, buf->gpuaddr + off);
+		if (found != buf)
+			misses++;
+	}
+
+	shuffle(order, n);
+	t2 = now();
+	for (i = 0; i < n; i++) {
+		struct buffer *buf = &bufs[order[i]];
+		if (use_tree) {
+			range_remove(&by_hostptr, &buf->host_range);
+			range_remove(&by_gpuaddr, &buf->gpu_range);
+		} else {
+			list_del(&buf->node);
+		}
+	}
+	t3 = now();
+
+	printf("%-6s %7d buffers: register %8.2f ms, lookup %8.2f ms, free %8.2f ms%s\n",
+			name, n, (t1 - t0) * 1000, (t2 - t1) * 1000, (t3 - t2) * 1000,
+			misses ? " (MISSES!)" : "");
+
+	free(order);
+	free(bufs);
+}
+
+int main(int argc, char **argv)
+{
+	int n = (argc > 1) ? atoi(argv[1]) : 100000;
+
+	srand(42);
+
+	run("tree", n, 1);
+
+	/* the list is O(n^2), so only compare at a size that finishes: */
+	run("tree", n / 10, 1);
+	run("list", n / 10, 0);
+
+	return 0;
+}
@@ -0,0 +1,196 @@
+/*
+ * Copyright (c) 2012 Rob Clark <robdclark@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _RANGE_H_
+#define _RANGE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Set of non-overlapping [start, end) ranges, for looking up which
+ * buffer an address falls in, in O(log n).  It is a treap (a binary
+ * search tree ordered by start, which is kept balanced by also keeping
+ * it heap-ordered by a random priority), embedded in the object like
+ * struct list.
+ *
+ * If ranges do overlap, range_find() returns the one with the highest
+ * start <= addr, if that contains addr.
+ */
+struct range {
+	struct range *left, *right;
+	uint32_t prio;
+	uintptr_t start, end;
+};
+
+struct range_tree {
+	struct range *root;
+};
+
+static inline uint32_t
+__range_prio(void)
+{
+	/* xorshift, doesn't need to be good, just not ordered: */
+	static uint32_t state = 2463534242u;
+	state ^= state << 13;
+	state ^= state >> 17;
+	state ^= state << 5;
+	return state;
+}
+
+/* ties on start are broken by address, so every node has a unique key: */
+static inline int
+__range_cmp(const struct range *a, const struct range *b)
+{
+	if (a->start != b->start)
+		return (a->start < b->start) ? -1 : 1;
+	if (a != b)
+		return (a < b) ? -1 : 1;
+	return 0;
+}
+
+static struct range *
+__range_insert(struct range *root, struct range *r)
+{
+	struct range *child;
+
+	if (!root)
+		return r;
+
+	if (__range_cmp(r, root) < 0) {
+		child = root->left = __range_insert(root->left, r);
+		if (child->prio > root->prio) {
+			/* rotate right: */
+			root->left = child->right;
+			child->right = root;
+			return child;
+		}
+	} else {
+		child = root->right = __range_insert(root->right, r);
+		if (child->prio > root->prio) {
+			/* rotate left: */
+			root->right = child->left;
+			child->left = root;
+			return child;
+		}
+	}
+
+	return root;
+}
+
+/* join two subtrees, where everything in a sorts before b: */
+static struct range *
+__range_merge(struct range *a, struct range *b)
+{
+	if (!a)
+		return b;
+	if (!b)
+		return a;
+	if (a->prio > b->prio) {
+		a->right = __range_merge(a->right, b);
+		return a;
+	}
+	b->left = __range_merge(a, b->left);
+	return b;
+}
+
+static struct range *
+__range_remove(struct range *root, struct range *r)
+{
+	int cmp;
+
+	if (!root)
+		return NULL;
+
+	cmp = __range_cmp(r, root);
+	if (cmp < 0)
+		root->left = __range_remove(root->left, r);
+	else if (cmp > 0)
+		root->right = __range_remove(root->right, r);
+	else
+		root = __range_merge(root->left, root->right);
+
+	return root;
+}
+
+static inline void
+range_insert(struct range_tree *tree, struct range *r,
+		uintptr_t start, uintptr_t len)
+{
+	r->left = r->right = NULL;
+	r->prio = __range_prio();
+	r->start = start;
+	r->end = start + len;
+	tree->root = __range_insert(tree->root, r);
+}
+
+static inline void
+range_remove(struct range_tree *tree, struct range *r)
+{
+	tree->root = __range_remove(tree->root, r);
+}
+
+static inline struct range *
+range_find(struct range_tree *tree, uintptr_t addr)
+{
+	struct range *r = tree->root, *best = NULL;
+
+	/* find the range with the highest start <= addr: */
+	while (r) {
+		if (r->start <= addr) {
+			best = r;
+			r = r->right;
+		} else {
+			r = r->left;
+		}
+	}
+
+	if (best && (addr < best->end))
+		return best;
+
+	return NULL;
+}
+
+/* the range with the lowest start >= addr, for walking all of the ranges
+ * that overlap some interval:
+ */
+static inline struct range *
+range_first(struct range_tree *tree, uintptr_t addr)
+{
+	struct range *r = tree->root, *best = NULL;
+
+	while (r) {
+		if (r->start >= addr) {
+			best = r;
+			r = r->left;
+		} else {
+			r = r->right;
+		}
+	}
+
+	return best;
+}
+
+#define range_entry(ptr, type, member) \
+	((type *)((char *)(ptr) - offsetof(type, member)))
+
+#endif
@@ -26,89 +26,36 @@
  */
 
 #include "wrap.h"
+#include "adreno_pm4types.h"
+#include "a2xx_reg.h"
+#include "freedreno_a2xx_reg.h"
+#include "ioctls.h"
 
 
-struct device_info {
-	const char *name;
-	struct {
-		const char *name;
-	} ioctl_info[_IOC_NR(0xffffffff)];
-};
-
-#define IOCTL_INFO(n) \
-		[_IOC_NR(n)] = { .name = #n }
-
-static struct device_info kgsl_3d_info = {
-		.name = "kgsl-3d",
-		.ioctl_info = {
-				IOCTL_INFO(IOCTL_KGSL_DEVICE_GETPROPERTY),
-				IOCTL_INFO(IOCTL_KGSL_DEVICE_WAITTIMESTAMP),
-				IOCTL_INFO(IOCTL_KGSL_RINGBUFFER_ISSUEIBCMDS),
-				IOCTL_INFO(IOCTL_KGSL_CMDSTREAM_READTIMESTAMP),
-				IOCTL_INFO(IOCTL_KGSL_CMDSTREAM_FREEMEMONTIMESTAMP),
-				IOCTL_INFO(IOCTL_KGSL_DRAWCTXT_CREATE),
-				IOCTL_INFO(IOCTL_KGSL_DRAWCTXT_DESTROY),
-				IOCTL_INFO(IOCTL_KGSL_MAP_USER_MEM),
-				IOCTL_INFO(IOCTL_KGSL_SHAREDMEM_FROM_PMEM),
-				IOCTL_INFO(IOCTL_KGSL_SHAREDMEM_FREE),
-				IOCTL_INFO(IOCTL_KGSL_SHAREDMEM_FROM_VMALLOC),
-				IOCTL_INFO(IOCTL_KGSL_SHAREDMEM_FLUSH_CACHE),
-				IOCTL_INFO(IOCTL_KGSL_GPUMEM_ALLOC),
-				IOCTL_INFO(IOCTL_KGSL_CFF_SYNCMEM),
-				IOCTL_INFO(IOCTL_KGSL_CFF_USER_EVENT),
-				IOCTL_INFO(IOCTL_KGSL_TIMESTAMP_EVENT),
-				/* kgsl-3d specific ioctls: */
-				IOCTL_INFO(IOCTL_KGSL_DRAWCTXT_SET_BIN_BASE_OFFSET),
-		},
-};
+static int kgsl_3d0 = -1, kgsl_2d0 = -1, kgsl_2d1 = -1, pmem_gpu0 = -1, pmem_gpu1 = -1;
 
-// kgsl-2d => Z180 vector graphcis core.. not sure if it is interesting..
-static struct device_info kgsl_2d_info = {
-		.name = "kgsl-2d",
-		.ioctl_info = {
-				IOCTL_INFO(IOCTL_KGSL_DEVICE_GETPROPERTY),
-				IOCTL_INFO(IOCTL_KGSL_DEVICE_WAITTIMESTAMP),
-				IOCTL_INFO(IOCTL_KGSL_RINGBUFFER_ISSUEIBCMDS),
-				IOCTL_INFO(IOCTL_KGSL_CMDSTREAM_READTIMESTAMP),
-				IOCTL_INFO(IOCTL_KGSL_CMDSTREAM_FREEMEMONTIMESTAMP),
-				IOCTL_INFO(IOCTL_KGSL_DRAWCTXT_CREATE),
-				IOCTL_INFO(IOCTL_KGSL_DRAWCTXT_DESTROY),
-				IOCTL_INFO(IOCTL_KGSL_MAP_USER_MEM),
-				IOCTL_INFO(IOCTL_KGSL_SHAREDMEM_FROM_PMEM),
-				IOCTL_INFO(IOCTL_KGSL_SHAREDMEM_FREE),
-				IOCTL_INFO(IOCTL_KGSL_SHAREDMEM_FROM_VMALLOC),
-				IOCTL_INFO(IOCTL_KGSL_SHAREDMEM_FLUSH_CACHE),
-				IOCTL_INFO(IOCTL_KGSL_GPUMEM_ALLOC),
-				IOCTL_INFO(IOCTL_KGSL_CFF_SYNCMEM),
-				IOCTL_INFO(IOCTL_KGSL_CFF_USER_EVENT),
-				IOCTL_INFO(IOCTL_KGSL_TIMESTAMP_EVENT),
-				/* no kgsl-2d specific ioctls, I don't think.. */
-		},
-};
 
-static struct device_info pmem_info = {
-		.name = "pmem-gpu",
-		.ioctl_info = {
-				IOCTL_INFO(PMEM_GET_PHYS),
-				IOCTL_INFO(PMEM_MAP),
-				IOCTL_INFO(PMEM_GET_SIZE),
-				IOCTL_INFO(PMEM_UNMAP),
-				IOCTL_INFO(PMEM_ALLOCATE),
-				IOCTL_INFO(PMEM_CONNECT),
-				IOCTL_INFO(PMEM_GET_TOTAL_SIZE),
-				IOCTL_INFO(HW3D_REVOKE_GPU),
-				IOCTL_INFO(HW3D_GRANT_GPU),
-				IOCTL_INFO(HW3D_WAIT_FOR_INTERRUPT),
-				IOCTL_INFO(PMEM_CLEAN_INV_CACHES),
-				IOCTL_INFO(PMEM_CLEAN_CACHES),
-				IOCTL_INFO(PMEM_INV_CACHES),
-				IOCTL_INFO(PMEM_GET_FREE_SPACE),
-				IOCTL_INFO(PMEM_ALLOCATE_ALIGNED),
-		},
-};
+/* The buffer registry and capture state are shared by all of the app's
+ * threads, so the ioctl handling (and anything else touching them) is
+ * serialized.  The lock is not held across the real ioctl, so a thread
+ * blocked in the kernel (ie. in WAITTIMESTAMP) doesn't hold up the rest.
+ * It nests within a thread, since capturing() can be called with it
+ * already held.
+ */
+static pthread_mutex_t registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+static __thread int registry_depth;
 
-static int kgsl_3d0 = -1, kgsl_2d0 = -1, kgsl_2d1 = -1, pmem_gpu0 = -1, pmem_gpu1 = -1;
+static void registry_lock(void)
+{
+	if (!registry_depth++)
+		pthread_mutex_lock(&registry_mutex);
+}
 
+static void registry_unlock(void)
+{
+	if (!--registry_depth)
+		pthread_mutex_unlock(&registry_mutex);
+}
 
 static struct device_info * get_kgsl_info(int fd)
 {
@@ -119,6 +66,99 @@ static struct device_info * get_kgsl_info(int fd)
 	return NULL;
 }
 
+/* Windowed capture, so that tracing something late in a run doesn't
+ * mean paying the full logging cost from the start:
+ *
+ *   WRAP_SUBMITS=A-B       only submits A thru B (counting from 0), or
+ *                          WRAP_SUBMITS=A for a single submit
+ *   WRAP_DRAWCTXT=id       only submits from the given draw context
+ *   WRAP_TRIGGER_FILE=f    only while the file f exists (checked once
+ *                          per submit)
+ *
+ * Outside of the window nothing is printed or written to the .rd file,
+ * but buffer allocations are still tracked so the capture is complete
+ * once the window opens.  The ioctls between submits mostly aren't for
+ * any particular draw context, so WRAP_DRAWCTXT only filters submits,
+ * and in between everything is logged while in the window.
+ */
+static struct {
+	int init, active;
+	unsigned int submit;        /* # of submits so far */
+	unsigned int first, last;
+	int drawctxt;
+	const char *trigger;
+	int triggered;              /* as of the start of the last submit */
+} capture;
+
+static void capture_check_trigger(void)
+{
+	capture.triggered = !capture.trigger || !access(capture.trigger, F_OK);
+}
+
+static void capture_init(void)
+{
+	const char *str;
+	char *end;
+
+	capture.last = ~0;
+	capture.drawctxt = -1;
+
+	str = getenv("WRAP_SUBMITS");
+	if (str) {
+		capture.first = capture.last = strtoul(str, &end, 0);
+		if (*end == '-')
+			capture.last = end[1] ? strtoul(end + 1, NULL, 0) : ~0;
+	}
+
+	str = getenv("WRAP_DRAWCTXT");
+	if (str)
+		capture.drawctxt = strtoul(str, NULL, 0);
+
+	capture.trigger = getenv("WRAP_TRIGGER_FILE");
+	capture_check_trigger();
+}
+
+static int capture_window(void)
+{
+	if ((capture.submit < capture.first) || (capture.submit > capture.last))
+		return 0;
+
+	return capture.triggered;
+}
+
+/* this is also called without the registry lock, for ioctls on other
+ * fds, so whichever thread gets here first sets up the window under the
+ * lock, and the rest only read capture.active:
+ */
+static int capturing(void)
+{
+	if (!__atomic_load_n(&capture.init, __ATOMIC_ACQUIRE)) {
+		registry_lock();
+		if (!capture.init) {
+			capture_init();
+			capture.active = capture_window();
+			__atomic_store_n(&capture.init, 1, __ATOMIC_RELEASE);
+		}
+		registry_unlock();
+	}
+	return __atomic_load_n(&capture.active, __ATOMIC_RELAXED);
+}
+
+static void capture_submit_begin(struct kgsl_ringbuffer_issueibcmds *param)
+{
+	capturing();
+	capture_check_trigger();
+	__atomic_store_n(&capture.active, capture_window() &&
+			((capture.drawctxt < 0) ||
+			(param->drawctxt_id == capture.drawctxt)), __ATOMIC_RELAXED);
+}
+
+static void capture_submit_end(void)
+{
+	capture.submit++;
+	__atomic_store_n(&capture.active, capture_window(), __ATOMIC_RELAXED);
+}
+
 void
 hexdump(const void *data, int size)
 {
@@ -183,6 +223,87 @@ hexdump_dwords(const void *data, int sizedwords)
 }
 
 
+/* WRAP_IOCTL_LOG=bin writes each ioctl to the .rd file as RD_IOCTL
+ * sections instead of printing it, which is little more than a memcpy
+ * per ioctl.  cffdump --ioctls turns them back into text afterwards.
+ */
+static int binlog = -1;
+
+static int binlog_enabled(void)
+{
+	int val = __atomic_load_n(&binlog, __ATOMIC_RELAXED);
+	if (val < 0) {
+		const char *str = getenv("WRAP_IOCTL_LOG");
+		val = str && !strcmp(str, "bin");
+		__atomic_store_n(&binlog, val, __ATOMIC_RELAXED);
+	}
+	return val;
+}
+
+/* whether to print the details of what is being captured: */
+static int printing(void)
+{
+	return capturing() && !binlog_enabled();
+}
+
+static uint64_t time_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static enum rd_ioctl_dev get_ioctl_dev(struct device_info *info)
+{
+	if (info == &kgsl_3d_info)
+		return RD_IOCTL_KGSL_3D;
+	else if (info == &kgsl_2d_info)
+		return RD_IOCTL_KGSL_2D;
+	else if (info == &pmem_info)
+		return RD_IOCTL_PMEM;
+	return RD_IOCTL_UNKNOWN;
+}
+
+static void log_ioctl(struct device_info *info, int dir, int fd,
+		unsigned long int request, void *ptr, int ret)
+{
+	struct rd_ioctl hdr = {
+			.post    = (dir == _IOC_READ),
+			.fd      = fd,
+			.request = request,
+			.ret     = ret,
+	};
+	struct iovec iov[3] = { { &hdr, sizeof(hdr) } };
+	int n = 1;
+
+	hdr.dev = get_ioctl_dev(info);
+
+	if (info && (dir & _IOC_DIR(request))) {
+		hdr.argsz = _IOC_SIZE(request);
+		iov[n++] = (struct iovec){ ptr, hdr.argsz };
+	}
+
+	/* and the things the text log prints which aren't in the args: */
+	if ((hdr.dev == RD_IOCTL_KGSL_3D) || (hdr.dev == RD_IOCTL_KGSL_2D)) {
+		if ((_IOC_NR(request) == _IOC_NR(IOCTL_KGSL_RINGBUFFER_ISSUEIBCMDS)) &&
+				(dir == _IOC_WRITE)) {
+			struct kgsl_ringbuffer_issueibcmds *param = ptr;
+			hdr.extrasz = param->numibs * sizeof(struct kgsl_ibdesc);
+			iov[n++] = (struct iovec){
+				(void *)(uintptr_t)param->ibdesc_addr, hdr.extrasz };
+		} else if ((_IOC_NR(request) == _IOC_NR(IOCTL_KGSL_DEVICE_GETPROPERTY)) &&
+				(dir == _IOC_READ)) {
+			struct kgsl_device_getproperty *param = ptr;
+			hdr.extrasz = param->sizebytes;
+			iov[n++] = (struct iovec){ param->value, hdr.extrasz };
+		}
+	}
+
+	hdr.time = time_ns();
+
+	rd_write_sectionv(RD_IOCTL, iov, n);
+}
+
 static void dump_ioctl(struct device_info *info, int dir, int fd,
 		unsigned long int request, void *ptr, int ret)
 {
@@ -191,11 +312,27 @@ static void dump_ioctl(struct device_info *info, int dir, int fd,
 	char c;
 	const char *name;
 
+	if (!capturing())
+		return;
+
+	if (binlog_enabled()) {
+		log_ioctl(info, dir, fd, request, ptr, ret);
+		return;
+	}
+
 	if (dir == _IOC_READ)
 		c = '<';
 	else
 		c = '>';
 
+	if (!info) {
+		printf("%c [%4d]         : <unknown> (%08lx)", c, fd, request);
+		if (dir == _IOC_READ)
+			printf(" (%d)", ret);
+		printf("\n");
+		return;
+	}
+
 	if (info->ioctl_info[nr].name)
 		name = info->ioctl_info[nr].name;
 	else
@@ -226,31 +363,107 @@ struct buffer {
 	unsigned int gpuaddr, flags, len;
 	struct list node;
 	int munmap;
+
+	/* for lookup by address, only in the trees once the address is
+	 * known (see set_hostptr()/set_gpuaddr()):
+	 */
+	struct range host_range, gpu_range;
+
+	/* hash of the contents last written to the .rd file, and the
+	 * rd_generation() they were written in:
+	 */
+	uint64_t hash;
+	unsigned int generation;
+
+	/* for WRAP_DIRTY mode, one byte per page, set by the SIGSEGV
+	 * handler when the app writes to a protected page:
+	 */
+	volatile uint8_t *dirty;
+	int protected;
+
+	/* last IB walk that reached this buffer, see walk_ib(): */
+	unsigned int walk;
 };
 
 LIST_HEAD(buffers_of_interest);
 
+/* apps can have thousands of buffers, so lookups by address go through
+ * these rather than walking the list:
+ */
+static struct range_tree buffers_by_hostptr;
+static struct range_tree buffers_by_gpuaddr;
+
+/* The dirty tracking SIGSEGV handler looks up buffers by hostptr, and
+ * can fire in any thread, including one which already holds the
+ * registry lock.  So buffers_by_hostptr and the buffers' dirty[] and
+ * protection are also guarded by this spinlock, which is safe to take
+ * from a signal handler.  Nothing that can fault is done while holding
+ * it:
+ */
+static int dirty_spin;
+
+static void dirty_lock(void)
+{
+	while (__atomic_exchange_n(&dirty_spin, 1, __ATOMIC_ACQUIRE))
+		continue;
+}
+
+static void dirty_unlock(void)
+{
+	__atomic_store_n(&dirty_spin, 0, __ATOMIC_RELEASE);
+}
+
+static void set_hostptr(struct buffer *buf, void *hostptr)
+{
+	dirty_lock();
+	if (buf->hostptr)
+		range_remove(&buffers_by_hostptr, &buf->host_range);
+	buf->hostptr = hostptr;
+	if (buf->hostptr)
+		range_insert(&buffers_by_hostptr, &buf->host_range,
+				(uintptr_t)hostptr, buf->len);
+	dirty_unlock();
+}
+
+static void set_gpuaddr(struct buffer *buf, unsigned int gpuaddr)
+{
+	if (buf->gpuaddr)
+		range_remove(&buffers_by_gpuaddr, &buf->gpu_range);
+	buf->gpuaddr = gpuaddr;
+	if (buf->gpuaddr)
+		range_insert(&buffers_by_gpuaddr, &buf->gpu_range,
+				gpuaddr, buf->len);
+}
+
 static struct buffer * register_buffer(void *hostptr, unsigned int flags, unsigned int len)
 {
 	struct buffer *buf = calloc(1, sizeof *buf);
-	buf->hostptr = hostptr;
 	buf->flags = flags;
 	buf->len = len;
+	set_hostptr(buf, hostptr);
 	list_add(&buf->node, &buffers_of_interest);
 	return buf;
 }
 
+/* lookup by hostptr first, then by gpuaddr.  Pass NULL/0 (or (void *)-1,
+ * which never matches) to only lookup by the other:
+ */
 static struct buffer * find_buffer(void *hostptr, unsigned int gpuaddr)
 {
-	struct buffer *buf;
-	list_for_each_entry(buf, &buffers_of_interest, node) {
-		if (hostptr)
-			if ((buf->hostptr <= hostptr) && (hostptr < (buf->hostptr + buf->len)))
-				return buf;
-		if (gpuaddr)
-			if ((buf->gpuaddr <= gpuaddr) && (gpuaddr < (buf->gpuaddr + buf->len)))
-				return buf;
+	struct range *r;
+
+	if (hostptr && (hostptr != (void *)-1)) {
+		r = range_find(&buffers_by_hostptr, (uintptr_t)hostptr);
+		if (r)
+			return range_entry(r, struct buffer, host_range);
+	}
+
+	if (gpuaddr) {
+		r = range_find(&buffers_by_gpuaddr, gpuaddr);
+		if (r)
+			return range_entry(r, struct buffer, gpu_range);
 	}
+
 	return NULL;
 }
 
@@ -259,8 +472,16 @@ static void unregister_buffer(unsigned int gpuaddr)
 	struct buffer *buf = find_buffer((void *)-1, gpuaddr);
 	if (buf) {
 		list_del(&buf->node);
+		dirty_lock();
+		if (buf->hostptr)
+			range_remove(&buffers_by_hostptr, &buf->host_range);
+		dirty_unlock();
+		range_remove(&buffers_by_gpuaddr, &buf->gpu_range);
 		if (buf->munmap)
 			munmap(buf->hostptr, buf->len);
+		else if (buf->protected)
+			mprotect(buf->hostptr, buf->len, PROT_READ | PROT_WRITE);
+		free((void *)buf->dirty);
 		free(buf);
 	}
 }
@@ -284,8 +505,10 @@ static void dump_buffer(unsigned int gpuaddr)
 void dump_all_buffers(void)
 {
 	struct buffer *buf;
+	registry_lock();
 	list_for_each_entry(buf, &buffers_of_interest, node)
 		dump_buffer(buf->gpuaddr);
+	registry_unlock();
 }
 /*****************************************************************************/
 
@@ -339,13 +562,376 @@ static void log_gpuaddr(uint32_t gpuaddr, uint32_t len)
 	rd_write_section(RD_GPUADDR, sect, sizeof(sect));
 }
 
+/* Dirty tracking (opt-in, WRAP_DIRTY=1): once a buffer has been written
+ * to the .rd file it is made read-only, and the SIGSEGV handler records
+ * which pages the app writes to (and makes them writable again).  The
+ * next submit then only writes out the modified pages, as a
+ * RD_BUFFER_DELTA.  Only CPU writes are seen this way, anything written
+ * by the GPU or by the kernel (which gets EFAULT rather than a signal)
+ * into a captured buffer is missed.
+ */
+static int dirty_tracking = -1;
+static unsigned int pagesize;
+static struct sigaction old_segv_action;
+
+static void dirty_handler(int sig, siginfo_t *info, void *context)
+{
+	struct buffer *buf;
+
+	dirty_lock();
+	buf = find_buffer(info->si_addr, 0);
+	if (buf && buf->protected) {
+		unsigned int page = (info->si_addr - buf->hostptr) / pagesize;
+		buf->dirty[page] = 1;
+		mprotect(buf->hostptr + (page * pagesize), pagesize,
+				PROT_READ | PROT_WRITE);
+		dirty_unlock();
+		return;
+	}
+	dirty_unlock();
+
+	/* not one of ours, so pass it on: */
+	if (old_segv_action.sa_flags & SA_SIGINFO) {
+		old_segv_action.sa_sigaction(sig, info, context);
+	} else if ((old_segv_action.sa_handler == SIG_DFL) ||
+			(old_segv_action.sa_handler == SIG_IGN)) {
+		/* the faulting access is retried with the original action: */
+		sigaction(SIGSEGV, &old_segv_action, NULL);
+	} else {
+		old_segv_action.sa_handler(sig);
+	}
+}
+
+static int dirty_tracking_enabled(void)
+{
+	if (dirty_tracking < 0) {
+		dirty_tracking = !!getenv("WRAP_DIRTY");
+		if (dirty_tracking) {
+			struct sigaction sa;
+
+			pagesize = sysconf(_SC_PAGESIZE);
+
+			memset(&sa, 0, sizeof(sa));
+			sa.sa_sigaction = dirty_handler;
+			sa.sa_flags = SA_SIGINFO | SA_RESTART;
+			sigemptyset(&sa.sa_mask);
+			sigaction(SIGSEGV, &sa, &old_segv_action);
+		}
+	}
+	return dirty_tracking;
+}
+
+/* clear dirty[] and make the buffer read-only again, with dirty_lock()
+ * held:
+ */
+static void protect_buffer(struct buffer *buf)
+{
+	unsigned int npages = ALIGN(buf->len, pagesize) / pagesize;
+
+	if ((unsigned long)buf->hostptr & (pagesize - 1))
+		return;
+
+	memset((void *)buf->dirty, 0, npages);
+
+	if (!mprotect(buf->hostptr, buf->len, PROT_READ))
+		buf->protected = 1;
+}
+
+/* write out the pages set in changed[]: */
+static void log_buffer_delta(struct buffer *buf, const uint8_t *changed)
+{
+	unsigned int npages = ALIGN(buf->len, pagesize) / pagesize;
+	unsigned int page, nruns = 0, niov = 1;
+	uint32_t *runs = malloc(((npages + 1) / 2) * 2 * sizeof(uint32_t));
+	struct iovec *iov = malloc((2 + npages) * sizeof(*iov));
+
+	iov[0].iov_base = &nruns;
+	iov[0].iov_len  = sizeof(nruns);
+
+	/* coalesce adjacent dirty pages into runs: */
+	for (page = 0; page < npages; page++) {
+		uint32_t off, len;
+
+		if (!changed[page])
+			continue;
+
+		off = page * pagesize;
+		while ((page < npages) && changed[page])
+			page++;
+		len = min(page * pagesize, buf->len) - off;
+
+		runs[nruns * 2 + 0] = off;
+		runs[nruns * 2 + 1] = len;
+
+		iov[niov].iov_base = &runs[nruns * 2];
+		iov[niov].iov_len  = 2 * sizeof(uint32_t);
+		niov++;
+		iov[niov].iov_base = buf->hostptr + off;
+		iov[niov].iov_len  = len;
+		niov++;
+
+		nruns++;
+	}
+
+	rd_write_sectionv(RD_BUFFER_DELTA, iov, niov);
+
+	free(runs);
+	free(iov);
+}
+
+static void log_buffer_contents(struct buffer *buf)
+{
+	uint64_t hash;
+
+	log_gpuaddr(buf->gpuaddr, buf->len);
+
+	if (dirty_tracking_enabled()) {
+		unsigned int npages = ALIGN(buf->len, pagesize) / pagesize;
+		uint8_t *changed = NULL;
+
+		if (!buf->dirty)
+			buf->dirty = calloc(1, npages);
+		if (buf->protected && (buf->generation == rd_generation()))
+			changed = malloc(npages);
+
+		/* take the pages written so far and protect the buffer again
+		 * before reading it, so that anything the app writes while
+		 * it is being written out is caught by the next submit:
+		 */
+		dirty_lock();
+		if (changed)
+			memcpy(changed, (void *)buf->dirty, npages);
+		protect_buffer(buf);
+		dirty_unlock();
+
+		if (changed) {
+			log_buffer_delta(buf, changed);
+			free(changed);
+		} else {
+			rd_write_section(RD_BUFFER_CONTENTS, buf->hostptr, buf->len);
+			buf->generation = rd_generation();
+		}
+		return;
+	}
+
+	hash = rd_hash(buf->hostptr, buf->len);
+
+	/* if nothing changed since last time we wrote it, just refer back
+	 * to the previous contents:
+	 */
+	if ((buf->generation == rd_generation()) && (buf->hash == hash)) {
+		uint32_t ref[2] = { hash, hash >> 32 };
+		rd_write_section(RD_BUFFER_REF, ref, sizeof(ref));
+		return;
+	}
+
+	rd_write_section(RD_BUFFER_CONTENTS, buf->hostptr, buf->len);
+	buf->hash = hash;
+	buf->generation = rd_generation();
+}
+
+/* Rather than writing out every buffer on each submit, the submitted
+ * IBs are walked (following the same packets that cffdump decodes) to
+ * find the buffers which are actually used.  This is not a full decode,
+ * any dword in those packets that points into one of our buffers pulls
+ * in that buffer.  WRAP_ALL_BUFFERS=1 to go back to writing everything,
+ * in case something is missed.
+ */
+static int all_buffers = -1;
+
+static struct {
+	unsigned int serial;
+	struct buffer **bufs;      /* buffers reached by the current walk */
+	int count, max;
+	struct {
+		uint32_t gpuaddr, sizedwords;
+	} ibs[64];                 /* IBs already walked */
+	int nibs;
+} walk;
+
+static struct buffer * walk_mark(uint32_t gpuaddr)
+{
+	struct buffer *buf = find_buffer((void *)-1, gpuaddr);
+
+	if (!buf || !buf->hostptr)
+		return NULL;
+
+	if (buf->walk != walk.serial) {
+		buf->walk = walk.serial;
+		if (walk.count == walk.max) {
+			walk.max = walk.max ? walk.max * 2 : 64;
+			walk.bufs = realloc(walk.bufs, walk.max * sizeof(walk.bufs[0]));
+		}
+		walk.bufs[walk.count++] = buf;
+	}
+
+	return buf;
+}
+
+static void walk_mark_dwords(uint32_t *dwords, int sizedwords)
+{
+	int i;
+	/* mask off the format/type bits in the low bits of fetch consts,
+	 * texture consts have more flags but those still land in the same
+	 * page:
+	 */
+	for (i = 0; i < sizedwords; i++)
+		walk_mark(dwords[i] & ~0x3);
+}
+
+/* register writes, for the ones which hold an address: */
+static void walk_regs(uint32_t regbase, uint32_t *dwords, int sizedwords,
+		int same)
+{
+	int i;
+	for (i = 0; i < sizedwords; i++) {
+		if ((regbase + (same ? 0 : i)) == REG_RB_COPY_DEST_BASE)
+			walk_mark(dwords[i] & ~0xfff);
+	}
+}
+
+static void walk_ib(uint32_t gpuaddr, uint32_t sizedwords, int depth);
+
+static void walk_packet(uint32_t opcode, uint32_t *dwords,
+		uint32_t sizedwords, int depth)
+{
+	switch (opcode) {
+	case CP_INDIRECT_BUFFER:
+	case CP_INDIRECT_BUFFER_PFD:
+		if (sizedwords >= 2)
+			walk_ib(dwords[0], dwords[1], depth + 1);
+		break;
+	case CP_SET_CONSTANT:
+		/* fetch/texture constants: */
+		if ((sizedwords >= 1) && ((dwords[0] >> 16) == 0x1))
+			walk_mark_dwords(dwords + 1, sizedwords - 1);
+		/* registers: */
+		if ((sizedwords >= 1) && ((dwords[0] >> 16) == 0x4))
+			walk_regs((dwords[0] & 0xffff) + 0x2000, dwords + 1,
+					sizedwords - 1, 0);
+		break;
+	case CP_DRAW_INDX:
+		/* index buffer address, if indices are not immediate: */
+		if (sizedwords == 5)
+			walk_mark(dwords[3]);
+		break;
+	case CP_MEM_WRITE:
+		if (sizedwords >= 1)
+			walk_mark(dwords[0] & ~0x3);
+		break;
+	case CP_EVENT_WRITE:
+		/* timestamp events write to memory too: */
+		if (sizedwords >= 2)
+			walk_mark(dwords[1] & ~0x3);
+		break;
+	case CP_IM_LOAD:
+		walk_mark_dwords(dwords, sizedwords);
+		break;
+	}
+}
+
+static void walk_ib(uint32_t gpuaddr, uint32_t sizedwords, int depth)
+{
+	struct buffer *buf = walk_mark(gpuaddr);
+	uint32_t *dwords;
+	int i, left;
+
+	if (!buf || (depth > 8))
+		return;
+
+	/* the same IB is often called multiple times, ie. once per bin.
+	 * But if it is called with a bigger size, the rest of it still
+	 * needs walking:
+	 */
+	for (i = 0; i < walk.nibs; i++) {
+		if (walk.ibs[i].gpuaddr != gpuaddr)
+			continue;
+		if (walk.ibs[i].sizedwords >= sizedwords)
+			return;
+		walk.ibs[i].sizedwords = sizedwords;
+		break;
+	}
+	if ((i == walk.nibs) && (walk.nibs < ARRAY_SIZE(walk.ibs))) {
+		walk.ibs[walk.nibs].gpuaddr = gpuaddr;
+		walk.ibs[walk.nibs].sizedwords = sizedwords;
+		walk.nibs++;
+	}
+
+	dwords = buf->hostptr + (gpuaddr - buf->gpuaddr);
+	left = min(sizedwords, (buf->len - (gpuaddr - buf->gpuaddr)) / 4);
+
+	while (left > 0) {
+		uint32_t count;
+
+		switch (dwords[0] >> 30) {
+		case 0x0: /* type-0 */
+			count = ((dwords[0] >> 16) & 0x3fff) + 2;
+			if (count <= left)
+				walk_regs(dwords[0] & 0x7fff, dwords + 1, count - 1,
+						dwords[0] & 0x8000);
+			break;
+		case 0x1: /* type-1 */
+			count = 3;
+			if (count <= left) {
+				walk_regs(dwords[0] & 0xfff, dwords + 1, 1, 0);
+				walk_regs((dwords[0] >> 12) & 0xfff, dwords + 2, 1, 0);
+			}
+			break;
+		case 0x2: /* type-2, nop */
+			count = 1;
+			break;
+		default:  /* type-3 */
+			count = ((dwords[0] >> 16) & 0x3fff) + 2;
+			if (count <= left)
+				walk_packet((dwords[0] >> 8) & 0xff, dwords + 1,
+						count - 1, depth);
+			break;
+		}
+
+		dwords += count;
+		left -= count;
+	}
+}
+
+/* write out the buffers used by a submit: */
+static void log_submit_buffers(uint32_t gpuaddr, uint32_t sizedwords)
+{
+	int i;
+
+	if (all_buffers < 0)
+		all_buffers = !!getenv("WRAP_ALL_BUFFERS");
+
+	if (all_buffers) {
+		struct buffer *buf;
+		list_for_each_entry(buf, &buffers_of_interest, node) {
+			if (buf->hostptr)
+				log_buffer_contents(buf);
+		}
+		return;
+	}
+
+	walk.serial++;
+	walk.count = walk.nibs = 0;
+	walk_ib(gpuaddr, sizedwords, 0);
+
+	for (i = 0; i < walk.count; i++)
+		log_buffer_contents(walk.bufs[i]);
+}
+
+/* # of RD_CMDSTREAM_ADDRs written for the submit being handled: */
+static unsigned int submit_ibs;
+
 static void kgsl_ioctl_ringbuffer_issueibcmds_pre(int fd,
 		struct kgsl_ringbuffer_issueibcmds *param)
 {
 	int is2d = get_kgsl_info(fd) == &kgsl_2d_info;
 	int i;
+	int print = printing();
 	struct kgsl_ibdesc *ibdesc;
-	printf("\t\tdrawctxt_id:\t%08x\n", param->drawctxt_id);
+
+	submit_ibs = 0;
+	if (print)
+		printf("\t\tdrawctxt_id:\t%08x\n", param->drawctxt_id);
 	/*
 For z180_cmdstream_issueibcmds():
 
@@ -387,16 +973,20 @@ PACKETSIZE_STATESTREAM:
 
 so the context, restored on context switch, is the first: 320 (0x140) words
 	*/
-	printf("\t\tflags:\t\t%08x\n", param->flags);
-	printf("\t\tnumibs:\t\t%08x\n", param->numibs);
-	printf("\t\tibdesc_addr:\t%08x\n", param->ibdesc_addr);
+	if (print) {
+		printf("\t\tflags:\t\t%08x\n", param->flags);
+		printf("\t\tnumibs:\t\t%08x\n", param->numibs);
+		printf("\t\tibdesc_addr:\t%08x\n", param->ibdesc_addr);
+	}
 	ibdesc = (struct kgsl_ibdesc *)param->ibdesc_addr;
 	for (i = 0; i < param->numibs; i++) {
 		// z180_cmdstream_issueibcmds or adreno_ringbuffer_issueibcmds
-		printf("\t\tibdesc[%d].ctrl:\t\t%08x\n", i, ibdesc[i].ctrl);
-		printf("\t\tibdesc[%d].sizedwords:\t%08x\n", i, ibdesc[i].sizedwords);
-		printf("\t\tibdesc[%d].gpuaddr:\t%08x\n", i, ibdesc[i].gpuaddr);
-		printf("\t\tibdesc[%d].hostptr:\t%p\n", i, ibdesc[i].hostptr);
+		if (print) {
+			printf("\t\tibdesc[%d].ctrl:\t\t%08x\n", i, ibdesc[i].ctrl);
+			printf("\t\tibdesc[%d].sizedwords:\t%08x\n", i, ibdesc[i].sizedwords);
+			printf("\t\tibdesc[%d].gpuaddr:\t%08x\n", i, ibdesc[i].gpuaddr);
+			printf("\t\tibdesc[%d].hostptr:\t%p\n", i, ibdesc[i].hostptr);
+		}
 		if (is2d) {
 			if (ibdesc[i].sizedwords > PACKETSIZE_STATESTREAM) {
 				unsigned int len, *ptr;
@@ -408,17 +998,21 @@ so the context, restored on context switch, is the first: 320 (0x140) words
 				 * can patch up the cmdstream to jump back to the next ringbuffer
 				 * entry.
 				 */
-				printf("\t\tcontext:\n");
-				hexdump_dwords(ibdesc[i].hostptr, PACKETSIZE_STATESTREAM);
+				if (print) {
+					printf("\t\tcontext:\n");
+					hexdump_dwords(ibdesc[i].hostptr, PACKETSIZE_STATESTREAM);
+				}
 				rd_write_section(RD_CONTEXT, ibdesc[i].hostptr,
 						PACKETSIZE_STATESTREAM * sizeof(unsigned int));
 
-				printf("\t\tcmd:\n");
 				ptr = (unsigned int *)(ibdesc[i].hostptr +
 						PACKETSIZE_STATESTREAM * sizeof(unsigned int));
 				len = ptr[2] & 0xfff;
 				/* 5 is length of first packet, 2 for the two 7f000000's */
-				hexdump_dwords(ptr, len + 5 + 2);
+				if (print) {
+					printf("\t\tcmd:\n");
+					hexdump_dwords(ptr, len + 5 + 2);
+				}
 				rd_write_section(RD_CMDSTREAM, ptr,
 						(len + 5 + 2) * sizeof(unsigned int));
 				/* dump out full buffer in case I need to go back and check
@@ -426,34 +1020,32 @@ so the context, restored on context switch, is the first: 320 (0x140) words
 				 */
 				dump_buffer(ibdesc[i].gpuaddr);
 			} else {
-				printf("\t\tWARNING: INVALID CONTEXT!\n");
-				hexdump_dwords(ibdesc[i].hostptr, ibdesc[i].sizedwords);
+				if (print) {
+					printf("\t\tWARNING: INVALID CONTEXT!\n");
+					hexdump_dwords(ibdesc[i].hostptr, ibdesc[i].sizedwords);
+				}
 			}
 		} else {
 			struct buffer *buf = find_buffer(NULL, ibdesc[i].gpuaddr);
 			if (buf && buf->hostptr) {
-				struct buffer *other_buf;
 				uint32_t off = ibdesc[i].gpuaddr - buf->gpuaddr;
 				uint32_t *ptr = buf->hostptr + off;
 
-				printf("\t\tcmd:\n");
-
-				hexdump_dwords(ptr, ibdesc[i].sizedwords);
-
-				list_for_each_entry(other_buf, &buffers_of_interest, node) {
-					if (other_buf && other_buf->hostptr) {
-						log_gpuaddr(other_buf->gpuaddr, other_buf->len);
-						rd_write_section(RD_BUFFER_CONTENTS,
-								other_buf->hostptr, other_buf->len);
-					}
+				if (print) {
+					printf("\t\tcmd:\n");
+					hexdump_dwords(ptr, ibdesc[i].sizedwords);
 				}
 
+				log_submit_buffers(ibdesc[i].gpuaddr,
+						ibdesc[i].sizedwords);
+
 				/* we already dump all the buffer contents, so just need
 				 * to dump the address/size of the cmdstream:
 				 */
 				rd_write_section(RD_CMDSTREAM_ADDR, (uint32_t[2]) {
 					ibdesc[i].gpuaddr, ibdesc[i].sizedwords,
 				}, 8);
+				submit_ibs++;
 			}
 		}
 	}
@@ -477,19 +1069,6 @@ static void kgsl_ioctl_drawctxt_create_post(int fd,
 	printf("\t\tdrawctxt_id:\t%08x\n", param->drawctxt_id);
 }
 
-#define PROP_INFO(n) [n] = #n
-static const char *propnames[] = {
-		PROP_INFO(KGSL_PROP_DEVICE_INFO),
-		PROP_INFO(KGSL_PROP_DEVICE_SHADOW),
-		PROP_INFO(KGSL_PROP_DEVICE_POWER),
-		PROP_INFO(KGSL_PROP_SHMEM),
-		PROP_INFO(KGSL_PROP_SHMEM_APERTURES),
-		PROP_INFO(KGSL_PROP_MMU_ENABLE),
-		PROP_INFO(KGSL_PROP_INTERRUPT_WAITS),
-		PROP_INFO(KGSL_PROP_VERSION),
-		PROP_INFO(KGSL_PROP_GPU_RESET_STAT),
-};
-
 static void kgsl_ioctl_device_getproperty_post(int fd,
 		struct kgsl_device_getproperty *param)
 {
@@ -497,44 +1076,417 @@ static void kgsl_ioctl_device_getproperty_post(int fd,
 	hexdump(param->value, param->sizebytes);
 }
 
-static int len_from_vma(unsigned int hostptr)
+/* Shadow table of the app's mappings, kept up to date by the mmap(),
+ * munmap() and mremap() wrappers, so the length of a SHAREDMEM_FROM_VMALLOC
+ * buffer can be looked up without going to /proc/self/maps.  Mappings made
+ * from within libc (ie. by malloc()) don't go through the wrappers, so
+ * those still fall back to a snapshot of the maps file.
+ */
+static pthread_mutex_t vma_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct range_tree vmas;
+
+/* The snapshot is sorted by address (the kernel lists the mappings in
+ * order), and only read again when a lookup misses it, or when memory
+ * may have been handed back (an munmap() or mremap() by the app, or a
+ * buffer being freed), since malloc() can then reuse the addresses for
+ * mappings of a different size:
+ */
+struct maps_entry {
+	uintptr_t start, end;
+};
+static struct maps_entry *maps;
+static int nmaps, maxmaps, maps_valid;
+
+static void maps_invalidate(void)
 {
-	long long addr, endaddr, offset, inode;
-	FILE *f;
-	int ret;
+	pthread_mutex_lock(&vma_mutex);
+	maps_valid = 0;
+	pthread_mutex_unlock(&vma_mutex);
+}
+
+static uintptr_t page_align(uintptr_t len)
+{
+	static uintptr_t pagesize;
+	if (!pagesize)
+		pagesize = sysconf(_SC_PAGESIZE);
+	return (len + pagesize - 1) & ~(pagesize - 1);
+}
+
+static void vma_insert_locked(uintptr_t start, uintptr_t len)
+{
+	struct range *vma = calloc(1, sizeof(*vma));
+	range_insert(&vmas, vma, start, len);
+}
+
+/* drop [start, start+len) from the table, trimming or splitting any
+ * mappings which only partly overlap it:
+ */
+static void vma_remove_locked(uintptr_t start, uintptr_t len)
+{
+	uintptr_t end = start + len;
+	struct range *vma;
+
+	vma = range_find(&vmas, start);
+	if (vma && (vma->start < start)) {
+		uintptr_t vstart = vma->start, vend = vma->end;
+		range_remove(&vmas, vma);
+		range_insert(&vmas, vma, vstart, start - vstart);
+		if (vend > end)
+			vma_insert_locked(end, vend - end);
+	}
+
+	while ((vma = range_first(&vmas, start)) && (vma->start < end)) {
+		uintptr_t vend = vma->end;
+		range_remove(&vmas, vma);
+		if (vend > end)
+			range_insert(&vmas, vma, end, vend - end);
+		else
+			free(vma);
+	}
+}
+
+static void vma_insert(void *addr, size_t len)
+{
+	pthread_mutex_lock(&vma_mutex);
+	vma_remove_locked((uintptr_t)addr, page_align(len));
+	vma_insert_locked((uintptr_t)addr, page_align(len));
+	pthread_mutex_unlock(&vma_mutex);
+}
+
+static void vma_remove(void *addr, size_t len)
+{
+	pthread_mutex_lock(&vma_mutex);
+	vma_remove_locked((uintptr_t)addr, page_align(len));
+	maps_valid = 0;
+	pthread_mutex_unlock(&vma_mutex);
+}
+
+/* read all of /proc/self/maps in one go into the snapshot, with
+ * vma_mutex held:
+ */
+static void read_maps_locked(void)
+{
+	static char *buf;
+	static int bufsz;
+	int fd, n, len = 0;
+	char *p;
 
 	// TODO: only for debug..
 	if (0)
 		dumpfile("/proc/self/maps");
 
-	f = fopen("/proc/self/maps", "r");
+	nmaps = 0;
+	maps_valid = 1;
+
+	fd = open("/proc/self/maps", O_RDONLY);
+	if (fd < 0)
+		return;
 
 	do {
-		char c;
-		ret = fscanf(f, "%llx-%llx", &addr, &endaddr);
-		if (addr == hostptr)
-			return endaddr - addr;
-		/* find end of line.. we could do this more cleverly w/ glibc.. :-( */
-		while (((ret = fscanf(f, "%c", &c)) > 0) && (c != '\n'));
-	} while (ret > 0);
-	return -1;
+		if ((bufsz - len) < 4096) {
+			bufsz = bufsz ? bufsz * 2 : 65536;
+			buf = realloc(buf, bufsz);
+		}
+		n = read(fd, buf + len, bufsz - len - 1);
+		if (n > 0)
+			len += n;
+	} while (n > 0);
+	close(fd);
+
+	buf[len] = '\0';
+
+	for (p = buf; p && *p; p = strchr(p, '\n')) {
+		unsigned long long addr, endaddr;
+
+		if (*p == '\n')
+			p++;
+
+		addr = strtoull(p, &p, 16);
+		if (*p != '-')
+			continue;
+		endaddr = strtoull(p + 1, &p, 16);
+
+		if (nmaps == maxmaps) {
+			maxmaps = maxmaps ? maxmaps * 2 : 256;
+			maps = realloc(maps, maxmaps * sizeof(maps[0]));
+		}
+		maps[nmaps].start = addr;
+		maps[nmaps].end = endaddr;
+		nmaps++;
+	}
+}
+
+static int maps_cmp(const void *key, const void *elem)
+{
+	uintptr_t addr = *(const uintptr_t *)key;
+	const struct maps_entry *m = elem;
+
+	if (addr < m->start)
+		return -1;
+	if (addr >= m->end)
+		return 1;
+	return 0;
+}
+
+/* look up the mapping that starts at hostptr in the snapshot, reading
+ * the maps file again if it isn't in there.  With vma_mutex held:
+ */
+static int len_from_maps(unsigned int hostptr)
+{
+	uintptr_t addr = hostptr;
+	struct maps_entry *m = NULL;
+
+	if (maps_valid)
+		m = bsearch(&addr, maps, nmaps, sizeof(maps[0]), maps_cmp);
+
+	if (!m) {
+		read_maps_locked();
+		m = bsearch(&addr, maps, nmaps, sizeof(maps[0]), maps_cmp);
+	}
+
+	if (!m || (m->start != addr))
+		return -1;
+
+	return m->end - m->start;
+}
+
+static int len_from_vma(unsigned int hostptr)
+{
+	struct range *vma;
+	int len = -1;
+
+	/* an address part way into a known mapping isn't the start of one
+	 * either, so only unknown addresses need the maps file:
+	 */
+	pthread_mutex_lock(&vma_mutex);
+	vma = range_find(&vmas, hostptr);
+	if (vma)
+		len = (vma->start == hostptr) ? (vma->end - vma->start) : -1;
+	else
+		len = len_from_maps(hostptr);
+	pthread_mutex_unlock(&vma_mutex);
+
+	return len;
+}
+
+/* GPU memory footprint tracking, WRAP_MEMSTAT=n: keeps live and peak
+ * totals of the app's GPU allocations, per size class and flags, and how
+ * long they lived.  A summary is printed at exit, and a RD_MEMSTAT written
+ * every n submits (while capturing).
+ */
+#define MEMSTAT_MAX_BUCKETS 64
+
+struct mem_alloc {
+	struct range range;         /* by gpuaddr */
+	struct rd_memstat_bucket *bucket;
+	unsigned int size;
+	uint64_t time;
+};
+
+static int memstat = -1;
+static struct rd_memstat memstat_total;
+static struct rd_memstat_bucket memstat_buckets[MEMSTAT_MAX_BUCKETS];
+static struct range_tree memstat_allocs;
+
+static void memstat_summary(void);
+
+static int memstat_enabled(void)
+{
+	if (memstat < 0) {
+		const char *str = getenv("WRAP_MEMSTAT");
+		memstat = str ? atoi(str) : 0;
+		if (memstat > 0)
+			atexit(memstat_summary);
+	}
+	return memstat > 0;
+}
+
+static struct rd_memstat_bucket * memstat_bucket(unsigned int size,
+		unsigned int flags)
+{
+	struct rd_memstat_bucket *bucket;
+	unsigned int size_log2 = 12;
+	int i;
+
+	while ((size_log2 < 32) && ((1ULL << size_log2) < size))
+		size_log2++;
+
+	for (i = 0; i < memstat_total.nbuckets; i++) {
+		bucket = &memstat_buckets[i];
+		if ((bucket->size_log2 == size_log2) && (bucket->flags == flags))
+			return bucket;
+	}
+
+	/* if there are too many combinations, the last bucket is kept for
+	 * everything else:
+	 */
+	if (memstat_total.nbuckets == MEMSTAT_MAX_BUCKETS)
+		return &memstat_buckets[MEMSTAT_MAX_BUCKETS - 1];
+	if (memstat_total.nbuckets == (MEMSTAT_MAX_BUCKETS - 1)) {
+		size_log2 = 0;
+		flags = ~0;
+	}
+
+	bucket = &memstat_buckets[memstat_total.nbuckets++];
+	bucket->size_log2 = size_log2;
+	bucket->flags = flags;
+	return bucket;
+}
+
+static void memstat_alloc(unsigned int gpuaddr, unsigned int size,
+		unsigned int flags)
+{
+	struct mem_alloc *alloc;
+	struct rd_memstat_bucket *bucket;
+	int i;
+
+	if (!memstat_enabled() || !gpuaddr)
+		return;
+
+	bucket = memstat_bucket(size, flags);
+
+	alloc = calloc(1, sizeof(*alloc));
+	alloc->bucket = bucket;
+	alloc->size = size;
+	alloc->time = time_ns();
+	range_insert(&memstat_allocs, &alloc->range, gpuaddr, 1);
+
+	bucket->allocs++;
+	bucket->live++;
+	bucket->live_bytes += size;
+	if (bucket->live > bucket->peak)
+		bucket->peak = bucket->live;
+	if (bucket->live_bytes > bucket->peak_bytes)
+		bucket->peak_bytes = bucket->live_bytes;
+
+	memstat_total.allocs++;
+	memstat_total.live++;
+	memstat_total.live_bytes += size;
+	if (memstat_total.live > memstat_total.peak)
+		memstat_total.peak = memstat_total.live;
+	if (memstat_total.live_bytes > memstat_total.peak_bytes) {
+		memstat_total.peak_bytes = memstat_total.live_bytes;
+		for (i = 0; i < memstat_total.nbuckets; i++)
+			memstat_buckets[i].at_peak_bytes = memstat_buckets[i].live_bytes;
+	}
+}
+
+static void memstat_free(unsigned int gpuaddr)
+{
+	struct mem_alloc *alloc;
+	struct rd_memstat_bucket *bucket;
+	struct range *r;
+	uint64_t lifetime;
+
+	if (!memstat_enabled())
+		return;
+
+	r = range_find(&memstat_allocs, gpuaddr);
+	if (!r)
+		return;
+
+	alloc = range_entry(r, struct mem_alloc, range);
+	bucket = alloc->bucket;
+	lifetime = time_ns() - alloc->time;
+
+	bucket->frees++;
+	bucket->live--;
+	bucket->live_bytes -= alloc->size;
+	bucket->lifetime += lifetime;
+	if (lifetime > bucket->max_lifetime)
+		bucket->max_lifetime = lifetime;
+
+	memstat_total.frees++;
+	memstat_total.live--;
+	memstat_total.live_bytes -= alloc->size;
+
+	range_remove(&memstat_allocs, r);
+	free(alloc);
+}
+
+static void memstat_submit(void)
+{
+	static unsigned int submits;
+	struct iovec iov[2] = {
+			{ &memstat_total, sizeof(memstat_total) },
+			{ memstat_buckets, 0 },
+	};
+
+	if (!memstat_enabled() || (++submits % memstat) || !capturing())
+		return;
+
+	iov[1].iov_len = memstat_total.nbuckets * sizeof(memstat_buckets[0]);
+	rd_write_sectionv(RD_MEMSTAT, iov, 2);
+}
+
+static int memstat_cmp(const void *a, const void *b)
+{
+	const struct rd_memstat_bucket *x = a, *y = b;
+	return (x->peak_bytes < y->peak_bytes) - (x->peak_bytes > y->peak_bytes);
+}
+
+static void memstat_summary(void)
+{
+	struct rd_memstat_bucket sorted[MEMSTAT_MAX_BUCKETS];
+	int i, n;
+
+	registry_lock();
+
+	n = memstat_total.nbuckets;
+	memcpy(sorted, memstat_buckets, n * sizeof(sorted[0]));
+	qsort(sorted, n, sizeof(sorted[0]), memstat_cmp);
+
+	printf("memstat: %u allocs, %u frees, peak %u buffers / %"PRIu64" KB, "
+			"%u buffers / %"PRIu64" KB still live\n",
+			memstat_total.allocs, memstat_total.frees, memstat_total.peak,
+			memstat_total.peak_bytes / 1024, memstat_total.live,
+			memstat_total.live_bytes / 1024);
+	printf("memstat:     size    flags   allocs    frees   peak  peak KB  "
+			"at peak KB  avg life ms  max life ms\n");
+	for (i = 0; i < n; i++) {
+		struct rd_memstat_bucket *bucket = &sorted[i];
+		uint64_t avg = bucket->frees ? bucket->lifetime / bucket->frees : 0;
+		char size[16];
+
+		if (bucket->size_log2)
+			sprintf(size, "<=%uK", (1U << bucket->size_log2) / 1024);
+		else
+			sprintf(size, "other");
+
+		printf("memstat: %8s %08x %8u %8u %6u %8"PRIu64" %11"PRIu64" "
+				"%12.3f %12.3f\n", size, bucket->flags, bucket->allocs,
+				bucket->frees, bucket->peak, bucket->peak_bytes / 1024,
+				bucket->at_peak_bytes / 1024, avg / 1000000.0,
+				bucket->max_lifetime / 1000000.0);
+	}
+
+	registry_unlock();
 }
 
+/* length of the buffer being mapped by SHAREDMEM_FROM_VMALLOC, looked up
+ * once before the ioctl, for after it too:
+ */
+static __thread int vmalloc_len;
+
 static void kgsl_ioctl_sharedmem_from_vmalloc_pre(int fd,
 		struct kgsl_sharedmem_from_vmalloc *param)
 {
 	int len;
 
+	vmalloc_len = len_from_vma(param->hostptr);
+
 	/* just make gpuaddr == hostptr.. should make it easy to track */
-	printf("\t\tflags:\t\t%08x\n", param->flags);
-	printf("\t\thostptr:\t%08x\n", param->hostptr);
+	if (printing()) {
+		printf("\t\tflags:\t\t%08x\n", param->flags);
+		printf("\t\thostptr:\t%08x\n", param->hostptr);
+	}
 	if (param->gpuaddr) {
 		len = param->gpuaddr;
 	} else {
 		/* note: if gpuaddr not specified, need to figure out length from
 		 * vma.. that is nasty!
 		 */
-		len = len_from_vma(param->hostptr);
+		len = vmalloc_len;
 
 		/* for 2d/z180, all of the 0x5000 length buffers seem to be what
 		 * will be passed back in IOCTL_KGSL_RINGBUFFER_ISSUEIBCMDS cmds
@@ -654,24 +1606,30 @@ static void kgsl_ioctl_sharedmem_from_vmalloc_pre(int fd,
 			break;
 		}
 	}
-	printf("\t\tlen:\t\t%08x\n", len);
+	if (printing())
+		printf("\t\tlen:\t\t%08x\n", len);
 }
 
 static void kgsl_ioctl_sharedmem_from_vmalloc_post(int fd,
 		struct kgsl_sharedmem_from_vmalloc *param)
 {
 	struct buffer *buf = find_buffer((void *)param->hostptr, 0);
-	log_gpuaddr(param->gpuaddr, len_from_vma(param->hostptr));
 	if (buf)
-		buf->gpuaddr = param->gpuaddr;
-	printf("\t\tgpuaddr:\t%08x\n", param->gpuaddr);
+		set_gpuaddr(buf, param->gpuaddr);
+	if (capturing())
+		log_gpuaddr(param->gpuaddr, vmalloc_len);
+	if (printing())
+		printf("\t\tgpuaddr:\t%08x\n", param->gpuaddr);
 }
 
 static void kgsl_ioctl_sharedmem_free_pre(int fd,
 		struct kgsl_sharedmem_free *param)
 {
-	printf("\t\tgpuaddr:\t%08x\n", param->gpuaddr);
+	if (printing())
+		printf("\t\tgpuaddr:\t%08x\n", param->gpuaddr);
 	unregister_buffer(param->gpuaddr);
+	/* the app is likely to free() the memory behind it next: */
+	maps_invalidate();
 }
 
 static void kgsl_ioctl_gpumem_alloc_pre(int fd,
@@ -685,22 +1643,64 @@ static void kgsl_ioctl_gpumem_alloc_post(int fd,
 		struct kgsl_gpumem_alloc *param)
 {
 	struct buffer *buf;
-	log_gpuaddr(param->gpuaddr, param->size);
-	printf("\t\tgpuaddr:\t%08lx\n", param->gpuaddr);
+	if (capturing())
+		log_gpuaddr(param->gpuaddr, param->size);
+	if (printing())
+		printf("\t\tgpuaddr:\t%08lx\n", param->gpuaddr);
 	/* NOTE: host addr comes from mmap'ing w/ gpuaddr as offset */
 	buf = register_buffer(NULL, param->flags, param->size);
-	buf->gpuaddr = param->gpuaddr;
+	set_gpuaddr(buf, param->gpuaddr);
+}
+
+/* The RD_TS_SUBMIT and RD_TS_SUBMITTED of a submit are tied together by
+ * a serial #, kept per thread since other threads can submit while this
+ * one is in the ioctl:
+ */
+static unsigned int ts_submits;
+static __thread unsigned int ts_submit;
+
+/* for cffdump --latency, written whether or not ioctls are logged.  Only
+ * for the 3D core, since that is what cffdump decodes (2D captures are
+ * for redump):
+ */
+static void log_timestamp(int fd, enum rd_timestamp_event event,
+		uint32_t value, int ret)
+{
+	struct rd_timestamp ts = {
+			.event = event,
+			.dev   = get_ioctl_dev(get_kgsl_info(fd)),
+			.value = value,
+			.ret   = ret,
+			.time  = time_ns(),
+	};
+
+	if (fd != kgsl_3d0)
+		return;
+
+	if (event == RD_TS_SUBMIT) {
+		ts_submit = ts_submits++;
+		ts.nibs = submit_ibs;
+	}
+	if ((event == RD_TS_SUBMIT) || (event == RD_TS_SUBMITTED))
+		ts.submit = ts_submit;
+
+	rd_write_section(RD_TIMESTAMP, &ts, sizeof(ts));
 }
 
 static void kgsl_ioctl_pre(int fd, unsigned long int request, void *ptr)
 {
+	if (_IOC_NR(request) == _IOC_NR(IOCTL_KGSL_RINGBUFFER_ISSUEIBCMDS))
+		capture_submit_begin(ptr);
+
 	dump_ioctl(get_kgsl_info(fd), _IOC_WRITE, fd, request, ptr, 0);
 	switch(_IOC_NR(request)) {
 	case _IOC_NR(IOCTL_KGSL_RINGBUFFER_ISSUEIBCMDS):
-		kgsl_ioctl_ringbuffer_issueibcmds_pre(fd, ptr);
+		if (capturing())
+			kgsl_ioctl_ringbuffer_issueibcmds_pre(fd, ptr);
 		break;
 	case _IOC_NR(IOCTL_KGSL_DRAWCTXT_CREATE):
-		kgsl_ioctl_drawctxt_create_pre(fd, ptr);
+		if (printing())
+			kgsl_ioctl_drawctxt_create_pre(fd, ptr);
 		break;
 	case _IOC_NR(IOCTL_KGSL_SHAREDMEM_FROM_VMALLOC):
 		kgsl_ioctl_sharedmem_from_vmalloc_pre(fd, ptr);
@@ -709,23 +1709,59 @@ static void kgsl_ioctl_pre(int fd, unsigned long int request, void *ptr)
 		kgsl_ioctl_sharedmem_free_pre(fd, ptr);
 		break;
 	case _IOC_NR(IOCTL_KGSL_GPUMEM_ALLOC):
-		kgsl_ioctl_gpumem_alloc_pre(fd, ptr);
+		if (printing())
+			kgsl_ioctl_gpumem_alloc_pre(fd, ptr);
 		break;
 	}
+
+	/* last thing before the real ioctl: */
+	if (capturing()) {
+		switch(_IOC_NR(request)) {
+		case _IOC_NR(IOCTL_KGSL_RINGBUFFER_ISSUEIBCMDS):
+			log_timestamp(fd, RD_TS_SUBMIT, 0, 0);
+			break;
+		case _IOC_NR(IOCTL_KGSL_DEVICE_WAITTIMESTAMP):
+			log_timestamp(fd, RD_TS_WAIT, ((struct kgsl_device_waittimestamp *)
+					ptr)->timestamp, 0);
+			break;
+		}
+	}
 }
 
 static void kgsl_ioctl_post(int fd, unsigned long int request, void *ptr, int ret)
 {
+	/* first thing after the real ioctl: */
+	if (capturing()) {
+		switch(_IOC_NR(request)) {
+		case _IOC_NR(IOCTL_KGSL_RINGBUFFER_ISSUEIBCMDS):
+			log_timestamp(fd, RD_TS_SUBMITTED, ((struct kgsl_ringbuffer_issueibcmds *)
+					ptr)->timestamp, ret);
+			break;
+		case _IOC_NR(IOCTL_KGSL_DEVICE_WAITTIMESTAMP):
+			log_timestamp(fd, RD_TS_WAITED, ((struct kgsl_device_waittimestamp *)
+					ptr)->timestamp, ret);
+			break;
+		case _IOC_NR(IOCTL_KGSL_CMDSTREAM_READTIMESTAMP):
+			log_timestamp(fd, RD_TS_READ, ((struct kgsl_cmdstream_readtimestamp *)
+					ptr)->timestamp, ret);
+			break;
+		}
+	}
+
 	dump_ioctl(get_kgsl_info(fd), _IOC_READ, fd, request, ptr, ret);
 	switch(_IOC_NR(request)) {
 	case _IOC_NR(IOCTL_KGSL_RINGBUFFER_ISSUEIBCMDS):
-		kgsl_ioctl_ringbuffer_issueibcmds_post(fd, ptr);
+		if (printing())
+			kgsl_ioctl_ringbuffer_issueibcmds_post(fd, ptr);
+		capture_submit_end();
 		break;
 	case _IOC_NR(IOCTL_KGSL_DRAWCTXT_CREATE):
-		kgsl_ioctl_drawctxt_create_post(fd, ptr);
+		if (printing())
+			kgsl_ioctl_drawctxt_create_post(fd, ptr);
 		break;
 	case _IOC_NR(IOCTL_KGSL_DEVICE_GETPROPERTY):
-		kgsl_ioctl_device_getproperty_post(fd, ptr);
+		if (printing())
+			kgsl_ioctl_device_getproperty_post(fd, ptr);
 		break;
 	case _IOC_NR(IOCTL_KGSL_SHAREDMEM_FROM_VMALLOC):
 		kgsl_ioctl_sharedmem_from_vmalloc_post(fd, ptr);
@@ -734,6 +1770,26 @@ static void kgsl_ioctl_post(int fd, unsigned long int request, void *ptr, int re
 		kgsl_ioctl_gpumem_alloc_post(fd, ptr);
 		break;
 	}
+
+	if (memstat_enabled() && !ret) {
+		struct kgsl_sharedmem_from_vmalloc *vmalloc = ptr;
+		struct kgsl_gpumem_alloc *alloc = ptr;
+
+		switch(_IOC_NR(request)) {
+		case _IOC_NR(IOCTL_KGSL_RINGBUFFER_ISSUEIBCMDS):
+			memstat_submit();
+			break;
+		case _IOC_NR(IOCTL_KGSL_SHAREDMEM_FROM_VMALLOC):
+			memstat_alloc(vmalloc->gpuaddr, vmalloc_len, vmalloc->flags);
+			break;
+		case _IOC_NR(IOCTL_KGSL_GPUMEM_ALLOC):
+			memstat_alloc(alloc->gpuaddr, alloc->size, alloc->flags);
+			break;
+		case _IOC_NR(IOCTL_KGSL_SHAREDMEM_FREE):
+			memstat_free(((struct kgsl_sharedmem_free *)ptr)->gpuaddr);
+			break;
+		}
+	}
 }
 
 static void pmem_ioctl_pre(int fd, unsigned long int request, void *ptr)
@@ -766,65 +1822,122 @@ int ioctl(int fd, unsigned long int request, ...)
 		ptr = NULL;
 	}
 
+	/* ioctls on other fds are only logged, which doesn't touch the
+	 * registry, so they don't need the lock:
+	 */
+	if (!get_kgsl_info(fd) && (fd != pmem_gpu0) && (fd != pmem_gpu1)) {
+		dump_ioctl(NULL, _IOC_WRITE, fd, request, ptr, 0);
+		ret = orig_ioctl(fd, request, ptr);
+		dump_ioctl(NULL, _IOC_READ, fd, request, ptr, ret);
+		return ret;
+	}
+
+	registry_lock();
 	if (get_kgsl_info(fd))
 		kgsl_ioctl_pre(fd, request, ptr);
-	else if ((fd == pmem_gpu0) || (fd == pmem_gpu1))
-		pmem_ioctl_pre(fd, request, ptr);
 	else
-		printf("> [%4d]         : <unknown> (%08lx)\n", fd, request);
+		pmem_ioctl_pre(fd, request, ptr);
+	registry_unlock();
 
 	ret = orig_ioctl(fd, request, ptr);
 
+	registry_lock();
 	if (get_kgsl_info(fd))
 		kgsl_ioctl_post(fd, request, ptr, ret);
-	else if ((fd == pmem_gpu0) || (fd == pmem_gpu1))
-		pmem_ioctl_post(fd, request, ptr, ret);
 	else
-		printf("< [%4d]         : <unknown> (%08lx) (%d)\n", fd, request, ret);
+		pmem_ioctl_post(fd, request, ptr, ret);
+	registry_unlock();
 
 	return ret;
 }
 
 void * mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset)
 {
+	struct buffer *buf;
 	void *ret = NULL;
 	PROLOG(mmap);
 
-	if (get_kgsl_info(fd)) {
+	if (!get_kgsl_info(fd)) {
+		ret = orig_mmap(addr, length, prot, flags, fd, offset);
+		if (ret != MAP_FAILED)
+			vma_insert(ret, length);
+		return ret;
+	}
+
+	registry_lock();
+
+	if (printing()) {
 		printf("< [%4d]         : mmap: addr=%p, length=%d, prot=%x, flags=%x, offset=%08lx\n",
 				fd, addr, length, prot, flags, offset);
 	}
 
-	if (get_kgsl_info(fd)) {
-		struct buffer *buf = find_buffer(NULL, offset);
-		if (buf && buf->hostptr) {
-			buf->munmap = 0;
-			ret = buf->hostptr;
-		}
+	buf = find_buffer(NULL, offset);
+	if (buf && buf->hostptr) {
+		buf->munmap = 0;
+		ret = buf->hostptr;
 	}
 
-	if (!ret)
+	if (!ret) {
 		ret = orig_mmap(addr, length, prot, flags, fd, offset);
+		if (ret != MAP_FAILED)
+			vma_insert(ret, length);
+	}
 
-	if (get_kgsl_info(fd)) {
-		struct buffer *buf = find_buffer(NULL, offset);
-		if (buf)
-			buf->hostptr = ret;
+	buf = find_buffer(NULL, offset);
+	if (buf)
+		set_hostptr(buf, ret);
+	if (printing())
 		printf("< [%4d]         : mmap: -> (%p)\n", fd, ret);
-	}
+
+	registry_unlock();
 
 	return ret;
 }
 
 int munmap(void *addr, size_t length)
 {
-	struct buffer *buf = find_buffer(addr, 0);
+	struct buffer *buf;
+	int ret;
 	PROLOG(munmap);
 
-	if (buf) {
+	registry_lock();
+	buf = find_buffer(addr, 0);
+	if (buf)
 		buf->munmap = 1;
+	registry_unlock();
+
+	if (buf)
 		return 0;
+
+	ret = orig_munmap(addr, length);
+	if (!ret)
+		vma_remove(addr, length);
+
+	return ret;
+}
+
+#ifndef MREMAP_FIXED
+#  define MREMAP_FIXED 2
+#endif
+
+void * mremap(void *old_address, size_t old_size, size_t new_size, int flags, ...)
+{
+	void *new_address = NULL, *ret;
+	PROLOG(mremap);
+
+	if (flags & MREMAP_FIXED) {
+		va_list args;
+
+		va_start(args, flags);
+		new_address = va_arg(args, void *);
+		va_end(args);
 	}
 
-	return orig_munmap(addr, length);
+	ret = orig_mremap(old_address, old_size, new_size, flags, new_address);
+	if (ret != MAP_FAILED) {
+		vma_remove(old_address, old_size);
+		vma_insert(ret, new_size);
+	}
+
+	return ret;
 }
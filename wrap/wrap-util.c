@@ -22,8 +22,322 @@
  */
 
 #include "wrap.h"
+#include "rdz.h"
 
 static int fd = -1;
+static unsigned int serial;
+static unsigned int generation;
+
+/* WRAP_COMPRESS=lz4 to write compressed .rd files, see rdz.h: */
+static int compress = -1;
+
+/* WRAP_INDEX=1 to append a RD_INDEX of all the sections at rd_end(): */
+static int indexing = -1;
+static struct {
+	struct rd_index_entry *entries;
+	int count, max;
+	uint32_t submit, gpuaddr;
+} rd_index;
+
+/* Sections are accumulated in a per-process buffer and written out with
+ * writev(), rather than three write() syscalls per section.  The c2d2
+ * param() sections are only 12 bytes each, so a busy app otherwise ends
+ * up doing tens of thousands of tiny writes per frame.  Payloads too big
+ * to be worth copying go straight out in the same writev() as whatever
+ * is already buffered.
+ */
+#define RD_BUF_SIZE   RDZ_FRAME_SIZE
+#define RD_BUF_DIRECT (RD_BUF_SIZE / 4)
+
+static char rd_buf[RD_BUF_SIZE];
+static int rd_buf_len;
+static char rd_zbuf[RDZ_BOUND(RD_BUF_SIZE)];
+
+static struct {
+	unsigned int sections;
+	unsigned int syscalls;
+	unsigned long long bytes;
+	unsigned long long raw;      /* before compression */
+} rd_stats;
+
+/* Sections can be written from any thread (ie. a loader thread creating
+ * buffers while the render thread submits).  Without WRAP_ASYNC, the
+ * writing is serialized by rd_lock.  rd_lock also serializes starting
+ * and ending files, in either mode.
+ */
+static pthread_mutex_t rd_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* WRAP_ASYNC=block or WRAP_ASYNC=drop moves the writing (and compression)
+ * of the .rd file off of the app's threads.  Each thread copies its
+ * sections into its own single producer single consumer ring, tagged
+ * with a global sequence number, and a writer thread merges the rings
+ * back into sequence order.  So there is no lock on the app side, just
+ * an atomic increment per section.
+ *
+ * Each ring is capped at WRAP_ASYNC_MAX megabytes (default 64).  When
+ * it is full, "block" waits for the writer to catch up, while "drop"
+ * drops sections up to the end of the current submit and then writes a
+ * RD_DROPPED section, so the app's frame pacing is never affected.
+ *
+ * Only the owning thread touches a ring's head, and only the writer
+ * touches its tail.  The semaphores are just for sleeping.  The writer
+ * is only woken once RD_ASYNC_BATCH bytes are queued (or on rd_end()),
+ * and app threads only when waiting for space, so the common case is
+ * free of syscalls and context switches.
+ *
+ * Once the writer is running, the file itself and everything below
+ * rd_emit_section() (the write buffer, index and stats) belong to it.
+ * Opening and finishing the file is handed over to it too (see
+ * rd_async_call()), and sections which can't be queued are dropped
+ * rather than written from the app's thread.  Sections queued for a
+ * file which has since been finished are dropped by the writer.
+ */
+struct rd_async_rec {
+	uint32_t type;
+	uint32_t size;
+	uint32_t seq;
+	uint32_t big;                /* payload is a struct rd_async_big */
+	uint32_t serial;             /* of the file it was queued for */
+	uint32_t pad;
+};
+
+/* sections too big for the ring are handed over by reference, and the
+ * app thread waits until they are written:
+ */
+struct rd_async_big {
+	const struct iovec *iov;
+	int iovcnt;
+	sem_t done;
+};
+
+#define RD_ASYNC_WRAP  0xffffffff    /* skip to the start of the ring */
+#define RD_ASYNC_BATCH RD_BUF_SIZE
+
+struct rd_ring {
+	struct rd_ring *next;
+	uint8_t *buf;
+	uint64_t head, tail;         /* free running byte counts */
+	int waiting;
+	sem_t space;
+
+	/* app thread side of drop-and-mark: */
+	unsigned int serial;         /* of the file the drops were in */
+	int dropping;
+	uint32_t dropped;            /* since the last RD_DROPPED */
+};
+
+static int async = -1;
+static struct {
+	int drop;
+	uint64_t size;               /* of each ring */
+	struct rd_ring *rings;
+	uint32_t seq;                /* next sequence # to hand out */
+	uint32_t next;               /* next sequence # to write */
+	uint32_t total;              /* dropped in the current file */
+	int drain;
+	void (*call)(void);          /* to run on the writer, see rd_async_call() */
+	sem_t avail, drained;
+	pthread_t thread;
+} rd_async;
+
+static __thread struct rd_ring *rd_ring;
+
+volatile int*  __errno( void );
+#undef errno
+#define errno (*__errno())
+
+static void rd_writev(struct iovec *iov, int iovcnt)
+{
+	while (iovcnt > 0) {
+		int ret = writev(fd, iov, iovcnt);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			printf("error: %d (%s)\n", ret, strerror(errno));
+			printf("fd=%d, iovcnt=%d\n", fd, iovcnt);
+			/* don't try to flush again from the exit handler: */
+			rd_buf_len = 0;
+			exit(-1);
+		}
+
+		rd_stats.syscalls++;
+		rd_stats.bytes += ret;
+
+		/* skip over whatever got written, in case of a short write: */
+		while ((iovcnt > 0) && (ret >= iov->iov_len)) {
+			ret -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+	}
+}
+
+static void rd_flush(void)
+{
+	struct iovec iov[2] = {
+			{ rd_buf, rd_buf_len },
+	};
+
+	if ((fd == -1) || !rd_buf_len)
+		return;
+
+	if (compress) {
+		/* write buffer out as a single frame: */
+		uint32_t hdr[2] = { rd_buf_len, rd_buf_len | RDZ_STORED };
+		int zlen = rdz_compress(rd_buf, rd_buf_len, rd_zbuf, sizeof(rd_zbuf));
+
+		iov[1] = iov[0];
+		iov[0].iov_base = hdr;
+		iov[0].iov_len  = sizeof(hdr);
+
+		if (zlen && (zlen < rd_buf_len)) {
+			hdr[1] = zlen;
+			iov[1].iov_base = rd_zbuf;
+			iov[1].iov_len  = zlen;
+		}
+
+		rd_writev(iov, 2);
+	} else {
+		rd_writev(iov, 1);
+	}
+
+	rd_buf_len = 0;
+}
+
+static void rd_emit_section(enum rd_sect_type type, const struct iovec *iov,
+		int iovcnt);
+static int rd_async_enabled(void);
+
+static const int rd_fatal_signals[] = {
+		SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT, SIGINT, SIGTERM,
+};
+static struct sigaction rd_old_actions[ARRAY_SIZE(rd_fatal_signals)];
+
+/* the last thing before the default action kills us: a bare writev()
+ * of what is already buffered, since nothing that might allocate, print
+ * or wait on the writer thread is safe from a signal handler:
+ */
+static void rd_fatal_flush(void)
+{
+	uint32_t hdr[2] = { rd_buf_len, rd_buf_len | RDZ_STORED };
+	struct iovec iov[2] = {
+			{ hdr, sizeof(hdr) },
+			{ rd_buf, rd_buf_len },
+	};
+	struct iovec *p = compress ? &iov[0] : &iov[1];
+	int n = compress ? 2 : 1;
+
+	if ((fd == -1) || !rd_buf_len)
+		return;
+
+	while (n > 0) {
+		ssize_t ret = writev(fd, p, n);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		while ((n > 0) && (ret >= p->iov_len)) {
+			ret -= p->iov_len;
+			p++;
+			n--;
+		}
+		if (n > 0) {
+			p->iov_base = (char *)p->iov_base + ret;
+			p->iov_len -= ret;
+		}
+	}
+
+	rd_buf_len = 0;
+}
+
+static void rd_fatal_handler(int sig, siginfo_t *info, void *ctx)
+{
+	struct sigaction *old = NULL;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(rd_fatal_signals); i++)
+		if (rd_fatal_signals[i] == sig)
+			old = &rd_old_actions[i];
+	if (!old)
+		return;
+
+	/* if the app has a handler of its own, it decides what the signal
+	 * does, and we stay installed in case it comes back:
+	 */
+	if (old->sa_flags & SA_SIGINFO) {
+		old->sa_sigaction(sig, info, ctx);
+		return;
+	}
+	if (old->sa_handler == SIG_IGN)
+		return;
+	if (old->sa_handler != SIG_DFL) {
+		old->sa_handler(sig);
+		return;
+	}
+
+	/* otherwise get what we have onto disk before the default action.
+	 * But not if some thread (maybe this one) is in the middle of
+	 * writing a section, since the buffer could be half updated.  With
+	 * WRAP_ASYNC the buffer belongs to the writer thread, which we can't
+	 * stop, so whatever it hasn't written yet is lost:
+	 */
+	if ((async <= 0) && !pthread_mutex_trylock(&rd_lock)) {
+		rd_fatal_flush();
+		pthread_mutex_unlock(&rd_lock);
+	}
+
+	sigaction(sig, old, NULL);
+	raise(sig);
+}
+
+static void rd_exit(void)
+{
+	rd_end();
+}
+
+static void rd_install_handlers(void)
+{
+	static int installed = 0;
+	struct sigaction sa;
+	int i;
+
+	if (installed)
+		return;
+	installed = 1;
+
+	atexit(rd_exit);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_sigaction = rd_fatal_handler;
+	sa.sa_flags = SA_SIGINFO;
+	sigemptyset(&sa.sa_mask);
+	for (i = 0; i < ARRAY_SIZE(rd_fatal_signals); i++)
+		sigaction(rd_fatal_signals[i], &sa, &rd_old_actions[i]);
+}
+
+static void rd_end_locked(void);
+static void rd_async_call(void (*func)(void));
+
+static char rd_name[256];
+
+static void rd_open(void)
+{
+	__atomic_add_fetch(&serial, 1, __ATOMIC_SEQ_CST);
+	__atomic_add_fetch(&generation, 1, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&fd, open(rd_name, O_WRONLY| O_TRUNC | O_CREAT, 0644),
+			__ATOMIC_RELEASE);
+
+	if (compress && (fd != -1)) {
+		uint32_t magic = RDZ_MAGIC;
+		struct iovec iov = { &magic, sizeof(magic) };
+		rd_writev(&iov, 1);
+	}
+}
 
 void rd_start(const char *name, const char *fmt, ...)
 {
@@ -31,9 +345,30 @@ void rd_start(const char *name, const char *fmt, ...)
 	static int cnt = 0;
 	va_list  args;
 
-	sprintf(buf, "%s-%04d.rd", name, cnt++);
+	pthread_mutex_lock(&rd_lock);
+
+	/* finish off previous file, if any, so buffered sections don't
+	 * end up in the new one:
+	 */
+	if (fd != -1)
+		rd_end_locked();
+
+	rd_install_handlers();
+
+	sprintf(rd_name, "%s-%04d.rd", name, cnt++);
+
+	if (compress < 0) {
+		const char *str = getenv("WRAP_COMPRESS");
+		compress = str && !strcmp(str, "lz4");
+	}
+
+	if (indexing < 0)
+		indexing = !!getenv("WRAP_INDEX");
+
+	rd_async_enabled();
+	rd_async_call(rd_open);
 
-	fd = open(buf, O_WRONLY| O_TRUNC | O_CREAT, 0644);
+	pthread_mutex_unlock(&rd_lock);
 
 	va_start(args, fmt);
 	vsprintf(buf, fmt, args);
@@ -42,36 +377,556 @@ void rd_start(const char *name, const char *fmt, ...)
 	rd_write_section(RD_TEST, buf, strlen(buf));
 }
 
-void rd_end(void)
+static void rd_index_write(void)
+{
+	uint64_t offset = rd_stats.raw;
+	struct iovec iov[] = {
+			{ rd_index.entries, rd_index.count * sizeof(rd_index.entries[0]) },
+			{ &offset, sizeof(offset) },
+	};
+
+	/* don't index the index: */
+	indexing = 0;
+	rd_emit_section(RD_INDEX, &iov[0], 1);
+	rd_emit_section(RD_INDEX_OFFSET, &iov[1], 1);
+	indexing = 1;
+
+	free(rd_index.entries);
+	memset(&rd_index, 0, sizeof(rd_index));
+}
+
+/* runs on the writer thread, if there is one: */
+static void rd_finish(void)
 {
+	struct rd_ring *ring;
+	uint32_t dropped = 0;
+
+	/* drops at the very end haven't been marked yet: */
+	for (ring = rd_async.rings; ring; ring = ring->next)
+		if (__atomic_load_n(&ring->serial, __ATOMIC_RELAXED) == rd_serial())
+			dropped += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+	if (dropped) {
+		struct iovec iov = { &dropped, sizeof(dropped) };
+		rd_emit_section(RD_DROPPED, &iov, 1);
+	}
+
+	if (rd_async.total)
+		printf("rd: %u sections dropped\n", rd_async.total);
+	rd_async.total = 0;
+
+	if (indexing)
+		rd_index_write();
+
+	rd_flush();
 	close(fd);
-	fd = -1;
+	__atomic_store_n(&fd, -1, __ATOMIC_RELEASE);
+
+	printf("rd: %u sections, %llu bytes (%llu written), %u write syscalls\n",
+			rd_stats.sections, rd_stats.raw, rd_stats.bytes,
+			rd_stats.syscalls);
+	memset(&rd_stats, 0, sizeof(rd_stats));
 }
 
-volatile int*  __errno( void );
-#undef errno
-#define errno (*__errno())
+static void rd_end_locked(void)
+{
+	if (fd == -1)
+		return;
 
-static void rd_write(const void *buf, int sz)
+	rd_async_call(rd_finish);
+}
+
+void rd_end(void)
 {
-	int ret = write(fd, buf, sz);
-	if (ret < 0) {
-		printf("error: %d (%s)\n", ret, strerror(errno));
-		printf("fd=%d, buf=%p, sz=%d\n", fd, buf, sz);
-		exit(-1);
+	pthread_mutex_lock(&rd_lock);
+	rd_end_locked();
+	pthread_mutex_unlock(&rd_lock);
+}
+
+/* changes each time a new .rd file is started: */
+unsigned int rd_serial(void)
+{
+	return __atomic_load_n(&serial, __ATOMIC_ACQUIRE);
+}
+
+/* changes each time a new .rd file is started, or a section is dropped
+ * (WRAP_ASYNC=drop), so anything remembering what has already been
+ * written can tell when it needs to start over:
+ */
+unsigned int rd_generation(void)
+{
+	return __atomic_load_n(&generation, __ATOMIC_ACQUIRE);
+}
+
+static void rd_append(const void *buf, int sz)
+{
+	rd_stats.raw += sz;
+
+	if (compress) {
+		/* everything has to go through the buffer to be compressed: */
+		while (sz > 0) {
+			int n = min(sz, sizeof(rd_buf) - rd_buf_len);
+			memcpy(rd_buf + rd_buf_len, buf, n);
+			rd_buf_len += n;
+			buf += n;
+			sz -= n;
+			if (rd_buf_len == sizeof(rd_buf))
+				rd_flush();
+		}
+		return;
 	}
+
+	if ((rd_buf_len + sz) > sizeof(rd_buf)) {
+		if (sz >= RD_BUF_DIRECT) {
+			/* big payload, don't bother copying it: */
+			struct iovec iov[2] = {
+					{ rd_buf, rd_buf_len },
+					{ (void *)buf, sz },
+			};
+			rd_writev(iov, 2);
+			rd_buf_len = 0;
+			return;
+		}
+		rd_flush();
+	}
+
+	memcpy(rd_buf + rd_buf_len, buf, sz);
+	rd_buf_len += sz;
 }
 
-void rd_write_section(enum rd_sect_type type, const void *buf, int sz)
+static void rd_index_add(enum rd_sect_type type, const struct iovec *iov,
+		uint32_t sz)
 {
+	struct rd_index_entry *entry;
+
+	if (rd_index.count == rd_index.max) {
+		rd_index.max = rd_index.max ? rd_index.max * 2 : 1024;
+		rd_index.entries = realloc(rd_index.entries,
+				rd_index.max * sizeof(rd_index.entries[0]));
+	}
+
+	if ((type == RD_GPUADDR) && (iov[0].iov_len >= sizeof(uint32_t)))
+		rd_index.gpuaddr = *(uint32_t *)iov[0].iov_base;
+
+	entry = &rd_index.entries[rd_index.count++];
+	entry->type    = type;
+	entry->size    = sz;
+	entry->submit  = rd_index.submit;
+	entry->gpuaddr = rd_index.gpuaddr;
+	entry->offset  = rd_stats.raw;
+
+	if (type == RD_CMDSTREAM_ADDR)
+		rd_index.submit++;
+}
+
+static void rd_emit_section(enum rd_sect_type type, const struct iovec *iov,
+		int iovcnt)
+{
+	static const uint8_t zeros[4];
+	uint32_t hdr[2] = { type, 0 };
+	int i, pad = 0;
+
 	if (fd == -1)
 		return;
-	rd_write(&type, sizeof(type));
-	rd_write(&sz, 4);
-	rd_write(buf, sz);
+
+	rd_stats.sections++;
+
+	for (i = 0; i < iovcnt; i++)
+		hdr[1] += iov[i].iov_len;
+
+	/* nul-pad strings (and ioctl logs, whose real sizes are in their
+	 * header) out to a dword, so the sections following them stay
+	 * aligned and the tools can use them in place:
+	 */
+	switch (type) {
+	case RD_TEST:
+	case RD_CMD:
+	case RD_VERT_SHADER:
+	case RD_FRAG_SHADER:
+	case RD_IOCTL:
+		pad = -hdr[1] & 3;
+		hdr[1] += pad;
+		break;
+	default:
+		break;
+	}
+
+	if (indexing)
+		rd_index_add(type, iov, hdr[1]);
+
+	rd_append(hdr, sizeof(hdr));
+	for (i = 0; i < iovcnt; i++)
+		rd_append(iov[i].iov_base, iov[i].iov_len);
+	if (pad)
+		rd_append(zeros, pad);
+}
+
+/* sequentially consistent, so that whichever side is about to sleep
+ * sees the other's update to head/tail, or the other side sees it and
+ * wakes it up:
+ */
+static uint64_t rd_async_load(uint64_t *p)
+{
+	return __atomic_load_n(p, __ATOMIC_SEQ_CST);
+}
+
+static void rd_async_store(uint64_t *p, uint64_t val)
+{
+	__atomic_store_n(p, val, __ATOMIC_SEQ_CST);
+}
+
+/* writer side, the record at the head of a ring, if any: */
+static struct rd_async_rec * rd_async_peek(struct rd_ring *ring)
+{
+	uint64_t head = rd_async_load(&ring->head);
+
+	while (ring->tail != head) {
+		uint64_t off = ring->tail % rd_async.size;
+		struct rd_async_rec *rec = (void *)(ring->buf + off);
+
+		if (((rd_async.size - off) >= sizeof(*rec)) &&
+				(rec->type != RD_ASYNC_WRAP))
+			return rec;
+
+		rd_async_store(&ring->tail, ring->tail + rd_async.size - off);
+	}
+
+	return NULL;
+}
+
+/* writer side, emit everything currently in the rings, in sequence
+ * order:
+ */
+static void rd_async_process(void)
+{
+	int gap = 0;
+
+	for (;;) {
+		struct rd_ring *ring, *best = NULL;
+		struct rd_async_rec *rec, *min = NULL;
+
+		for (ring = __atomic_load_n(&rd_async.rings, __ATOMIC_ACQUIRE);
+				ring; ring = ring->next) {
+			rec = rd_async_peek(ring);
+			if (rec && (!min || ((int32_t)(rec->seq - min->seq) < 0))) {
+				min = rec;
+				best = ring;
+			}
+		}
+
+		if (!min)
+			break;
+
+		/* the next section in order is still being copied into some
+		 * other thread's ring, which only takes a moment.  But in case
+		 * that thread died halfway through, don't wait forever:
+		 */
+		if (((int32_t)(min->seq - rd_async.next) > 0) && (gap++ < 100000)) {
+			sched_yield();
+			continue;
+		}
+
+		if (min->big) {
+			struct rd_async_big *big = *(struct rd_async_big **)(min + 1);
+			if (min->serial == rd_serial())
+				rd_emit_section(min->type, big->iov, big->iovcnt);
+			sem_post(&big->done);
+		} else if (min->serial == rd_serial()) {
+			struct iovec iov = { min + 1, min->size };
+			rd_emit_section(min->type, &iov, 1);
+		}
+
+		rd_async.next = min->seq + 1;
+		gap = 0;
+
+		rd_async_store(&best->tail,
+				best->tail + ALIGN(sizeof(*min) + min->size, 8));
+		if (__atomic_exchange_n(&best->waiting, 0, __ATOMIC_SEQ_CST))
+			sem_post(&best->space);
+	}
+}
+
+static int rd_async_empty(void)
+{
+	struct rd_ring *ring;
+
+	for (ring = __atomic_load_n(&rd_async.rings, __ATOMIC_ACQUIRE);
+			ring; ring = ring->next)
+		if (rd_async_load(&ring->head) != ring->tail)
+			return 0;
+
+	return 1;
+}
+
+static void * rd_async_thread(void *arg)
+{
+	sigset_t set;
+
+	/* leave the signals for the app's threads: */
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	for (;;) {
+		rd_async_process();
+		if (__atomic_exchange_n(&rd_async.drain, 0, __ATOMIC_SEQ_CST)) {
+			rd_async_process();
+			if (rd_async.call)
+				rd_async.call();
+			rd_flush();
+			sem_post(&rd_async.drained);
+		}
+		if (rd_async_empty())
+			sem_wait(&rd_async.avail);
+	}
+
+	return NULL;
+}
+
+static int rd_async_enabled(void)
+{
+	if (async < 0) {
+		const char *str = getenv("WRAP_ASYNC");
+		async = 0;
+		if (str && *str) {
+			const char *max = getenv("WRAP_ASYNC_MAX");
+			rd_async.drop = !strcmp(str, "drop");
+			rd_async.size = (uint64_t)(max ? strtoul(max, NULL, 0) : 64) << 20;
+			sem_init(&rd_async.avail, 0, 0);
+			sem_init(&rd_async.drained, 0, 0);
+			async = !pthread_create(&rd_async.thread, NULL,
+					rd_async_thread, NULL);
+		}
+	}
+	return async;
+}
+
+/* wait for the writer to get everything queued so far onto disk, and
+ * then run func (if not NULL) on the writer thread, which owns the file.
+ * Without the writer, func just runs here.  Called with rd_lock held:
+ */
+static void rd_async_call(void (*func)(void))
+{
+	if ((async <= 0) || pthread_equal(pthread_self(), rd_async.thread)) {
+		if (func)
+			func();
+		else
+			rd_flush();
+		return;
+	}
+
+	rd_async.call = func;
+	__atomic_store_n(&rd_async.drain, 1, __ATOMIC_SEQ_CST);
+	sem_post(&rd_async.avail);
+	while (sem_wait(&rd_async.drained) && (errno == EINTR))
+		continue;
+	rd_async.call = NULL;
+}
+
+/* the calling thread's ring, created on first use: */
+static struct rd_ring * rd_async_ring(void)
+{
+	struct rd_ring *ring = rd_ring;
+
+	if (!ring) {
+		ring = calloc(1, sizeof(*ring));
+		ring->buf = malloc(rd_async.size);
+		if (!ring->buf) {
+			free(ring);
+			return NULL;
+		}
+		sem_init(&ring->space, 0, 0);
+
+		ring->next = __atomic_load_n(&rd_async.rings, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&rd_async.rings, &ring->next,
+				ring, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+			continue;
+
+		rd_ring = ring;
+	}
+
+	return ring;
+}
+
+/* app side, find room for n bytes in the ring, waiting for it unless
+ * dropping, and returns where to put them.  rd_async_commit() then makes
+ * them visible to the writer:
+ */
+static struct rd_async_rec * rd_async_reserve(struct rd_ring *ring,
+		uint64_t n, uint64_t *head)
+{
+	uint64_t off, skip;
+
+	for (;;) {
+		uint64_t tail = rd_async_load(&ring->tail);
+		*head = ring->head;
+		off = *head % rd_async.size;
+		skip = ((rd_async.size - off) < n) ? (rd_async.size - off) : 0;
+		if ((*head + skip + n - tail) <= rd_async.size)
+			break;
+		if (rd_async.drop)
+			return NULL;
+		__atomic_store_n(&ring->waiting, 1, __ATOMIC_SEQ_CST);
+		if (rd_async_load(&ring->tail) == tail)
+			sem_wait(&ring->space);
+	}
+
+	/* records don't wrap around the end of the ring: */
+	if (skip) {
+		if (skip >= sizeof(struct rd_async_rec))
+			((struct rd_async_rec *)(ring->buf + off))->type = RD_ASYNC_WRAP;
+		*head += skip;
+	}
+
+	return (void *)(ring->buf + (*head % rd_async.size));
+}
+
+static void rd_async_commit(struct rd_ring *ring, struct rd_async_rec *rec,
+		uint64_t head, int wake)
+{
+	uint64_t old = ring->head, tail;
+	uint64_t batch = min(RD_ASYNC_BATCH, rd_async.size / 4);
+
+	/* the sequence # is taken as late as possible, so that the writer
+	 * never has to wait long for a gap to be filled:
+	 */
+	rec->seq = __atomic_fetch_add(&rd_async.seq, 1, __ATOMIC_SEQ_CST);
+	rec->serial = ring->serial;
+
+	rd_async_store(&ring->head, head);
+
+	/* the writer only sleeps when the rings are empty, so wake it when
+	 * there is a batch worth writing:
+	 */
+	tail = rd_async_load(&ring->tail);
+	if (wake || (((old - tail) < batch) && ((head - tail) >= batch)))
+		sem_post(&rd_async.avail);
+}
+
+/* queue a section, or drop it (if dropping, or if a ring couldn't be
+ * allocated for this thread):
+ */
+static void rd_async_push(enum rd_sect_type type, const struct iovec *iov,
+		int iovcnt)
+{
+	struct rd_ring *ring = rd_async_ring();
+	struct rd_async_big big;
+	struct rd_async_rec *rec;
+	uint64_t head, n;
+	uint32_t size = 0;
+	uint8_t *p;
+	int i;
+
+	if (!ring) {
+		__atomic_add_fetch(&rd_async.total, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&generation, 1, __ATOMIC_SEQ_CST);
+		return;
+	}
+
+	for (i = 0; i < iovcnt; i++)
+		size += iov[i].iov_len;
+
+	/* drops from a previous file aren't interesting: */
+	if (ring->serial != rd_serial()) {
+		ring->serial = rd_serial();
+		ring->dropping = 0;
+		ring->dropped = 0;
+	}
+
+	/* once a section is dropped, drop the rest of the submit too, since
+	 * eg. a RD_BUFFER_CONTENTS without its RD_GPUADDR would be wrong:
+	 */
+	if (ring->dropping) {
+		ring->dropped++;
+		__atomic_add_fetch(&rd_async.total, 1, __ATOMIC_RELAXED);
+		if (type == RD_CMDSTREAM_ADDR)
+			ring->dropping = 0;
+		return;
+	}
+
+	if (ring->dropped) {
+		n = ALIGN(sizeof(*rec) + 4, 8);
+		rec = rd_async_reserve(ring, n, &head);
+		if (!rec)
+			goto drop;
+		rec->type = RD_DROPPED;
+		rec->size = 4;
+		rec->big  = 0;
+		*(uint32_t *)(rec + 1) = ring->dropped;
+		rd_async_commit(ring, rec, head + n, 0);
+		ring->dropped = 0;
+	}
+
+	n = ALIGN(sizeof(*rec) + size, 8);
+	if (n > (rd_async.size / 2)) {
+		n = ALIGN(sizeof(*rec) + sizeof(struct rd_async_big *), 8);
+		rec = rd_async_reserve(ring, n, &head);
+		if (!rec)
+			goto drop;
+		big.iov = iov;
+		big.iovcnt = iovcnt;
+		sem_init(&big.done, 0, 0);
+		rec->type = type;
+		rec->size = sizeof(struct rd_async_big *);
+		rec->big  = 1;
+		*(struct rd_async_big **)(rec + 1) = &big;
+		rd_async_commit(ring, rec, head + n, 1);
+		while (sem_wait(&big.done) && (errno == EINTR))
+			continue;
+		sem_destroy(&big.done);
+		return;
+	}
+
+	rec = rd_async_reserve(ring, n, &head);
+	if (!rec)
+		goto drop;
+
+	rec->type = type;
+	rec->size = size;
+	rec->big  = 0;
+	p = (uint8_t *)(rec + 1);
+	for (i = 0; i < iovcnt; i++) {
+		memcpy(p, iov[i].iov_base, iov[i].iov_len);
+		p += iov[i].iov_len;
+	}
+
+	rd_async_commit(ring, rec, head + n, 0);
+
+	return;
+
+drop:
+	ring->dropped++;
+	ring->dropping = (type != RD_CMDSTREAM_ADDR);
+	__atomic_add_fetch(&rd_async.total, 1, __ATOMIC_RELAXED);
+	/* whatever the app thinks was written, wasn't: */
+	__atomic_add_fetch(&generation, 1, __ATOMIC_SEQ_CST);
+}
+
+/* write a section whose payload is scattered across several buffers: */
+void rd_write_sectionv(enum rd_sect_type type, const struct iovec *iov, int iovcnt)
+{
+	if (__atomic_load_n(&fd, __ATOMIC_ACQUIRE) == -1)
+		return;
+
+	/* with the writer thread, it is the only one writing to the file: */
+	if (async > 0) {
+		rd_async_push(type, iov, iovcnt);
+		return;
+	}
+
+	pthread_mutex_lock(&rd_lock);
+	rd_emit_section(type, iov, iovcnt);
+	pthread_mutex_unlock(&rd_lock);
+}
+
+void rd_write_section(enum rd_sect_type type, const void *buf, int sz)
+{
+	struct iovec iov = { (void *)buf, sz };
+	rd_write_sectionv(type, &iov, 1);
 }
 
 
+static void *libc_dl;
+static void *libc2d2_dl;
+
 static void * _dlopen(const char *libname)
 {
 	void *dl = dlopen(libname, RTLD_LAZY);
@@ -82,16 +937,18 @@ static void * _dlopen(const char *libname)
 	return dl;
 }
 
+static void _dlopen_all(void)
+{
+	libc_dl = _dlopen("libc.so");
+	libc2d2_dl = _dlopen("libC2D2.so");
+}
+
 void * _dlsym_helper(const char *name)
 {
-	static void *libc_dl;
-	static void *libc2d2_dl;
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
 	void *func;
 
-	if (!libc_dl)
-		libc_dl = _dlopen("libc.so");
-	if (!libc2d2_dl)
-		libc2d2_dl = _dlopen("libC2D2.so");
+	pthread_once(&once, _dlopen_all);
 
 	func = dlsym(libc_dl, name);
 
@@ -34,17 +34,23 @@
 #include <string.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
+#include <signal.h>
+#include <time.h>
 #include <dlfcn.h>
 #include <fcntl.h>
 #include <inttypes.h>
 #include <pthread.h>
+#include <semaphore.h>
 #include <errno.h>
+#include <unistd.h>
 
 #include "kgsl_drm.h"
 #include "msm_kgsl.h"
 #include "android_pmem.h"
 #include "z180.h"
 #include "list.h"
+#include "range.h"
 #include "redump.h"
 
 // don't use <stdio.h> from glibc..
@@ -56,11 +62,22 @@ int printf(const char *format, ...);
 int sprintf(char *str, const char *format, ...);
 
 void * _dlsym_helper(const char *name);
+unsigned int rd_serial(void);
+unsigned int rd_generation(void);
+void rd_write_sectionv(enum rd_sect_type type, const struct iovec *iov, int iovcnt);
 
+/* The original function is looked up on first use.  Several threads can
+ * race to do that, but they all get the same answer, so it only needs to
+ * be atomic:
+ */
 #define PROLOG(func) 					\
-	static typeof(func) *orig_##func = NULL;	\
-	if (!orig_##func)				\
+	static typeof(func) *__orig_##func = NULL;	\
+	typeof(func) *orig_##func =			\
+		__atomic_load_n(&__orig_##func, __ATOMIC_ACQUIRE); \
+	if (!orig_##func) {				\
 		orig_##func = _dlsym_helper(#func);	\
+		__atomic_store_n(&__orig_##func, orig_##func, __ATOMIC_RELEASE); \
+	}
 
 
 #endif /* WRAP_H_ */